@@ -384,18 +384,14 @@ static inline void mtx_unlock(safe_spinlock_t *m)
 #define mtx_unlock_spin(a)	mtx_unlock(a)
 
 /*
- * XXX these must be changed, as we cannot sleep within the RCU.
- * Must change to proper rwlock, and then can move the definitions
- * into the main netmap.c file.
+ * Reader counters of the bridge epochs. We do not use RCU because
+ * the readers may sleep (e.g. in copyin()), see nm_bdg_sync().
  */
-#define BDG_RWLOCK_T		struct rw_semaphore
-#define BDG_RWINIT(b)		init_rwsem(&(b)->bdg_lock)
-#define BDG_RWDESTROY(b)
-#define BDG_WLOCK(b)		down_write(&(b)->bdg_lock)
-#define BDG_WUNLOCK(b)		up_write(&(b)->bdg_lock)
-#define BDG_RLOCK(b)		down_read(&(b)->bdg_lock)
-#define BDG_RUNLOCK(b)		up_read(&(b)->bdg_lock)
-#define BDG_RTRYLOCK(b)		down_read_trylock(&(b)->bdg_lock)
+#define BDG_ATOMIC_T		atomic_t
+#define BDG_ATOMIC_INC(p)	atomic_inc(p)
+#define BDG_ATOMIC_DEC(p)	atomic_dec(p)
+#define BDG_ATOMIC_READ(p)	atomic_read(p)
+#define BDG_MB()		smp_mb()
 #define BDG_SET_VAR(lval, p)	((lval) = (p))
 #define BDG_GET_VAR(lval)	(lval)
 
@@ -413,15 +409,21 @@ static inline int ilog2(uint64_t n)
 /* XXX do we need GFP_DMA for slots ?
  * Documentation/DMA-API.txt */
 
-#define contigmalloc(sz, ty, flags, a, b, pgsz, c) ({		\
+/* the domainset is just the preferred NUMA node */
+#define DOMAINSET_PREF(n)	(n)
+
+#define contigmalloc_domainset(sz, ty, ds, flags, a, b, pgsz, c) ({	\
 	unsigned int order_ =					\
 		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
-	struct page *p_ = alloc_pages(GFP_ATOMIC | __GFP_ZERO,  \
-		order_);					\
+	struct page *p_ = alloc_pages_node((ds),		\
+		GFP_ATOMIC | __GFP_ZERO, order_);		\
 	if (p_ != NULL) 					\
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
 
+#define contigmalloc(sz, ty, flags, a, b, pgsz, c)		\
+	contigmalloc_domainset(sz, ty, NUMA_NO_NODE, flags, a, b, pgsz, c)
+
 #define contigfree(va, sz, ty)					\
 	do {							\
 		unsigned int npages_ =				\
@@ -471,6 +473,7 @@ struct nm_linux_selrecord_t;
  */
 #define CTLFLAG_RD              1
 #define CTLFLAG_RW              2
+#define CTLFLAG_RDTUN           CTLFLAG_RD	/* set at module load */
 
 struct sysctl_oid;
 struct sysctl_req;
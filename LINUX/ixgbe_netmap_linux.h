@@ -505,6 +505,42 @@ out:
  * If (flags & NAF_FORCE_READ) also check for incoming packets irrespective
  * of whether or not we received an interrupt.
  */
+#if defined(NETMAP_LINUX_IXGBE_HAVE_TSIP) && !defined(NM_IXGBEVF)
+/*
+ * When the NIC timestamps all the received packets (X550 and later,
+ * with HWTSTAMP_FILTER_ALL), it appends the time of arrival to each of
+ * them and sets TSIP. Strip the timestamp from the packet and convert
+ * it to the wall clock, as ixgbe_ptp_rx_pktstamp() does.
+ */
+#define NM_IXGBE_HWTSTAMP	NAF_HWTSTAMP
+
+static inline uint64_t
+ixgbe_netmap_rx_tstamp(struct NM_IXGBE_ADAPTER *adapter,
+		struct netmap_slot *slot, void *addr, uint32_t staterr)
+{
+	struct timespec64 systime;
+	unsigned long flags;
+	__le32 regval[2];
+	uint64_t ns;
+
+	if (!(staterr & IXGBE_RXDADV_STAT_TSIP) ||
+			slot->len < IXGBE_TS_HDR_LEN)
+		return 0;
+	slot->len -= IXGBE_TS_HDR_LEN;
+	memcpy(regval, (char *)addr + slot->len, IXGBE_TS_HDR_LEN);
+	/* seconds in the upper word, nanoseconds in the lower one */
+	systime.tv_sec = le32_to_cpu(regval[1]);
+	systime.tv_nsec = le32_to_cpu(regval[0]);
+	spin_lock_irqsave(&adapter->tmreg_lock, flags);
+	ns = timecounter_cyc2time(&adapter->hw_tc, timespec64_to_ns(&systime));
+	spin_unlock_irqrestore(&adapter->tmreg_lock, flags);
+	return ns;
+}
+#else
+#define NM_IXGBE_HWTSTAMP	0
+#define ixgbe_netmap_rx_tstamp(_a, _s, _b, _st)	((void)(_b), 0)
+#endif /* NETMAP_LINUX_IXGBE_HAVE_TSIP */
+
 static int
 ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 {
@@ -557,6 +593,7 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 			uint32_t staterr;
 			u_int size = le16toh(curr->wb.upper.length);
 			uint64_t paddr;
+			void *addr;
 			struct netmap_slot *slot = &ring->slot[nm_i];
 			int complete;
 
@@ -570,9 +607,12 @@ ixgbe_netmap_rxsync(struct netmap_kring *kring, int flags)
 			slot->len = size;
 			complete = staterr & IXGBE_RXD_STAT_EOP;
 			slot->flags = complete ? 0 : NS_MOREFRAG;
-			PNMB(na, slot, &paddr);
+			addr = PNMB(na, slot, &paddr);
 			netmap_sync_map_cpu(na, (bus_dma_tag_t) na->pdev,
 					&paddr, size, NR_RX);
+			if (kring->nkr_tstamp != NULL)
+				kring->nkr_tstamp[nm_i] = ixgbe_netmap_rx_tstamp(
+						adapter, slot, addr, staterr);
 
 			nm_i = nm_next(nm_i, lim);
 			nic_i = nm_next(nic_i, lim);
@@ -873,7 +913,7 @@ ixgbe_netmap_attach(struct NM_IXGBE_ADAPTER *adapter)
 
 	na.ifp = adapter->netdev;
 	na.pdev = &adapter->pdev->dev;
-	na.na_flags = NAF_MOREFRAG;
+	na.na_flags = NAF_MOREFRAG | NM_IXGBE_HWTSTAMP;
 	na.num_tx_desc = NM_IXGBE_TX_RING(adapter, 0)->count;
 	na.num_rx_desc = NM_IXGBE_RX_RING(adapter, 0)->count;
 	na.num_tx_rings = adapter->num_tx_queues;
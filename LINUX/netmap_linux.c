@@ -83,6 +83,63 @@ nm_os_vfree(void *addr){
 	vfree(addr);
 }
 
+/*
+ * Hugepage clusters. 2 MB pages come from the buddy allocator as
+ * compound pages, 1 GB pages (beyond MAX_ORDER) from the contiguous
+ * range allocator, when available.
+ */
+void *
+nm_os_hugemalloc(size_t size, int node)
+{
+	unsigned int order = get_order(size);
+	struct page *page;
+
+	if (node < 0)
+		node = NUMA_NO_NODE;
+	if (size <= (1UL << NETMAP_HUGEPAGE_2M)) {
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP |
+				__GFP_ZERO | __GFP_NOWARN, order);
+		return page ? page_address(page) : NULL;
+	}
+#ifdef NETMAP_LINUX_HAVE_ALLOC_CONTIG_PAGES
+	page = alloc_contig_pages(size >> PAGE_SHIFT, GFP_KERNEL | __GFP_NOWARN,
+			node == NUMA_NO_NODE ? numa_node_id() : node, NULL);
+	if (page != NULL) {
+		void *va = page_address(page);
+
+		memset(va, 0, size);
+		return va;
+	}
+#endif /* NETMAP_LINUX_HAVE_ALLOC_CONTIG_PAGES */
+	return NULL;
+}
+
+void
+nm_os_hugefree(void *addr, size_t size)
+{
+	if (size <= (1UL << NETMAP_HUGEPAGE_2M)) {
+		__free_pages(virt_to_page(addr), get_order(size));
+		return;
+	}
+#ifdef NETMAP_LINUX_HAVE_ALLOC_CONTIG_PAGES
+	free_contig_range(page_to_pfn(virt_to_page(addr)),
+			size >> PAGE_SHIFT);
+#endif /* NETMAP_LINUX_HAVE_ALLOC_CONTIG_PAGES */
+}
+
+/* pools allocated as a single area, from the same allocators */
+void *
+nm_os_contigmalloc(size_t size, int node)
+{
+	return nm_os_hugemalloc(PAGE_ALIGN(size), node);
+}
+
+void
+nm_os_contigfree(void *addr, size_t size)
+{
+	nm_os_hugefree(addr, PAGE_ALIGN(size));
+}
+
 void
 nm_os_selinfo_init(NM_SELINFO_T *si)
 {
@@ -343,6 +400,20 @@ int nm_iommu_group_id(struct device *dev)
 }
 #endif /* HAVE_IOMMU */
 
+/*
+ * Returns the NUMA node the device is attached to, or -1 if unknown.
+ */
+int nm_numa_node_id(struct device *dev)
+{
+	int node;
+
+	if (!dev)
+		return -1;
+
+	node = dev_to_node(dev);
+	return node == NUMA_NO_NODE ? -1 : node;
+}
+
 /* #################### VALE OFFLOADINGS SUPPORT ################## */
 
 /* Compute and return a raw checksum over (data, len), using 'cur_sum'
@@ -420,6 +491,26 @@ nm_os_mbuf_has_seg_offld(struct mbuf *m)
 	return skb_is_gso(m);
 }
 
+u_int
+nm_os_mbuf_seg_size(struct mbuf *m)
+{
+	if (!(skb_shinfo(m)->gso_type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6)))
+		return 0;
+	return skb_shinfo(m)->gso_size;
+}
+
+/*
+ * A zerocopy skb built around a netmap buffer gets its fragments copied
+ * by skb_orphan_frags_rx() on the way to the local sockets, which is
+ * slower than copying the packet in the first place: always copy.
+ */
+struct mbuf *
+nm_os_mbuf_zcopy(struct ifnet *ifp, void *buf, u_int len,
+		void *cookie, uint32_t idx)
+{
+	return NULL;
+}
+
 #ifdef WITH_GENERIC
 /* ####################### MITIGATION SUPPORT ###################### */
 
@@ -1240,8 +1331,63 @@ linux_netmap_fault(struct vm_fault *vmf)
 	return 0;
 }
 
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+/*
+ * Hugepage-backed pools start at offsets aligned to the hugepage size
+ * (see netmap_mem_finalize_all()) and linux_netmap_get_unmapped_area()
+ * aligns the user mapping accordingly, so they can be mapped with PMDs.
+ * 1 GB pages are mapped as 2 MB PMDs.
+ */
+static vm_fault_t
+linux_netmap_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_adapter *na = priv->np_na;
+	unsigned long addr = vmf->address & HPAGE_PMD_MASK;
+	unsigned long off;
+	unsigned long pa;
+
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+	if (addr < vma->vm_start || addr + HPAGE_PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	off = (vma->vm_pgoff << PAGE_SHIFT) + (addr - vma->vm_start);
+	if ((off & ~HPAGE_PMD_MASK) ||
+	    netmap_mem_ofs_hugeshift(na->nm_mem, off) < HPAGE_PMD_SHIFT)
+		return VM_FAULT_FALLBACK;
+	pa = netmap_mem_ofstophys(na->nm_mem, off);
+	nm_prdis("huge fault off %lx -> phys addr %lx", off, pa);
+	if (pa == 0 || (pa & ~HPAGE_PMD_MASK))
+		return VM_FAULT_FALLBACK;
+	return vmf_insert_pfn_pmd(vmf, phys_to_pfn_t(pa, 0),
+			vmf->flags & FAULT_FLAG_WRITE);
+}
+
+static unsigned long
+linux_netmap_get_unmapped_area(struct file *f, unsigned long addr,
+		unsigned long len, unsigned long pgoff, unsigned long flags)
+{
+	unsigned long off = pgoff << PAGE_SHIFT;
+	unsigned long ret;
+
+	if (addr || (flags & MAP_FIXED) || len < HPAGE_PMD_SIZE)
+		return current->mm->get_unmapped_area(f, addr, len, pgoff, flags);
+	ret = current->mm->get_unmapped_area(f, 0, len + HPAGE_PMD_SIZE,
+			pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return ret;
+	/* the user address must be congruent to the offset */
+	ret += (off - ret) & (HPAGE_PMD_SIZE - 1);
+	return ret;
+}
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
+
 static struct vm_operations_struct linux_netmap_mmap_ops = {
 	.fault = linux_netmap_fault,
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+	.huge_fault = linux_netmap_huge_fault,
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
 };
 
 static int
@@ -1293,6 +1439,10 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 		 */
 		vma->vm_private_data = priv;
 		vma->vm_ops = &linux_netmap_mmap_ops;
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+		if (memflags & NETMAP_MEM_HUGE)
+			vma->vm_flags |= VM_MIXEDMAP | VM_HUGEPAGE;
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
 	}
 	return 0;
 }
@@ -1451,6 +1601,9 @@ static struct file_operations netmap_fops = {
 	.owner = THIS_MODULE,
 	.open = linux_netmap_open,
 	.mmap = linux_netmap_mmap,
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+	.get_unmapped_area = linux_netmap_get_unmapped_area,
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
 	LIN_IOCTL_NAME = linux_netmap_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = linux_netmap_compat_ioctl,
@@ -1538,7 +1691,7 @@ netmap_pernet_init(struct net *net)
 		return error;
 
 	ns->net = net;
-	ns->num_bridges = NM_BRIDGES;
+	ns->num_bridges = netmap_bridges > 0 ? netmap_bridges : 1;
 	ns->bridges = netmap_init_bridges2(ns->num_bridges);
 	if (ns->bridges == NULL) {
 		nm_bns_destroy(net, ns);
@@ -1611,6 +1764,40 @@ nm_os_ncpus(void)
 	return nr_cpu_ids;
 }
 
+/* only a hint, the caller may be migrated right after */
+u_int
+nm_os_curcpu(void)
+{
+	return raw_smp_processor_id();
+}
+
+uint64_t
+nm_os_nanotime(void)
+{
+	return ktime_get_real_ns();
+}
+
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **filp)
+{
+	struct file *f = fget(fd);
+
+	if (f == NULL)
+		return NULL;
+	if (f->f_op != &netmap_fops || f->private_data == NULL) {
+		fput(f);
+		return NULL;
+	}
+	*filp = f;
+	return f->private_data;
+}
+
+void
+nm_os_priv_put(void *filp)
+{
+	fput((struct file *)filp);
+}
+
 struct nm_kctx {
 	struct mm_struct *mm;       /* to access guest memory */
 	struct task_struct *worker; /* the kernel thread */
@@ -1623,6 +1810,10 @@ struct nm_kctx {
 
 	/* integer to manage multiple worker contexts */
 	long type;
+
+	/* see nm_os_kctx_sleep() */
+	wait_queue_head_t wq;
+	int wakeup;
 };
 
 static int
@@ -1656,6 +1847,42 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	nmk->affinity = affinity;
 }
 
+void
+nm_os_kctx_pause(int how)
+{
+	switch (how) {
+	case NM_KCTX_RELAX:
+		cpu_relax();
+		break;
+	case NM_KCTX_YIELD:
+		cond_resched();
+		break;
+	}
+}
+
+void
+nm_os_kctx_sleep(struct nm_kctx *nmk, u_int us)
+{
+	ktime_t to = ns_to_ktime((u64)us * NSEC_PER_USEC);
+	DEFINE_WAIT(wait);
+
+	/* we are on the wait queue before checking the flag, so that
+	 * a concurrent nm_os_kctx_wakeup() is not missed */
+	prepare_to_wait(&nmk->wq, &wait, TASK_INTERRUPTIBLE);
+	if (!NM_ACCESS_ONCE(nmk->wakeup) && !kthread_should_stop())
+		schedule_hrtimeout_range(&to, (u64)us * NSEC_PER_USEC / 4,
+				HRTIMER_MODE_REL);
+	finish_wait(&nmk->wq, &wait);
+	NM_ACCESS_ONCE(nmk->wakeup) = 0;
+}
+
+void
+nm_os_kctx_wakeup(struct nm_kctx *nmk)
+{
+	NM_ACCESS_ONCE(nmk->wakeup) = 1;
+	wake_up(&nmk->wq);
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, void *opaque)
 {
@@ -1670,6 +1897,7 @@ nm_os_kctx_create(struct nm_kctx_cfg *cfg, void *opaque)
 	nmk->type = cfg->type;
 	nmk->attach_user = cfg->attach_user;
 	nmk->affinity = -1;  /* unspecified */
+	init_waitqueue_head(&nmk->wq);
 
 	return nmk;
 }
@@ -264,6 +264,30 @@ nm_os_free(void *addr)
     ExFreePoolWithTag(addr, /* M_DEVBUF */ 2);
 }
 
+/* no hugepage support (see netmap_mem_pools_config()) */
+void *
+nm_os_hugemalloc(size_t size, int node)
+{
+    return NULL;
+}
+
+void
+nm_os_hugefree(void *addr, size_t size)
+{
+}
+
+/* pools are always made of separate clusters */
+void *
+nm_os_contigmalloc(size_t size, int node)
+{
+    return NULL;
+}
+
+void
+nm_os_contigfree(void *addr, size_t size)
+{
+}
+
 void *
 nm_os_realloc(void *src, size_t size, size_t oldSize)
 {
@@ -885,6 +909,14 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
     DbgPrint("bdg_mismatch_datapath unimplemented!!!\n");
 }
 
+u_int
+netmap_host_offload(struct netmap_kring *kring, struct mbuf *m,
+	u_int mss, u_int nm_i, u_int avail)
+{
+    DbgPrint("netmap_host_offload unimplemented!!!\n");
+    return 0;
+}
+
 void if_ref(struct net_device *ifp)
 {
 	/*
@@ -1016,18 +1048,57 @@ nm_os_ncpus(void)
 	return 1;  // TODO
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return 0;  // TODO, see nm_os_ncpus()
+}
+
+uint64_t
+nm_os_nanotime(void)
+{
+	LARGE_INTEGER tm;
+
+	KeQuerySystemTime(&tm); /* 100ns units since 1601 */
+	return (uint64_t)(tm.QuadPart - 116444736000000000LL) * 100;
+}
+
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **filp)
+{
+	return NULL;  // TODO, only the calling descriptor can be used
+}
+
+void
+nm_os_priv_put(void *filp)
+{
+}
+
 int
 nm_os_mbuf_has_csum_offld(struct mbuf *m)
 {
 	return 0;  // TODO
 }
 
+struct mbuf *
+nm_os_mbuf_zcopy(struct ifnet *ifp, void *buf, u_int len,
+		void *cookie, uint32_t idx)
+{
+	return NULL;  // TODO, packets are always copied
+}
+
 int
 nm_os_mbuf_has_seg_offld(struct mbuf *m)
 {
 	return 0;  // TODO
 }
 
+u_int
+nm_os_mbuf_seg_size(struct mbuf *m)
+{
+	return 0;  // TODO
+}
+
 void
 nm_os_get_module(void)
 {
@@ -1051,6 +1122,24 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	// TODO
 }
 
+void
+nm_os_kctx_pause(int how)
+{
+	// TODO
+}
+
+void
+nm_os_kctx_sleep(struct nm_kctx *nmk, u_int us)
+{
+	// TODO
+}
+
+void
+nm_os_kctx_wakeup(struct nm_kctx *nmk)
+{
+	// TODO
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, void *opaque)
 {
@@ -136,6 +136,8 @@ typedef ULONG 			vm_ooffset_t;
 #define destroy_dev(a)
 #define __user
 #define nm_iommu_group_id(dev)	0
+#define nm_numa_node_id(dev)	(-1)
+#define nm_numa_node_valid(n)	((n) == 0)
 
 
 /*
@@ -190,17 +192,14 @@ static inline void mtx_unlock(win_spinlock_t *m)
 
 
 /*
- *	READ/WRITE LOCKS DEFINITION
+ *	BRIDGE EPOCH COUNTERS
  */
 
-#define BDG_RWLOCK_T			ERESOURCE
-#define BDG_RWINIT(b)			ExInitializeResourceLite(b.bdg_lock)
-#define BDG_RWDESTROY(b)		ExDeleteResourceLite(b.bdg_lock)
-#define BDG_WLOCK(b)			ExAcquireResourceExclusiveLite(&b->bdg_lock, TRUE)
-#define BDG_WUNLOCK(b)			ExReleaseResourceLite(&b->bdg_lock)
-#define BDG_RLOCK(b)			ExAcquireResourceSharedLite(&b->bdg_lock,TRUE)
-#define BDG_RUNLOCK(b)			ExReleaseResourceLite(&b->bdg_lock)
-#define BDG_RTRYLOCK(b)			ExAcquireResourceExclusiveLite(&b->bdg_lock, FALSE)
+#define BDG_ATOMIC_T			volatile LONG
+#define BDG_ATOMIC_INC(p)		InterlockedIncrement(p)
+#define BDG_ATOMIC_DEC(p)		InterlockedDecrement(p)
+#define BDG_ATOMIC_READ(p)		(*(p))
+#define BDG_MB()			MemoryBarrier()
 #define BDG_SET_VAR(lval, p)		((lval) = (p))
 #define BDG_GET_VAR(lval)		(lval)
 
@@ -407,6 +406,9 @@ win_contigmalloc(int sz, int page_size)
 #define contigmalloc(sz, ty, flags, a, b, pgsz, c)	\
 					win_contigmalloc(sz, M_NETMAP)
 #define contigfree(va, sz, ty)		ExFreePoolWithTag(va, M_NETMAP)
+#define DOMAINSET_PREF(n)		(n)
+#define contigmalloc_domainset(sz, ty, ds, flags, a, b, pgsz, c)	\
+					win_contigmalloc(sz, M_NETMAP)
 
 #define vtophys				MmGetPhysicalAddress
 #define MALLOC_DEFINE(a,b,c)
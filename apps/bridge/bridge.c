@@ -162,6 +162,62 @@ usage(void)
 	exit(1);
 }
 
+#if defined(_WIN32) || defined(BUSYWAIT)
+#ifndef _WIN32
+static int use_batch = 1; /* sync both ports with one system call */
+#else
+static int use_batch = 0;
+#endif
+static struct nmreq_sync_entry sync_entries[NR_SYNC_BATCH_MAX];
+
+/* append the rx or tx rings bound to d to the sync_entries list */
+static u_int
+add_rings(u_int n, struct nm_desc *d, int tx)
+{
+	u_int i, first, last;
+
+	first = tx ? d->first_tx_ring : d->first_rx_ring;
+	last = tx ? d->last_tx_ring : d->last_rx_ring;
+	for (i = first; i <= last && n < NR_SYNC_BATCH_MAX; i++, n++) {
+		sync_entries[n].nr_fd = d->fd;
+		sync_entries[n].nr_ring = i;
+		sync_entries[n].nr_dir = tx ? NR_SYNC_TX : NR_SYNC_RX;
+	}
+	return n;
+}
+
+/*
+ * Sync the rings of both ports with a single NETMAP_REQ_SYNC_BATCH:
+ * for each direction, the tx rings of the destination if there are
+ * packets to forward, the rx rings of the source otherwise.
+ * Return -1 if the kernel cannot do it.
+ */
+static int
+sync_batch(struct nm_desc *pa, struct nm_desc *pb, int n0, int n1)
+{
+	struct nmreq_sync_batch req;
+	struct nmreq_header hdr;
+	u_int i, n;
+
+	n = add_rings(0, n0 ? pb : pa, n0);
+	n = add_rings(n, n1 ? pa : pb, n1);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_SYNC_BATCH;
+	hdr.nr_body = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_entries = (uintptr_t)sync_entries;
+	req.nr_count = n;
+	if (ioctl(pa->fd, NIOCCTRL, &hdr))
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (sync_entries[i].nr_error == EBADF)
+			return -1;
+	}
+	return 0;
+}
+#endif /* defined(_WIN32) || defined(BUSYWAIT) */
+
 /*
  * bridge [-v] if1 [if2]
  *
@@ -287,18 +343,20 @@ main(int argc, char **argv)
 		n0 = pkt_queued(pa, 0);
 		n1 = pkt_queued(pb, 0);
 #if defined(_WIN32) || defined(BUSYWAIT)
-		if (n0) {
-			ioctl(pollfd[1].fd, NIOCTXSYNC, NULL);
-			pollfd[1].revents = POLLOUT;
-		} else {
-			ioctl(pollfd[0].fd, NIOCRXSYNC, NULL);
+		if (use_batch && sync_batch(pa, pb, n0, n1)) {
+			D("batched sync not supported, using one ioctl per port");
+			use_batch = 0;
 		}
-		if (n1) {
-			ioctl(pollfd[0].fd, NIOCTXSYNC, NULL);
-			pollfd[0].revents = POLLOUT;
-		} else {
-			ioctl(pollfd[1].fd, NIOCRXSYNC, NULL);
+		if (!use_batch) {
+			ioctl(n0 ? pollfd[1].fd : pollfd[0].fd,
+				n0 ? NIOCTXSYNC : NIOCRXSYNC, NULL);
+			ioctl(n1 ? pollfd[0].fd : pollfd[1].fd,
+				n1 ? NIOCTXSYNC : NIOCRXSYNC, NULL);
 		}
+		if (n0)
+			pollfd[1].revents = POLLOUT;
+		if (n1)
+			pollfd[0].revents = POLLOUT;
 		ret = 1;
 #else
 		if (n0)
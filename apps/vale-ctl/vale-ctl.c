@@ -155,21 +155,33 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config, int nr_arg2)
 	case NETMAP_BDG_POLLING_ON:
 	case NETMAP_BDG_POLLING_OFF:
 		/* We reuse nmreq fields as follows:
-		 *   nr_tx_slots: 0 and non-zero indicate REG_ALL_NIC
-		 *                REG_ONE_NIC, respectively.
+		 *   nr_tx_slots: 0, 1 and 2 indicate REG_ALL_NIC,
+		 *                REG_ONE_NIC and REG_NIC_SW (shared pool),
+		 *                respectively.
 		 *   nr_rx_slots: CPU core index. This also indicates the
 		 *                first queue in the case of REG_ONE_NIC
-		 *   nr_tx_rings: (REG_ONE_NIC only) indicates the
+		 *   nr_tx_rings: (REG_ONE_NIC and REG_NIC_SW) indicates the
 		 *                number of CPU cores or the last queue
+		 *   nr_rx_rings: (optional 4th value) non-zero selects
+		 *                adaptive polling, passed in nr_arg3
 		 */
-		nmr.nr_flags |= nmr.nr_tx_slots ?
-			NR_REG_ONE_NIC : NR_REG_ALL_NIC;
+		nmr.nr_flags |= nmr.nr_tx_slots == 0 ? NR_REG_ALL_NIC :
+			nmr.nr_tx_slots == 2 ? NR_REG_NIC_SW : NR_REG_ONE_NIC;
 		nmr.nr_ringid = nmr.nr_rx_slots;
 		/* number of cores/rings */
 		if (nmr.nr_flags == NR_REG_ALL_NIC)
 			nmr.nr_arg1 = 1;
 		else
 			nmr.nr_arg1 = nmr.nr_tx_rings;
+		if (nmr_config != NULL) {
+			const char *c;
+			int fields = 1;
+
+			for (c = nmr_config; *c; c++)
+				fields += (*c == ',');
+			if (fields > 3 && nmr.nr_rx_rings)
+				nmr.nr_arg3 = 1;
+		}
 
 		error = ioctl(fd, NIOCREGIF, &nmr);
 		if (!error)
@@ -196,6 +208,287 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config, int nr_arg2)
 	return error;
 }
 
+/*
+ * Show the forwarding table of a bridge. If config is not NULL
+ * ("buckets[,ageing]") or flush is set, reconfigure it first.
+ */
+static int
+fdb_ctl(const char *name, const char *config, int flush)
+{
+	struct nmreq_header hdr;
+	struct nmreq_vale_fdb req;
+	int error = 0;
+	int fd = open("/dev/netmap", O_RDWR);
+
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	if (config != NULL || flush) {
+		bzero(&req, sizeof(req));
+		if (config != NULL) {
+			char *ageing;
+
+			req.nr_buckets = strtoul(config, &ageing, 0);
+			if (*ageing == ',') {
+				req.nr_ageing = strtoul(ageing + 1, NULL, 0);
+				if (req.nr_ageing == 0)
+					req.nr_flags |= NR_VALE_FDB_NO_AGEING;
+			}
+		}
+		if (flush)
+			req.nr_flags |= NR_VALE_FDB_FLUSH;
+		hdr.nr_reqtype = NETMAP_REQ_VALE_FDB_SET;
+		error = ioctl(fd, NIOCCTRL, &hdr);
+		if (error) {
+			perror(name);
+			goto out;
+		}
+	}
+
+	bzero(&req, sizeof(req));
+	hdr.nr_reqtype = NETMAP_REQ_VALE_FDB_GET;
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error) {
+		perror(name);
+		goto out;
+	}
+	D("%s: %u buckets x %u ways, ageing %us, %u entries, %u groups",
+		name, req.nr_buckets, req.nr_ways, req.nr_ageing,
+		req.nr_entries, req.nr_groups);
+	D("hits %" PRIu64 " misses %" PRIu64 " learned %" PRIu64
+		" evictions %" PRIu64 " expired %" PRIu64,
+		req.nr_hits, req.nr_misses, req.nr_learned,
+		req.nr_evictions, req.nr_expired);
+out:
+	close(fd);
+	return error;
+}
+
+static int
+port_ctl(const char *name, const char *config)
+{
+	struct nmreq_header hdr;
+	struct nmreq_vale_port req;
+	int error = 0;
+	int fd = open("/dev/netmap", O_RDWR);
+
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	if (config != NULL) {
+		static const uint32_t flags[] = { NR_VALE_PORT_RXHASH,
+			NR_VALE_PORT_ZCOPY, NR_VALE_PORT_FAIR };
+		const char *p = config;
+		char *end;
+		u_int i;
+
+		bzero(&req, sizeof(req));
+		/* x,y,z,w: rxhash, zcopy, fair, weight */
+		for (i = 0; i < 4; i++) {
+			u_long v = strtoul(p, &end, 0);
+
+			if (i < 3 && v)
+				req.nr_flags |= flags[i];
+			else if (i == 3)
+				req.nr_weight = v;
+			if (*end != ',')
+				break;
+			p = end + 1;
+		}
+		hdr.nr_reqtype = NETMAP_REQ_VALE_PORT_SET;
+		error = ioctl(fd, NIOCCTRL, &hdr);
+		if (error) {
+			perror(name);
+			goto out;
+		}
+	}
+
+	bzero(&req, sizeof(req));
+	hdr.nr_reqtype = NETMAP_REQ_VALE_PORT_GET;
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error) {
+		perror(name);
+		goto out;
+	}
+	D("%s: %u rx rings, rx hash %s, zero-copy %s, fair %s, weight %u",
+		name, req.nr_rx_rings,
+		(req.nr_flags & NR_VALE_PORT_RXHASH) ? "on" : "off",
+		(req.nr_flags & NR_VALE_PORT_ZCOPY) ? "on" : "off",
+		(req.nr_flags & NR_VALE_PORT_FAIR) ? "on" : "off",
+		req.nr_weight);
+out:
+	close(fd);
+	return error;
+}
+
+static int
+stats_ctl(const char *name)
+{
+	struct nmreq_header hdr;
+	struct nmreq_vale_stats req;
+	u_int r = 0;
+	int error = 0;
+	int fd = open("/dev/netmap", O_RDWR);
+
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_VALE_STATS_GET;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	do {
+		bzero(&req, sizeof(req));
+		req.nr_ring_id = r;
+		error = ioctl(fd, NIOCCTRL, &hdr);
+		if (error) {
+			perror(name);
+			break;
+		}
+		if (r < req.nr_tx_rings)
+			D("%s tx %u: %llu pkts %llu bytes, drops: %llu lookup "
+			    "%llu down %llu nospace, %llu retries, %llu bcast",
+			    name, r,
+			    (unsigned long long)req.nr_tx_pkts,
+			    (unsigned long long)req.nr_tx_bytes,
+			    (unsigned long long)req.nr_drop_lookup,
+			    (unsigned long long)req.nr_drop_down,
+			    (unsigned long long)req.nr_drop_nospace,
+			    (unsigned long long)req.nr_retries,
+			    (unsigned long long)req.nr_bcast);
+		if (r < req.nr_rx_rings)
+			D("%s rx %u: %llu pkts %llu bytes", name, r,
+			    (unsigned long long)req.nr_rx_pkts,
+			    (unsigned long long)req.nr_rx_bytes);
+		r++;
+	} while (r < req.nr_tx_rings || r < req.nr_rx_rings);
+	close(fd);
+	return error;
+}
+
+static int
+rules_ctl(const char *name)
+{
+	static const char *actions[] = { "learn", "fwd", "drop", "bcast" };
+	struct nmreq_header hdr;
+	struct nmreq_vale_rules req;
+	struct nmreq_vale_rule *rules = NULL;
+	u_int i;
+	int error = 0;
+	int fd = open("/dev/netmap", O_RDWR);
+
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_VALE_RULES_GET;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	/* get the size of the table, then the rules */
+	bzero(&req, sizeof(req));
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error || req.nr_count == 0)
+		goto out;
+	rules = calloc(req.nr_count, sizeof(*rules));
+	if (rules == NULL) {
+		error = -1;
+		goto out;
+	}
+	req.nr_rules = (uintptr_t)rules;
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error)
+		goto out;
+	for (i = 0; i < req.nr_count; i++) {
+		struct nmreq_vale_rule *r = rules + i;
+
+		D("%s rule %u: fields 0x%x action %s port %u ring %u, %llu hits",
+		    name, i, r->nr_fields,
+		    r->nr_action < 4 ? actions[r->nr_action] : "?",
+		    r->nr_out_port, r->nr_out_ring,
+		    (unsigned long long)r->nr_hits);
+	}
+out:
+	if (error)
+		perror(name);
+	else
+		D("%s: %u rules (max %u)", name, req.nr_count, req.nr_max);
+	free(rules);
+	close(fd);
+	return error;
+}
+
+/* show the usage of the memory pools of a port, or of a memid */
+static int
+pools_ctl(const char *name)
+{
+	static const char *pools[] = { "if", "ring", "buf" };
+	struct nmreq_header hdr;
+	struct nmreq_pools_stats req;
+	struct nmreq_pool_stats *ps[] =
+		{ &req.nr_if_pool, &req.nr_ring_pool, &req.nr_buf_pool };
+	int i, error;
+	int fd = open("/dev/netmap", O_RDWR);
+
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+
+	bzero(&hdr, sizeof(hdr));
+	bzero(&req, sizeof(req));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_STATS_GET;
+	if (name[strspn(name, "0123456789")] == '\0')
+		req.nr_mem_id = atoi(name);
+	else
+		strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error) {
+		perror(name);
+		close(fd);
+		return error;
+	}
+	D("memid %u: %u users, %llu extra buffers, %llu leaked buffers",
+	    req.nr_mem_id, req.nr_users,
+	    (unsigned long long)req.nr_extra_bufs,
+	    (unsigned long long)req.nr_leaked);
+	for (i = 0; i < 3; i++)
+		D("%s pool: %u objects, %u free, "
+		    "%u high-water, %llu failures", pools[i],
+		    ps[i]->nr_objtotal, ps[i]->nr_objfree,
+		    ps[i]->nr_hiwat,
+		    (unsigned long long)ps[i]->nr_failures);
+	if (hdr.nr_name[0] != '\0')
+		D("%s: %u buffers in the rings, %u extra buffers", name,
+		    req.nr_port_ring_bufs, req.nr_port_extra_bufs);
+	close(fd);
+	return 0;
+}
+
 static void
 usage(int errcode)
 {
@@ -210,12 +503,25 @@ usage(int errcode)
 	    "\t-r interface	interface name to be deleted\n"
 	    "\t-l list all or specified bridge's interfaces (default)\n"
 	    "\t-C string ring/slot setting of an interface creating by -n\n"
-	    "\t-p interface start polling. Additional -C x,y,z configures\n"
-	    "\t\t x: 0 (REG_ALL_NIC) or 1 (REG_ONE_NIC),\n"
-	    "\t\t y: CPU core id for ALL_NIC and core/ring for ONE_NIC\n"
-	    "\t\t z: (ONE_NIC only) num of total cores/rings\n"
+	    "\t-p interface start polling. Additional -C x,y,z,w configures\n"
+	    "\t\t x: 0 (REG_ALL_NIC), 1 (REG_ONE_NIC) or 2 (shared pool),\n"
+	    "\t\t y: CPU core id for ALL_NIC and core/ring for ONE_NIC,\n"
+	    "\t\t    first core of the pool for shared\n"
+	    "\t\t z: (ONE_NIC and shared) num of total cores/rings\n"
+	    "\t\t w: 1 to back off and sleep on interrupts when idle\n"
 	    "\t-P interface stop polling\n"
-	    "\t-m memid to use when creating a new interface\n");
+	    "\t-m memid to use when creating a new interface\n"
+	    "\t-f bridge show the forwarding table. Additional -C x,y\n"
+	    "\t\t x: number of buckets, y: ageing time in seconds\n"
+	    "\t-F bridge flush the forwarding table\n"
+	    "\t-s interface show the port configuration. Additional -C x,y,z,w\n"
+	    "\t\t x: 1 to spread the flows over the rx rings, 0 not to\n"
+	    "\t\t y: 1 to swap buffers with ports on the same memid\n"
+	    "\t\t z: 1 to share the rx rings fairly among the senders\n"
+	    "\t\t w: weight of the port as a sender (1-256)\n"
+	    "\t-S interface show the forwarding counters of each ring\n"
+	    "\t-R bridge show the classifier rules and their hits\n"
+	    "\t-M interface|memid show the usage of the memory pools\n");
 	exit(errcode);
 }
 
@@ -224,9 +530,9 @@ main(int argc, char *argv[])
 {
 	int ch, nr_cmd = 0, nr_arg = 0;
 	char *name = NULL, *nmr_config = NULL;
-	int nr_arg2 = 0;
+	int nr_arg2 = 0, fdb = 0, port = 0;
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:f:F:s:S:R:M:")) != -1) {
 		if (ch != 'C' && ch != 'm')
 			name = optarg; /* default */
 		switch (ch) {
@@ -268,12 +574,32 @@ main(int argc, char *argv[])
 		case 'm':
 			nr_arg2 = atoi(optarg);
 			break;
+		case 'f':
+		case 'F':
+			fdb = ch;
+			break;
+		case 's':
+		case 'S':
+		case 'R':
+		case 'M':
+			port = ch;
+			break;
 		}
 	}
 	if (optind != argc) {
 		// fprintf(stderr, "optind %d argc %d\n", optind, argc);
 		usage(-1);
 	}
+	if (fdb)
+		return fdb_ctl(name, nmr_config, fdb == 'F') ? 1 : 0;
+	if (port == 'S')
+		return stats_ctl(name) ? 1 : 0;
+	if (port == 'R')
+		return rules_ctl(name) ? 1 : 0;
+	if (port == 'M')
+		return pools_ctl(name) ? 1 : 0;
+	if (port)
+		return port_ctl(name, nmr_config) ? 1 : 0;
 	if (argc == 1) {
 		nr_cmd = NETMAP_BDG_LIST;
 		name = NULL;
@@ -527,6 +527,10 @@ int netmap_generic_rings = 1;
 /* Non-zero to enable checksum offloading in NIC drivers */
 int netmap_generic_hwcsum = 0;
 
+/* Buffers of each allocator that can be lent to the host stack by
+ * netmap_grab_packets() instead of being copied, 0 to always copy. */
+int netmap_host_zcopy = 0;
+
 /* Non-zero if ptnet devices are allowed to use virtio-net headers. */
 int ptnet_vnet_hdr = 1;
 
@@ -553,6 +557,8 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, txsync_retry, CTLFLAG_RW,
 
 SYSCTL_INT(_dev_netmap, OID_AUTO, fwd, CTLFLAG_RW, &netmap_fwd, 0,
 		"Force NR_FORWARD mode");
+SYSCTL_INT(_dev_netmap, OID_AUTO, host_zcopy, CTLFLAG_RW, &netmap_host_zcopy, 0,
+		"Buffers that can be passed to the host stack without a copy");
 SYSCTL_INT(_dev_netmap, OID_AUTO, admode, CTLFLAG_RW, &netmap_admode, 0,
 		"Adapter mode. 0 selects the best option available,"
 		"1 forces native adapter, 2 forces emulated adapter");
@@ -1116,8 +1122,21 @@ netmap_dtor(void *data)
  * into mbufs and we are done. The host --> NIC side is slightly
  * harder because there might not be room in the tx ring so it
  * might take a while before releasing the buffer.
+ *
+ * With the netmap_host_zcopy sysctl, packets going to the host stack
+ * are not copied into the mbufs: the netmap buffer itself is lent to the
+ * stack, and the slot gets a fresh one (see netmap_mem_bufs_lend()).
+ * The buffers are lent in batches of up to NM_HOST_LEND_BATCH slots.
+ * This is only available where the OS can wrap a netmap buffer in an
+ * mbuf (NM_OS_MBUF_ZCOPY), elsewhere the sysctl is ignored.
+ * Packets coming from the host stack are always copied, since the
+ * application can only see the buffers of the netmap memory region.
  */
 
+/* shorter packets are cheaper to copy than to lend */
+#define NM_HOST_ZCOPY_MIN	256
+#define NM_HOST_LEND_BATCH	32
+
 
 /*
  * Pass a whole queue of mbufs to the host stack as coming from 'dst'
@@ -1145,9 +1164,50 @@ netmap_send_up(struct ifnet *dst, struct mbq *q)
 }
 
 
+/*
+ * Put the packets of n slots into q, in order: the buffers that can be
+ * lent to the host stack are lent all together, the others are copied.
+ * Return nonzero in the unlikely event of an mbuf shortage, after
+ * dropping the packets that could not be copied.
+ */
+static int
+netmap_grab_batch(struct netmap_adapter *na, struct mbq *q,
+		struct netmap_slot **slot, u_int n)
+{
+	struct mbuf *m[NM_HOST_LEND_BATCH];
+	u_int i, lend = 0;
+	int error = 0;
+
+	if (NM_OS_MBUF_ZCOPY && netmap_host_zcopy) {
+		struct netmap_slot *ls[NM_HOST_LEND_BATCH];
+
+		for (i = 0; i < n; i++) {
+			ls[i] = slot[i]->len >= NM_HOST_ZCOPY_MIN ? slot[i] : NULL;
+			lend += ls[i] != NULL;
+		}
+		if (lend)
+			netmap_mem_bufs_lend(na, ls, m, n);
+	}
+	if (!lend)
+		bzero(m, n * sizeof(m[0]));
+	for (i = 0; i < n; i++) {
+		/* XXX TODO: adapt to the case of a multisegment packet */
+		if (m[i] == NULL && !error)
+			m[i] = m_devget(NMB(na, slot[i]), slot[i]->len, 0,
+					na->ifp, NULL);
+		if (m[i] == NULL) {
+			error = ENOMEM;
+			continue;
+		}
+		mbq_enqueue(q, m[i]);
+	}
+	return error;
+}
+
 /*
  * Scan the buffers from hwcur to ring->head, and put a copy of those
- * marked NS_FORWARD (or all of them if forced) into a queue of mbufs.
+ * marked NS_FORWARD (or all of them if forced) into a queue of mbufs,
+ * or the buffers themselves if they can be lent to the host stack.
  * Drop remaining packets in the unlikely event
  * of an mbuf shortage.
  */
@@ -1156,11 +1216,11 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 {
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
-	u_int n;
+	u_int n, nb = 0;
 	struct netmap_adapter *na = kring->na;
+	struct netmap_slot *batch[NM_HOST_LEND_BATCH];
 
 	for (n = kring->nr_hwcur; n != head; n = nm_next(n, lim)) {
-		struct mbuf *m;
 		struct netmap_slot *slot = &kring->ring->slot[n];
 
 		if ((slot->flags & NS_FORWARD) == 0 && !force)
@@ -1170,13 +1230,15 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 			continue;
 		}
 		slot->flags &= ~NS_FORWARD; // XXX needed ?
-		/* XXX TODO: adapt to the case of a multisegment packet */
-		m = m_devget(NMB(na, slot), slot->len, 0, na->ifp, NULL);
-
-		if (m == NULL)
-			break;
-		mbq_enqueue(q, m);
+		batch[nb++] = slot;
+		if (nb < NM_HOST_LEND_BATCH)
+			continue;
+		if (netmap_grab_batch(na, q, batch, nb))
+			return;
+		nb = 0;
 	}
+	if (nb)
+		netmap_grab_batch(na, q, batch, nb);
 }
 
 static inline int
@@ -1293,7 +1355,8 @@ netmap_txsync_to_host(struct netmap_kring *kring, int flags)
 
 /*
  * rxsync backend for packets coming from the host stack.
- * They have been put in kring->rx_queue by netmap_transmit().
+ * They have been pushed on kring->rx_queue by netmap_transmit(),
+ * without taking the lock.
  * We protect access to the kring using kring->rx_queue.lock
  *
  * also moves to the nic hw rings any packet the user has marked
@@ -1315,7 +1378,9 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 
 	mbq_lock(q);
 
-	/* First part: import newly received packets */
+	/* First part: import newly received packets, including the ones
+	 * that netmap_transmit() left on the lock-free side of the queue */
+	mbq_mpsc_drain(q);
 	n = mbq_len(q);
 	if (n) { /* grab packets from the queue */
 		struct mbuf *m;
@@ -1323,18 +1388,42 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 
 		nm_i = kring->nr_hwtail;
 		stop_i = nm_prev(kring->nr_hwcur, lim);
-		while ( nm_i != stop_i && (m = mbq_dequeue(q)) != NULL ) {
+		while ( nm_i != stop_i && (m = mbq_peek(q)) != NULL ) {
 			int len = MBUF_LEN(m);
 			struct netmap_slot *slot = &ring->slot[nm_i];
+			u_int mss = 0, nslots = 1, avail;
+			int offld;
+
+			/* Offloads left to the device are done in software,
+			 * a TSO/GSO packet taking one slot per segment. */
+			if (nm_os_mbuf_has_seg_offld(m))
+				mss = nm_os_mbuf_seg_size(m);
+			offld = mss || (!netmap_generic_hwcsum &&
+					nm_os_mbuf_has_csum_offld(m));
+			avail = stop_i - nm_i;
+			if (stop_i < nm_i)
+				avail += lim + 1;
+			if (mss)
+				nslots = howmany(len, mss);
+			if (nslots > avail && nslots <= lim)
+				break; /* wait for the user to free some slots */
+			mbq_dequeue(q);
+
+			if (offld) {
+				nslots = netmap_host_offload(kring, m, mss,
+						nm_i, avail);
+			} else {
+				m_copydata(m, 0, len, NMB(na, slot));
+				ND("nm %d len %d", nm_i, len);
+				if (netmap_debug & NM_DEBUG_HOST)
+					nm_prinf("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
 
-			m_copydata(m, 0, len, NMB(na, slot));
-			ND("nm %d len %d", nm_i, len);
-			if (netmap_debug & NM_DEBUG_HOST)
-				nm_prinf("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
-
-			slot->len = len;
-			slot->flags = 0;
-			nm_i = nm_next(nm_i, lim);
+				slot->len = len;
+				slot->flags = 0;
+			}
+			nm_i += nslots;
+			if (nm_i > lim)
+				nm_i -= lim + 1;
 			mbq_enqueue(&fq, m);
 		}
 		kring->nr_hwtail = nm_i;
@@ -2366,6 +2455,32 @@ nm_sync_finalize(struct netmap_kring *kring)
 		kring->rhead, kring->rcur, kring->rtail);
 }
 
+/*
+ * Stamp the slots that an rxsync made visible, from 'old_tail' to
+ * nr_hwtail, with the current time. Drivers with NAF_HWTSTAMP have
+ * already stored the NIC timestamps, and only the packets the NIC did
+ * not stamp get the software time.
+ */
+static inline void
+nm_rxsync_tstamp(struct netmap_kring *kring, u_int old_tail)
+{
+	uint64_t *ts = kring->nkr_tstamp, now;
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int i;
+
+	if (ts == NULL || old_tail == kring->nr_hwtail)
+		return;
+	now = nm_os_nanotime();
+	if (kring->na->na_flags & NAF_HWTSTAMP) {
+		for (i = old_tail; i != kring->nr_hwtail; i = nm_next(i, lim))
+			if (ts[i] == 0)
+				ts[i] = now;
+	} else {
+		for (i = old_tail; i != kring->nr_hwtail; i = nm_next(i, lim))
+			ts[i] = now;
+	}
+}
+
 /* set ring timestamp */
 static inline void
 ring_timestamp_set(struct netmap_ring *ring)
@@ -2375,6 +2490,168 @@ ring_timestamp_set(struct netmap_ring *ring)
 	}
 }
 
+/* number of buffers held by the rings of na, call with NMG_LOCK held */
+static u_int
+netmap_ring_bufs(struct netmap_adapter *na)
+{
+	enum txrx t;
+	u_int i, n = 0;
+
+	if (na->tx_rings == NULL)
+		return 0; /* krings not created */
+	for_rx_tx(t) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
+			struct netmap_kring *kring = NMR(na, t)[i];
+
+			if (kring->ring != NULL)
+				n += kring->nkr_num_slots;
+		}
+	}
+	return n;
+}
+
+/*
+ * Sync a kring the caller has got with nm_kr_tryget(), as NIOCTXSYNC
+ * or NIOCRXSYNC do. Packets to be forwarded to the host stack are
+ * appended to q.
+ */
+static void
+netmap_sync_kring(struct netmap_kring *kring, int sync_flags, struct mbq *q)
+{
+	struct netmap_ring *ring = kring->ring;
+	u_int old_tail;
+
+	if (kring->tx == NR_TX) {
+		if (netmap_debug & NM_DEBUG_TXSYNC)
+			nm_prinf("pre txsync ring %d cur %d hwcur %d",
+			    kring->ring_id, ring->cur,
+			    kring->nr_hwcur);
+		if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
+			nm_sync_finalize(kring);
+		}
+		if (netmap_debug & NM_DEBUG_TXSYNC)
+			nm_prinf("post txsync ring %d cur %d hwcur %d",
+			    kring->ring_id, ring->cur,
+			    kring->nr_hwcur);
+	} else {
+		if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		}
+		if (nm_may_forward_up(kring)) {
+			/* transparent forwarding, see netmap_poll() */
+			netmap_grab_packets(kring, q, netmap_fwd);
+		}
+		old_tail = kring->nr_hwtail;
+		if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
+			nm_rxsync_tstamp(kring, old_tail);
+			nm_sync_finalize(kring);
+		}
+		ring_timestamp_set(ring);
+	}
+}
+
+/* Sync the ring of one NETMAP_REQ_SYNC_BATCH entry, bound to priv. */
+static int
+netmap_sync_batch_one(struct netmap_priv_d *priv, struct nmreq_sync_entry *e)
+{
+	struct netmap_adapter *na;
+	struct netmap_kring *kring;
+	struct mbq q;
+	enum txrx t;
+	int error = 0;
+
+	if (unlikely(priv->np_nifp == NULL))
+		return ENXIO;
+	mb(); /* make sure following reads are not from cache */
+
+	if (unlikely(priv->np_csb_atok_base))
+		return EBUSY;
+	if (e->nr_dir != NR_SYNC_TX && e->nr_dir != NR_SYNC_RX)
+		return EINVAL;
+	t = (e->nr_dir == NR_SYNC_TX ? NR_TX : NR_RX);
+	if (e->nr_ring < priv->np_qfirst[t] || e->nr_ring >= priv->np_qlast[t])
+		return EINVAL;
+
+	na = priv->np_na;
+	kring = NMR(na, t)[e->nr_ring];
+	mbq_init(&q);
+	if (unlikely(nm_kr_tryget(kring, 1, &error))) {
+		error = (error ? EIO : 0);
+	} else {
+		netmap_sync_kring(kring, priv->np_sync_flags, &q);
+		nm_kr_put(kring);
+	}
+	if (mbq_peek(&q)) {
+		netmap_send_up(na->ifp, &q);
+	}
+	e->nr_head = kring->ring->head;
+	e->nr_tail = kring->ring->tail;
+	return error;
+}
+
+/* Process NETMAP_REQ_SYNC_BATCH on the file descriptor of priv. */
+static int
+netmap_sync_batch(struct netmap_priv_d *priv, struct nmreq_header *hdr)
+{
+	struct nmreq_sync_batch *req =
+		(struct nmreq_sync_batch *)(uintptr_t)hdr->nr_body;
+	struct nmreq_sync_entry *entries =
+		(struct nmreq_sync_entry *)(uintptr_t)req->nr_entries;
+	struct nmreq_sync_entry *v;
+	struct netmap_priv_d *p = NULL;
+	void *filp = NULL;
+	int fd = -1;
+	size_t len;
+	u_int n;
+	int error = 0;
+
+	req->nr_synced = 0;
+	if (req->nr_count == 0)
+		return 0;
+	if (req->nr_count > NR_SYNC_BATCH_MAX || entries == NULL)
+		return EINVAL;
+	len = sizeof(*entries) * req->nr_count;
+	/* nr_reserved tells if the body came from userspace */
+	if (hdr->nr_reserved) {
+		v = nm_os_malloc(len);
+		if (v == NULL)
+			return ENOMEM;
+		error = copyin(entries, v, len);
+		if (error)
+			goto out;
+	} else {
+		v = entries;
+	}
+
+	for (n = 0; n < req->nr_count; n++) {
+		struct nmreq_sync_entry *e = &v[n];
+
+		/* consecutive entries for the same fd share the lookup */
+		if (p == NULL || e->nr_fd != fd) {
+			if (filp != NULL) {
+				nm_os_priv_put(filp);
+				filp = NULL;
+			}
+			fd = e->nr_fd;
+			p = (fd == -1) ? priv : nm_os_priv_get(fd, &filp);
+		}
+		e->nr_error = (p == NULL) ? EBADF : netmap_sync_batch_one(p, e);
+		if (e->nr_error == 0)
+			req->nr_synced++;
+	}
+	if (filp != NULL)
+		nm_os_priv_put(filp);
+
+	if (hdr->nr_reserved)
+		error = copyout(v, entries, len);
+out:
+	if (v != entries)
+		nm_os_free(v);
+	return error;
+}
+
 static int nmreq_copyin(struct nmreq_header *, int);
 static int nmreq_copyout(struct nmreq_header *, int);
 static int nmreq_checkoptions(struct nmreq_header *);
@@ -2732,6 +3009,29 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			error = nm_bdg_polling(hdr);
 			break;
 		}
+
+		case NETMAP_REQ_VALE_FDB_GET:
+		case NETMAP_REQ_VALE_FDB_SET: {
+			error = netmap_vale_fdb(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_PORT_GET:
+		case NETMAP_REQ_VALE_PORT_SET: {
+			error = netmap_vale_port(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_STATS_GET: {
+			error = netmap_vale_stats(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_RULES_GET:
+		case NETMAP_REQ_VALE_RULES_SET: {
+			error = netmap_vale_rules(hdr);
+			break;
+		}
 #endif  /* WITH_VALE */
 		case NETMAP_REQ_POOLS_INFO_GET: {
 			/* Get information from the memory allocator used for
@@ -2777,6 +3077,86 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			break;
 		}
 
+		case NETMAP_REQ_POOLS_CONFIG_SET: {
+			struct nmreq_pools_config *req =
+				(struct nmreq_pools_config *)(uintptr_t)hdr->nr_body;
+
+			NMG_LOCK();
+			nmd = netmap_mem_find(req->nr_mem_id ? req->nr_mem_id : 1);
+			if (nmd == NULL) {
+				error = EINVAL;
+			} else {
+				error = netmap_mem_pools_config(nmd, req);
+				netmap_mem_put(nmd);
+			}
+			NMG_UNLOCK();
+			break;
+		}
+
+		case NETMAP_REQ_POOLS_STATS_GET: {
+			struct nmreq_pools_stats *req =
+				(struct nmreq_pools_stats *)(uintptr_t)hdr->nr_body;
+
+			NMG_LOCK();
+			if (hdr->nr_name[0] == '\0') {
+				nmd = netmap_mem_find(req->nr_mem_id ?
+						req->nr_mem_id : 1);
+				if (nmd == NULL) {
+					error = EINVAL;
+				} else {
+					error = netmap_mem_pools_stats_get(req, nmd);
+					netmap_mem_put(nmd);
+				}
+				NMG_UNLOCK();
+				break;
+			}
+			do {
+				/* Look up the port as in NETMAP_REQ_POOLS_INFO_GET,
+				 * but do not create it nor touch its allocator. */
+				struct nmreq_register regreq;
+				bzero(&regreq, sizeof(regreq));
+				regreq.nr_mode = NR_REG_ALL_NIC;
+
+				hdr->nr_reqtype = NETMAP_REQ_REGISTER;
+				hdr->nr_body = (uintptr_t)&regreq;
+				error = netmap_get_na(hdr, &na, &ifp, NULL, 0 /* no create */);
+				hdr->nr_reqtype = NETMAP_REQ_POOLS_STATS_GET; /* reset type */
+				hdr->nr_body = (uintptr_t)req; /* reset nr_body */
+				if (error) {
+					na = NULL;
+					ifp = NULL;
+					break;
+				}
+				if (na->nm_mem == NULL) {
+					error = EINVAL;
+					break;
+				}
+				error = netmap_mem_pools_stats_get(req, na->nm_mem);
+				req->nr_port_ring_bufs = netmap_ring_bufs(na);
+				req->nr_port_extra_bufs = na->na_extra_bufs;
+			} while (0);
+			netmap_unget_na(na, ifp);
+			NMG_UNLOCK();
+			break;
+		}
+
+		case NETMAP_REQ_BUFQ_SYNC: {
+			NMG_LOCK();
+			if (priv->np_nifp == NULL) {
+				error = ENXIO;
+			} else {
+				error = netmap_mem_bufq_sync(priv->np_na,
+							priv->np_nifp);
+			}
+			NMG_UNLOCK();
+			break;
+		}
+
+		case NETMAP_REQ_SYNC_BATCH: {
+			error = netmap_sync_batch(priv, hdr);
+			break;
+		}
+
 		case NETMAP_REQ_CSB_ENABLE: {
 			struct nmreq_option *opt;
 
@@ -2844,40 +3224,12 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 
 		for (i = qfirst; i < qlast; i++) {
 			struct netmap_kring *kring = krings[i];
-			struct netmap_ring *ring = kring->ring;
 
 			if (unlikely(nm_kr_tryget(kring, 1, &error))) {
 				error = (error ? EIO : 0);
 				continue;
 			}
-
-			if (cmd == NIOCTXSYNC) {
-				if (netmap_debug & NM_DEBUG_TXSYNC)
-					nm_prinf("pre txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-				if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
-					nm_sync_finalize(kring);
-				}
-				if (netmap_debug & NM_DEBUG_TXSYNC)
-					nm_prinf("post txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-			} else {
-				if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				}
-				if (nm_may_forward_up(kring)) {
-					/* transparent forwarding, see netmap_poll() */
-					netmap_grab_packets(kring, &q, netmap_fwd);
-				}
-				if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
-					nm_sync_finalize(kring);
-				}
-				ring_timestamp_set(ring);
-			}
+			netmap_sync_kring(kring, sync_flags, &q);
 			nm_kr_put(kring);
 		}
 
@@ -2919,14 +3271,32 @@ nmreq_size_by_type(uint16_t nr_reqtype)
 	case NETMAP_REQ_VALE_DELIF:
 	case NETMAP_REQ_SYNC_KLOOP_STOP:
 	case NETMAP_REQ_CSB_ENABLE:
+	case NETMAP_REQ_BUFQ_SYNC:
 		return 0;
 	case NETMAP_REQ_VALE_POLLING_ENABLE:
 	case NETMAP_REQ_VALE_POLLING_DISABLE:
 		return sizeof(struct nmreq_vale_polling);
 	case NETMAP_REQ_POOLS_INFO_GET:
 		return sizeof(struct nmreq_pools_info);
+	case NETMAP_REQ_POOLS_CONFIG_SET:
+		return sizeof(struct nmreq_pools_config);
+	case NETMAP_REQ_POOLS_STATS_GET:
+		return sizeof(struct nmreq_pools_stats);
+	case NETMAP_REQ_SYNC_BATCH:
+		return sizeof(struct nmreq_sync_batch);
 	case NETMAP_REQ_SYNC_KLOOP_START:
 		return sizeof(struct nmreq_sync_kloop_start);
+	case NETMAP_REQ_VALE_FDB_GET:
+	case NETMAP_REQ_VALE_FDB_SET:
+		return sizeof(struct nmreq_vale_fdb);
+	case NETMAP_REQ_VALE_PORT_GET:
+	case NETMAP_REQ_VALE_PORT_SET:
+		return sizeof(struct nmreq_vale_port);
+	case NETMAP_REQ_VALE_STATS_GET:
+		return sizeof(struct nmreq_vale_stats);
+	case NETMAP_REQ_VALE_RULES_GET:
+	case NETMAP_REQ_VALE_RULES_SET:
+		return sizeof(struct nmreq_vale_rules);
 	}
 	return 0;
 }
@@ -3211,7 +3581,7 @@ netmap_poll(struct netmap_priv_d *priv, int events, NM_SELRECORD_T *sr)
 	struct netmap_adapter *na;
 	struct netmap_kring *kring;
 	struct netmap_ring *ring;
-	u_int i, want[NR_TXRX], revents = 0;
+	u_int i, want[NR_TXRX], revents = 0, old_tail;
 	NM_SELINFO_T *si[NR_TXRX];
 #define want_tx want[NR_TX]
 #define want_rx want[NR_RX]
@@ -3415,10 +3785,13 @@ do_retry_rx:
 			 * the nm_sync() below only on for the host RX ring (see
 			 * netmap_rxsync_from_host()). */
 			kring->nr_kflags &= ~NR_FORWARD;
-			if (kring->nm_sync(kring, sync_flags))
+			old_tail = kring->nr_hwtail;
+			if (kring->nm_sync(kring, sync_flags)) {
 				revents |= POLLERR;
-			else
+			} else {
+				nm_rxsync_tstamp(kring, old_tail);
 				nm_sync_finalize(kring);
+			}
 			send_down |= (kring->nr_kflags & NR_FORWARD);
 			ring_timestamp_set(ring);
 			found = kring->rcur != kring->rtail;
@@ -3841,47 +4214,44 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 
 	q = &kring->rx_queue;
 
-	// XXX reconsider long packets if we handle fragments
-	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
-		nm_prerr("%s from_host, drop packet size %d > %d", na->name,
-			len, NETMAP_BUF_SIZE(na));
-		goto done;
-	}
-
-	if (!netmap_generic_hwcsum) {
-		if (nm_os_mbuf_has_csum_offld(m)) {
-			RD(1, "%s drop mbuf that needs checksum offload", na->name);
+	/* Checksums and TCP segmentation are done in software by
+	 * netmap_rxsync_from_host(), so TSO/GSO packets may be longer
+	 * than a netmap buffer. */
+	if (nm_os_mbuf_has_seg_offld(m)) {
+		if (nm_os_mbuf_seg_size(m) == 0) {
+			RD(1, "%s drop mbuf that needs non-TCP segmentation offload",
+				na->name);
 			goto done;
 		}
-	}
-
-	if (nm_os_mbuf_has_seg_offld(m)) {
-		RD(1, "%s drop mbuf that needs generic segmentation offload", na->name);
+	} else if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
+		nm_prerr("%s from_host, drop packet size %d > %d", na->name,
+			len, NETMAP_BUF_SIZE(na));
 		goto done;
 	}
 
-	/* protect against netmap_rxsync_from_host(), netmap_sw_to_nic()
-	 * and maybe other instances of netmap_transmit (the latter
-	 * not possible on Linux).
-	 * We enqueue the mbuf only if we are sure there is going to be
-	 * enough room in the host RX ring, otherwise we drop it.
+	/* Several CPUs may transmit at the same time, so we do not take
+	 * the mbq lock here: the mbuf is pushed on the lock-free side of
+	 * the queue, and netmap_rxsync_from_host() moves the pending mbufs
+	 * into the mbq in batches, under the lock.
+	 * We enqueue the mbuf only if there is going to be enough room
+	 * in the host RX ring, otherwise we drop it. Without the lock the
+	 * check is only approximate, and concurrent senders may overshoot
+	 * it by a few mbufs, which then wait in the queue.
+	 * A TSO/GSO mbuf is counted once here; netmap_rxsync_from_host()
+	 * keeps it in the queue until there are slots for all its segments.
 	 */
-	mbq_lock(q);
-
 	busy = kring->nr_hwtail - kring->nr_hwcur;
 	if (busy < 0)
 		busy += kring->nkr_num_slots;
-	if (busy + mbq_len(q) >= kring->nkr_num_slots - 1) {
+	if (busy + mbq_mpsc_len(q) >= kring->nkr_num_slots - 1) {
 		RD(2, "%s full hwcur %d hwtail %d qlen %d", na->name,
-			kring->nr_hwcur, kring->nr_hwtail, mbq_len(q));
+			kring->nr_hwcur, kring->nr_hwtail, mbq_mpsc_len(q));
 	} else {
-		mbq_enqueue(q, m);
-		ND(2, "%s %d bufs in queue", na->name, mbq_len(q));
-		/* notify outside the lock */
+		mbq_mpsc_enqueue(q, m);
+		ND(2, "%s %d bufs in queue", na->name, mbq_mpsc_len(q));
 		m = NULL;
 		error = 0;
 	}
-	mbq_unlock(q);
 
 done:
 	if (m)
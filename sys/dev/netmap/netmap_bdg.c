@@ -120,16 +120,215 @@ netmap_bdg_name(struct netmap_vp_adapter *vp)
 }
 
 
+/*
+ * Number of bridges in the system (or per namespace), fixed at
+ * module load. A bridge is cheap until it is created, as the
+ * per-port arrays and the forwarding table are only allocated then.
+ */
+int netmap_bridges = NM_BRIDGES;
+
 #ifndef CONFIG_NET_NS
 /*
- * XXX in principle nm_bridges could be created dynamically
  * Right now we have a static array and deletions are protected
  * by an exclusive lock.
  */
 struct nm_bridge *nm_bridges;
+u_int nm_num_bridges;
 #endif /* !CONFIG_NET_NS */
 
 
+/*
+ * Default geometry of the forwarding table of new bridges.
+ * Existing bridges can be reconfigured with NETMAP_REQ_VALE_FDB_SET.
+ */
+static int bridge_fdb_buckets = NM_BDG_HASH;
+static int bridge_fdb_ageing = NM_BDG_AGEING;
+SYSBEGIN(vars_bdg);
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_fdb_buckets, CTLFLAG_RW,
+		&bridge_fdb_buckets, 0,
+		"Number of buckets in the forwarding table of new bridges");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_fdb_ageing, CTLFLAG_RW,
+		&bridge_fdb_ageing, 0,
+		"Ageing time (seconds) of the forwarding table entries");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridges, CTLFLAG_RDTUN,
+		&netmap_bridges, 0, "Number of VALE bridges");
+SYSEND;
+
+/*
+ * Back-off thresholds of adaptive polling kthreads, counted in
+ * consecutive polls that found no work (see nm_bdg_poll_backoff()).
+ */
+static int polling_pause_polls = 64;
+static int polling_yield_polls = 1024;
+static int polling_sleep_polls = 16384;
+static int polling_sleep_us = 100;
+SYSBEGIN(vars_bdg_poll);
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_INT(_dev_netmap, OID_AUTO, polling_pause_polls, CTLFLAG_RW,
+		&polling_pause_polls, 0,
+		"Empty polls before an adaptive poller starts to pause");
+SYSCTL_INT(_dev_netmap, OID_AUTO, polling_yield_polls, CTLFLAG_RW,
+		&polling_yield_polls, 0,
+		"Empty polls before an adaptive poller starts to yield the CPU");
+SYSCTL_INT(_dev_netmap, OID_AUTO, polling_sleep_polls, CTLFLAG_RW,
+		&polling_sleep_polls, 0,
+		"Empty polls before an adaptive poller sleeps on interrupts");
+SYSCTL_INT(_dev_netmap, OID_AUTO, polling_sleep_us, CTLFLAG_RW,
+		&polling_sleep_us, 0,
+		"Sleep interval (us) of an idle adaptive poller");
+SYSEND;
+
+/* round up to a power of 2 within the supported range */
+static u_int
+nm_bdg_ht_buckets(u_int buckets)
+{
+	u_int n = NM_BDG_HASH_MIN;
+
+	while (n < buckets && n < NM_BDG_HASH_MAX)
+		n <<= 1;
+	return n;
+}
+
+/* The tables may be large, so use vmalloc() where available. */
+static void *
+nm_bdg_ht_alloc(size_t n)
+{
+	void *p;
+#ifdef linux
+	p = nm_os_vmalloc(n);
+	if (p)
+		bzero(p, n);
+#else
+	p = nm_os_malloc(n);
+#endif
+	return p;
+}
+
+static void
+nm_bdg_ht_free(void *p)
+{
+#ifdef linux
+	nm_os_vfree(p);
+#else
+	nm_os_free(p);
+#endif
+}
+
+static struct nm_hash_ent *
+nm_bdg_ht_alloc_ent(u_int buckets)
+{
+	return nm_bdg_ht_alloc(sizeof(struct nm_hash_ent) *
+			NM_BDG_HASH_WAYS * buckets);
+}
+
+struct nm_hash_table *
+nm_bdg_ht_create(void)
+{
+	struct nm_hash_table *ht;
+	u_int buckets = nm_bdg_ht_buckets(bridge_fdb_buckets);
+
+	ht = nm_os_malloc(sizeof(*ht));
+	if (ht == NULL)
+		return NULL;
+	ht->ht_ent = nm_bdg_ht_alloc_ent(buckets);
+	if (ht->ht_ent == NULL) {
+		nm_os_free(ht);
+		return NULL;
+	}
+	ht->ht_ncpus = nm_os_ncpus();
+	ht->ht_pcpu = nm_bdg_ht_alloc(sizeof(struct nm_ht_pcpu) * ht->ht_ncpus);
+	if (ht->ht_pcpu == NULL) {
+		nm_bdg_ht_free(ht->ht_ent);
+		nm_os_free(ht);
+		return NULL;
+	}
+	ht->ht_buckets = buckets;
+	ht->ht_ageing = bridge_fdb_ageing < 0 ? 0 : bridge_fdb_ageing;
+	return ht;
+}
+
+void
+nm_bdg_ht_destroy(struct nm_hash_table *ht)
+{
+	if (ht == NULL)
+		return;
+	nm_bdg_ht_free(ht->ht_ent);
+	nm_bdg_ht_free(ht->ht_pcpu);
+	if (ht->ht_mcast_ts)
+		nm_bdg_ht_free(ht->ht_mcast_ts);
+	if (ht->ht_cls)
+		nm_os_free(ht->ht_cls);
+	nm_os_free(ht);
+}
+
+/*
+ * Remove the entries and group memberships of 'port', or all of
+ * them if port is negative. Concurrent lookups see either the old
+ * or the cleared entries, and the entries can be learned again
+ * concurrently, as with any other update from the datapath.
+ */
+void
+nm_bdg_ht_flush(struct nm_hash_table *ht, int port)
+{
+	u_int i, n = ht->ht_buckets * NM_BDG_HASH_WAYS;
+
+	if (port < 0) {
+		bzero(ht->ht_ent, sizeof(struct nm_hash_ent) * n);
+		bzero(ht->ht_mcast, sizeof(ht->ht_mcast));
+		if (ht->ht_mcast_ts)
+			bzero(ht->ht_mcast_ts, sizeof(uint32_t) *
+				NM_BDG_MCAST_COLS * ht->ht_mcast_ports);
+		ht->ht_mcast_used = 0;
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (ht->ht_ent[i].ports == (uint32_t)port)
+			ht->ht_ent[i].mac = 0;
+	}
+	for (i = 0; i < ht->ht_mcast_used; i++)
+		NM_MCAST_TS(ht, port, i) = 0;
+	NM_MCAST_TS(ht, port, NM_BDG_MCAST_ROUTER) = 0;
+}
+
+/*
+ * Replace the forwarding table of the bridge with an empty one
+ * of the given number of buckets. The datapath keeps running on
+ * the old table until the new one is published. The learned
+ * addresses are lost and are learned again as traffic flows.
+ * Must be called with NMG_LOCK held.
+ */
+int
+nm_bdg_ht_resize(struct nm_bridge *b, u_int buckets)
+{
+	struct nm_hash_table *ht = b->ht;
+	struct nm_hash_ent *ent, *old;
+
+	NMG_LOCK_ASSERT();
+	buckets = nm_bdg_ht_buckets(buckets);
+	if (buckets == ht->ht_buckets)
+		return 0;
+	ent = nm_bdg_ht_alloc_ent(buckets);
+	if (ent == NULL)
+		return ENOMEM;
+	/* readers may pair either table with either size, so the
+	 * size only grows when the larger table is in place */
+	old = ht->ht_ent;
+	if (buckets < ht->ht_buckets) {
+		ht->ht_buckets = buckets;
+		nm_bdg_sync(b);
+		ht->ht_ent = ent;
+		nm_bdg_sync(b);
+	} else {
+		BDG_MB();
+		ht->ht_ent = ent;
+		nm_bdg_sync(b);
+		ht->ht_buckets = buckets;
+	}
+	nm_bdg_ht_free(old);
+	return 0;
+}
+
 static int
 nm_is_id_char(const char c)
 {
@@ -168,6 +367,146 @@ nm_bdg_name_validate(const char *name, size_t prefixlen)
 	return colon_pos;
 }
 
+/*
+ * Wait until no reader can see what the bridge was before the last
+ * update. Readers increment the counter of the epoch they find in
+ * bdg_epoch: we wait for the readers of the other epoch (who read
+ * bdg_epoch before a previous flip), flip, and wait for the readers
+ * of the old one. Readers that enter after we have seen their
+ * counter at zero see the update, because of the barriers on both
+ * sides. Called with NMG_LOCK held, so writers do not race.
+ */
+void
+nm_bdg_sync(struct nm_bridge *b)
+{
+	u_int e;
+
+	BDG_MB();
+	e = b->bdg_epoch & 1;
+	while (BDG_ATOMIC_READ(&b->bdg_readers[e ^ 1]))
+		tsleep(b, 0, "nmbdg", 1);
+	b->bdg_epoch++;
+	BDG_MB();
+	while (BDG_ATOMIC_READ(&b->bdg_readers[e]))
+		tsleep(b, 0, "nmbdg", 1);
+}
+
+/*
+ * Make the current lookup functions and private data visible to
+ * the datapath. The spare buffer is not in use after nm_bdg_sync().
+ */
+static void
+nm_bdg_publish_lookup(struct nm_bridge *b)
+{
+	struct nm_bdg_lookup *l = b->bdg_lookup_buf;
+
+	if (l == b->bdg_lookup)
+		l++;
+	l->lookup = b->bdg_ops.lookup;
+	l->lookup_batch = b->bdg_ops.lookup_batch;
+	l->private_data = b->private_data;
+	BDG_MB();
+	b->bdg_lookup = l;
+	nm_bdg_sync(b);
+}
+
+/*
+ * Make room for at least n ports in the bridge, by doubling the arrays
+ * indexed by port number. The sizes are only updated once no reader
+ * can be using the old arrays, which are then freed, after merging the
+ * multicast timestamps written in the old array meanwhile.
+ * Must be called with NMG_LOCK held.
+ */
+static int
+nm_bdg_grow(struct nm_bridge *b, u_int n)
+{
+	struct nm_hash_table *ht = b->ht;
+	u_int old = b->bdg_max_ports, num = old ? old : NM_BDG_MINPORTS, i;
+	struct netmap_vp_adapter **ports, **old_ports;
+	uint32_t *index, *tmp, *old_index, *old_tmp, *mts, *old_mts;
+
+	NMG_LOCK_ASSERT();
+	if (n <= old)
+		return 0;
+	while (num < n)
+		num <<= 1;
+	if (num > NM_BDG_MAXPORTS)
+		num = NM_BDG_MAXPORTS;
+	if (num < n)
+		return ENOMEM;
+
+	ports = nm_bdg_ht_alloc(sizeof(*ports) * num);
+	index = nm_bdg_ht_alloc(sizeof(*index) * num);
+	tmp = nm_bdg_ht_alloc(sizeof(*tmp) * num);
+	mts = nm_bdg_ht_alloc(sizeof(*mts) * num * NM_BDG_MCAST_COLS);
+	if (ports == NULL || index == NULL || tmp == NULL || mts == NULL) {
+		if (ports)
+			nm_bdg_ht_free(ports);
+		if (index)
+			nm_bdg_ht_free(index);
+		if (tmp)
+			nm_bdg_ht_free(tmp);
+		if (mts)
+			nm_bdg_ht_free(mts);
+		return ENOMEM;
+	}
+	if (old) {
+		memcpy(ports, b->bdg_ports, sizeof(*ports) * old);
+		memcpy(index, b->bdg_port_index, sizeof(*index) * old);
+		memcpy(mts, ht->ht_mcast_ts,
+			sizeof(*mts) * old * NM_BDG_MCAST_COLS);
+	}
+	for (i = old; i < num; i++)
+		index[i] = i;
+
+	old_ports = b->bdg_ports;
+	old_index = b->bdg_port_index;
+	old_tmp = b->tmp_bdg_port_index;
+	old_mts = ht->ht_mcast_ts;
+	BDG_MB();
+	b->bdg_ports = ports;
+	b->bdg_port_index = index;
+	b->tmp_bdg_port_index = tmp;
+	ht->ht_mcast_ts = mts;
+	nm_bdg_sync(b);
+	b->bdg_max_ports = num;
+	ht->ht_mcast_ports = num;
+
+	if (old) {
+		/* The senders kept refreshing the memberships in old_mts
+		 * until the sync, so merge them again, keeping the latest
+		 * timestamp. A leave racing with the grow may be lost,
+		 * and then only ageing removes the port from the group. */
+		for (i = 0; i < old * NM_BDG_MCAST_COLS; i++) {
+			if (old_mts[i] > mts[i])
+				mts[i] = old_mts[i];
+		}
+		nm_bdg_ht_free(old_ports);
+		nm_bdg_ht_free(old_index);
+		nm_bdg_ht_free(old_tmp);
+		nm_bdg_ht_free(old_mts);
+	}
+	return 0;
+}
+
+static void
+nm_bdg_free_tables(struct nm_bridge *b)
+{
+	if (b->bdg_max_ports) {
+		nm_bdg_ht_free(b->bdg_ports);
+		nm_bdg_ht_free(b->bdg_port_index);
+		nm_bdg_ht_free(b->tmp_bdg_port_index);
+		b->bdg_ports = NULL;
+		b->bdg_port_index = b->tmp_bdg_port_index = NULL;
+		b->bdg_max_ports = 0;
+	}
+	if (b->ht) {
+		/* also frees ht_mcast_ts */
+		nm_bdg_ht_destroy(b->ht);
+		b->ht = NULL;
+	}
+}
+
 /*
  * locate a bridge among the existing ones.
  * MUST BE CALLED WITH NMG_LOCK()
@@ -212,19 +551,22 @@ nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops)
 		/* initialize the bridge */
 		ND("create new bridge %s with ports %d", b->bdg_basename,
 			b->bdg_active_ports);
-		b->ht = nm_os_malloc(sizeof(struct nm_hash_ent) * NM_BDG_HASH);
-		if (b->ht == NULL) {
-			nm_prerr("failed to allocate hash table");
+		/* a previous creation may have failed before attaching
+		 * any port, leaving the tables around */
+		nm_bdg_free_tables(b);
+		b->ht = nm_bdg_ht_create();
+		if (b->ht == NULL || nm_bdg_grow(b, NM_BDG_MINPORTS)) {
+			nm_prerr("failed to allocate bridge tables");
+			nm_bdg_free_tables(b);
 			return NULL;
 		}
 		strncpy(b->bdg_basename, name, namelen);
 		b->bdg_namelen = namelen;
 		b->bdg_active_ports = 0;
-		for (i = 0; i < NM_BDG_MAXPORTS; i++)
-			b->bdg_port_index[i] = i;
 		/* set the default function */
 		b->bdg_ops = b->bdg_saved_ops = *ops;
 		b->private_data = b->ht;
+		nm_bdg_publish_lookup(b);
 		b->bdg_flags = 0;
 		NM_BNS_GET(b);
 	}
@@ -240,9 +582,10 @@ netmap_bdg_free(struct nm_bridge *b)
 	}
 
 	ND("marking bridge %s as free", b->bdg_basename);
-	nm_os_free(b->ht);
+	nm_bdg_free_tables(b);
 	memset(&b->bdg_ops, 0, sizeof(b->bdg_ops));
 	memset(&b->bdg_saved_ops, 0, sizeof(b->bdg_saved_ops));
+	b->bdg_lookup = NULL;
 	b->bdg_flags = 0;
 	NM_BNS_PUT(b);
 	return 0;
@@ -252,6 +595,9 @@ netmap_bdg_free(struct nm_bridge *b)
  * to modify the private data previously given to regops().
  * 'name' may be just bridge's name (including ':' if it
  * is not just NM_BDG_NAME).
+ * The callback runs concurrently with the datapath, so it should
+ * return new data rather than modify the old one in place. The old
+ * data is no longer in use when this function returns.
  * Called without NMG_LOCK.
  */
 int
@@ -272,10 +618,10 @@ netmap_bdg_update_private_data(const char *name, bdg_update_private_data_fn_t ca
 		error = EACCES;
 		goto unlock_update_priv;
 	}
-	BDG_WLOCK(b);
 	private_data = callback(b->private_data, callback_data, &error);
 	b->private_data = private_data;
-	BDG_WUNLOCK(b);
+	/* the caller may free the old data when we return */
+	nm_bdg_publish_lookup(b);
 
 unlock_update_priv:
 	NMG_UNLOCK();
@@ -293,6 +639,7 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	int s_hw = hw, s_sw = sw;
 	int i, lim =b->bdg_active_ports;
 	uint32_t *tmp = b->tmp_bdg_port_index;
+	struct netmap_vp_adapter *vpna;
 
 	/*
 	New algorithm:
@@ -300,16 +647,15 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	lookup NA(ifp)->bdg_port and SWNA(ifp)->bdg_port
 	in the array of bdg_port_index, replacing them with
 	entries from the bottom of the array;
-	decrement bdg_active_ports;
-	acquire BDG_WLOCK() and copy back the array.
+	clear the ports, publish the new array and decrement
+	bdg_active_ports; wait for the readers of the old array,
+	which becomes the next tmp_bdg_port_index.
 	 */
 
 	if (netmap_debug & NM_DEBUG_BDG)
 		nm_prinf("detach %d and %d (lim %d)", hw, sw, lim);
-	/* make a copy of the list of active ports, update it,
-	 * and then copy back within BDG_WLOCK().
-	 */
-	memcpy(b->tmp_bdg_port_index, b->bdg_port_index, sizeof(b->tmp_bdg_port_index));
+	/* make a copy of the list of active ports and update it */
+	memcpy(b->tmp_bdg_port_index, b->bdg_port_index, sizeof(uint32_t) * b->bdg_max_ports);
 	for (i = 0; (hw >= 0 || sw >= 0) && i < lim; ) {
 		if (hw >= 0 && tmp[i] == hw) {
 			ND("detach hw %d at %d", hw, i);
@@ -331,16 +677,23 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 		nm_prerr("delete failed hw %d sw %d, should panic...", hw, sw);
 	}
 
-	BDG_WLOCK(b);
-	if (b->bdg_ops.dtor)
-		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
+	/* Readers may pair either array with either count: the
+	 * detached ports are in both, so clear them first. */
+	vpna = b->bdg_ports[s_hw];
 	b->bdg_ports[s_hw] = NULL;
-	if (s_sw >= 0) {
+	if (s_sw >= 0)
 		b->bdg_ports[s_sw] = NULL;
-	}
-	memcpy(b->bdg_port_index, b->tmp_bdg_port_index, sizeof(b->tmp_bdg_port_index));
+	BDG_MB();
+	b->tmp_bdg_port_index = b->bdg_port_index;
+	b->bdg_port_index = tmp;
 	b->bdg_active_ports = lim;
-	BDG_WUNLOCK(b);
+	nm_bdg_sync(b);
+
+	if (b->bdg_ops.dtor)
+		b->bdg_ops.dtor(vpna);
+	nm_bdg_ht_flush(b->ht, s_hw);
+	if (s_sw >= 0)
+		nm_bdg_ht_flush(b->ht, s_sw);
 
 	ND("now %d active ports", lim);
 	netmap_bdg_free(b);
@@ -438,7 +791,7 @@ netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		return ENXIO;
 	/* yes we should, see if we have space to attach entries */
 	needed = 2; /* in some cases we only need 1 */
-	if (b->bdg_active_ports + needed >= NM_BDG_MAXPORTS) {
+	if (nm_bdg_grow(b, b->bdg_active_ports + needed)) {
 		nm_prerr("bridge full %d, cannot create new port", b->bdg_active_ports);
 		return ENOMEM;
 	}
@@ -513,23 +866,23 @@ netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 		}
 	}
 
-	BDG_WLOCK(b);
 	vpna->bdg_port = cand;
 	ND("NIC  %p to bridge port %d", vpna, cand);
 	/* bind the port to the bridge (virtual ports are not active) */
 	b->bdg_ports[cand] = vpna;
 	vpna->na_bdg = b;
-	b->bdg_active_ports++;
 	if (hostna != NULL) {
 		/* also bind the host stack to the bridge */
 		b->bdg_ports[cand2] = hostna;
 		hostna->bdg_port = cand2;
 		hostna->na_bdg = b;
-		b->bdg_active_ports++;
 		ND("host %p to bridge port %d", hostna, cand2);
 	}
+	/* the candidates are already next in bdg_port_index, so
+	 * the ports become visible when the count is updated */
+	BDG_MB();
+	b->bdg_active_ports += (hostna != NULL) ? 2 : 1;
 	ND("if %s refs %d", ifname, vpna->up.na_refcount);
-	BDG_WUNLOCK(b);
 	*na = &vpna->up;
 	netmap_adapter_get(*na);
 
@@ -547,6 +900,25 @@ nm_is_bwrap(struct netmap_adapter *na)
 	return na->nm_register == netmap_bwrap_reg;
 }
 
+/*
+ * The buffer pool of the bwrap has grown (see netmap_mem_lut_refresh()):
+ * pass the new size to the copies of the lut made by netmap_bwrap_reg().
+ * The new buffers are already mapped for the device of the hwna, which
+ * is also the device of the bwrap. Called with the allocator lock held.
+ */
+void
+netmap_bwrap_lut_refresh(struct netmap_adapter *na)
+{
+	struct netmap_bwrap_adapter *bna = (struct netmap_bwrap_adapter *)na;
+	struct netmap_adapter *hwna = bna->hwna;
+	struct netmap_vp_adapter *hostna = &bna->host;
+
+	if (hwna->na_lut.lut == na->na_lut.lut)
+		hwna->na_lut.objtotal = na->na_lut.objtotal;
+	if (hostna->up.na_lut.lut == na->na_lut.lut)
+		hostna->up.na_lut.objtotal = na->na_lut.objtotal;
+}
+
 
 struct nm_bdg_polling_state;
 struct
@@ -555,11 +927,17 @@ nm_bdg_kthread {
 	u_int qfirst;
 	u_int qlast;
 	struct nm_bdg_polling_state *bps;
+	/* adaptive mode only */
+	u_int idle;		/* consecutive polls without work */
+	bool asleep;		/* counted in bps->sleepers */
+	u_int irq_gen;		/* last bps->irq_gen seen */
 };
 
 struct nm_bdg_polling_state {
 	bool configured;
 	bool stopped;
+	bool adaptive;		/* NETMAP_POLLING_ADAPTIVE */
+	struct nm_bdg_polling_state *pool_next; /* NETMAP_POLLING_MODE_SHARED */
 	struct netmap_bwrap_adapter *bna;
 	uint32_t mode;
 	u_int qfirst;
@@ -567,8 +945,71 @@ struct nm_bdg_polling_state {
 	u_int cpu_from;
 	u_int ncpus;
 	struct nm_bdg_kthread *kthreads;
+	/*
+	 * Interrupts of the hw adapter are only enabled while all the
+	 * kthreads sleep. intr_lock protects sleepers and the interrupt
+	 * state; irq_gen is bumped by netmap_bwrap_intr_notify() on
+	 * every interrupt, which also wakes up the sleepers. The
+	 * interrupt handler reads na_polling_state within a bridge
+	 * epoch, so the state is only freed after nm_bdg_sync().
+	 */
+	NM_MTX_T intr_lock;
+	u_int sleepers;
+	volatile u_int irq_gen;
 };
 
+/*
+ * Adaptive polling: after polling_pause_polls empty polls the kthread
+ * starts to pause the CPU between polls, after polling_yield_polls it
+ * yields the CPU, and after polling_sleep_polls it sleeps for
+ * polling_sleep_us between polls. When the last kthread falls asleep
+ * the interrupts of the hw adapter are re-enabled, so that traffic
+ * wakes the kthreads up (nm_os_kctx_wakeup()) before the next poll is
+ * due; the first kthread that finds work turns the interrupts off again.
+ */
+static void
+nm_bdg_poll_backoff(struct nm_bdg_kthread *nbk, int work)
+{
+	struct nm_bdg_polling_state *bps = nbk->bps;
+	u_int irq_gen = bps->irq_gen;
+
+	if (work || irq_gen != nbk->irq_gen) {
+		nbk->irq_gen = irq_gen;
+		nbk->idle = 0;
+		if (nbk->asleep) {
+			NM_MTX_LOCK(bps->intr_lock);
+			if (bps->sleepers-- == bps->ncpus)
+				nma_intr_enable(bps->bna->hwna, 0);
+			NM_MTX_UNLOCK(bps->intr_lock);
+			nbk->asleep = false;
+		}
+		return;
+	}
+
+	if (nbk->idle < (u_int)polling_sleep_polls)
+		nbk->idle++;
+	if (nbk->idle < (u_int)polling_pause_polls)
+		return;
+	if (nbk->idle < (u_int)polling_yield_polls) {
+		nm_os_kctx_pause(NM_KCTX_RELAX);
+		return;
+	}
+	if (nbk->idle < (u_int)polling_sleep_polls) {
+		nm_os_kctx_pause(NM_KCTX_YIELD);
+		return;
+	}
+	if (!nbk->asleep) {
+		NM_MTX_LOCK(bps->intr_lock);
+		if (++bps->sleepers == bps->ncpus)
+			nma_intr_enable(bps->bna->hwna, 1);
+		NM_MTX_UNLOCK(bps->intr_lock);
+		nbk->asleep = true;
+	}
+	/* an interrupt arrived after we sampled irq_gen has already
+	 * posted a wakeup, and the sleep returns at once */
+	nm_os_kctx_sleep(nbk->nmk, polling_sleep_us);
+}
+
 static void
 netmap_bwrap_polling(void *data)
 {
@@ -576,6 +1017,7 @@ netmap_bwrap_polling(void *data)
 	struct netmap_bwrap_adapter *bna;
 	u_int qfirst, qlast, i;
 	struct netmap_kring **kring0, *kring;
+	int work = 0;
 
 	if (!nbk)
 		return;
@@ -585,9 +1027,16 @@ netmap_bwrap_polling(void *data)
 	kring0 = NMR(bna->hwna, NR_RX);
 
 	for (i = qfirst; i < qlast; i++) {
+		u_int tail;
+
 		kring = kring0[i];
+		tail = kring->nr_hwtail;
 		kring->nm_notify(kring, 0);
+		if (kring->nr_hwtail != tail)
+			work = 1;
 	}
+	if (nbk->bps->adaptive)
+		nm_bdg_poll_backoff(nbk, work);
 }
 
 static int
@@ -609,6 +1058,9 @@ nm_bdg_create_kthreads(struct nm_bdg_polling_state *bps)
 		int affinity = bps->cpu_from + i;
 
 		t->bps = bps;
+		t->idle = 0;
+		t->asleep = false;
+		t->irq_gen = 0;
 		t->qfirst = all ? bps->qfirst /* must be 0 */: affinity;
 		t->qlast = all ? bps->qlast : t->qfirst + 1;
 		if (netmap_verbose)
@@ -666,19 +1118,243 @@ cleanup:
 }
 
 static void
-nm_bdg_polling_stop_delete_kthreads(struct nm_bdg_polling_state *bps)
+nm_bdg_polling_stop_kthreads(struct nm_bdg_polling_state *bps)
 {
 	int i;
 
-	if (!bps)
-		return;
-
 	for (i = 0; i < bps->ncpus; i++) {
 		struct nm_bdg_kthread *t = bps->kthreads + i;
 		nm_os_kctx_worker_stop(t->nmk);
+	}
+	bps->stopped = true;
+}
+
+static void
+nm_bdg_polling_delete_kthreads(struct nm_bdg_polling_state *bps)
+{
+	int i;
+
+	for (i = 0; i < bps->ncpus; i++) {
+		struct nm_bdg_kthread *t = bps->kthreads + i;
 		nm_os_kctx_destroy(t->nmk);
 	}
+	nm_os_free(bps->kthreads);
+}
+
+/*
+ * Shared polling (NETMAP_POLLING_MODE_SHARED): a single pool of kthreads
+ * serves all the ports that enable it. Each kthread owns a list of
+ * krings, whose nm_notify() does the work:
+ *   - the rx krings of the NIC (netmap_bwrap_intr_notify()) move the
+ *     received packets into the switch;
+ *   - the rx krings of the bwrap (netmap_bwrap_notify()) reclaim the
+ *     completed NIC tx slots and push out the packets that did not fit,
+ *     which would otherwise wait for the next packet from the switch,
+ *     as the NIC interrupts are disabled.
+ * Whenever a port joins or leaves, the kthreads are stopped and the
+ * krings of all the ports are redistributed round robin among them.
+ * The pool and its list of ports are protected by NMG_LOCK.
+ */
+struct nm_bdg_pool_thread {
+	struct nm_kctx *nmk;
+	struct netmap_kring **work;
+	u_int nwork;
+};
+
+struct nm_bdg_pool {
+	u_int nthreads;
+	u_int cpu_from;
+	struct nm_bdg_polling_state *ports;
+	struct nm_bdg_pool_thread *threads;
+};
+
+static struct nm_bdg_pool *nm_bdg_pool;
+
+static void
+nm_bdg_pool_worker(void *data)
+{
+	struct nm_bdg_pool_thread *t = data;
+	u_int i;
+
+	for (i = 0; i < t->nwork; i++) {
+		struct netmap_kring *kring = t->work[i];
+
+		kring->nm_notify(kring, 0);
+	}
+}
+
+static void
+nm_bdg_pool_stop(struct nm_bdg_pool *p)
+{
+	u_int i;
+
+	for (i = 0; i < p->nthreads; i++) {
+		struct nm_bdg_pool_thread *t = p->threads + i;
+
+		if (t->nmk) {
+			nm_os_kctx_worker_stop(t->nmk);
+			nm_os_kctx_destroy(t->nmk);
+			t->nmk = NULL;
+		}
+		if (t->work) {
+			nm_os_free(t->work);
+			t->work = NULL;
+		}
+		t->nwork = 0;
+	}
+}
+
+static int
+nm_bdg_pool_start(struct nm_bdg_pool *p)
+{
+	struct nm_bdg_polling_state *bps;
+	struct nm_kctx_cfg kcfg;
+	u_int i, k, total = 0, per_thread;
+	int error;
+
+	for (bps = p->ports; bps; bps = bps->pool_next) {
+		struct netmap_adapter *hwna = bps->bna->hwna;
+
+		total += nma_get_nrings(hwna, NR_RX) +
+			nma_get_nrings(hwna, NR_TX);
+	}
+	per_thread = (total + p->nthreads - 1) / p->nthreads;
+	for (i = 0; i < p->nthreads; i++) {
+		struct nm_bdg_pool_thread *t = p->threads + i;
+
+		t->work = nm_os_malloc(sizeof(*t->work) * per_thread);
+		if (t->work == NULL) {
+			error = ENOMEM;
+			goto cleanup;
+		}
+	}
+
+	k = 0;
+	for (bps = p->ports; bps; bps = bps->pool_next) {
+		struct netmap_bwrap_adapter *bna = bps->bna;
+		struct netmap_adapter *hwna = bna->hwna;
+		u_int nrx = nma_get_nrings(hwna, NR_RX);
+		u_int ntx = nma_get_nrings(hwna, NR_TX);
+
+		for (i = 0; i < nrx || i < ntx; i++) {
+			struct nm_bdg_pool_thread *t;
+
+			if (i < nrx) {
+				t = p->threads + (k++ % p->nthreads);
+				t->work[t->nwork++] = hwna->rx_rings[i];
+			}
+			if (i < ntx) {
+				t = p->threads + (k++ % p->nthreads);
+				t->work[t->nwork++] = bna->up.up.rx_rings[i];
+			}
+		}
+	}
+
+	bzero(&kcfg, sizeof(kcfg));
+	kcfg.worker_fn = nm_bdg_pool_worker;
+	for (i = 0; i < p->nthreads; i++) {
+		struct nm_bdg_pool_thread *t = p->threads + i;
+
+		if (t->nwork == 0)
+			continue;
+		kcfg.type = i;
+		kcfg.worker_private = t;
+		t->nmk = nm_os_kctx_create(&kcfg, NULL);
+		if (t->nmk == NULL) {
+			error = EFAULT;
+			goto cleanup;
+		}
+		nm_os_kctx_worker_setaff(t->nmk, p->cpu_from + i);
+		error = nm_os_kctx_worker_start(t->nmk);
+		if (error) {
+			nm_prerr("error in nm_kthread_start(): %d", error);
+			nm_os_kctx_destroy(t->nmk);
+			t->nmk = NULL;
+			goto cleanup;
+		}
+		if (netmap_verbose)
+			nm_prinf("pool kthread %u a:%u krings:%u", i,
+				p->cpu_from + i, t->nwork);
+	}
+	return 0;
+
+cleanup:
+	nm_bdg_pool_stop(p);
+	return error;
+}
+
+static int
+nm_bdg_pool_join(struct nm_bdg_polling_state *bps)
+{
+	struct nm_bdg_pool *p = nm_bdg_pool;
+	int error;
+
+	NMG_LOCK_ASSERT();
+	if (p == NULL) {
+		p = nm_os_malloc(sizeof(*p));
+		if (p == NULL)
+			return ENOMEM;
+		p->threads = nm_os_malloc(sizeof(*p->threads) * bps->ncpus);
+		if (p->threads == NULL) {
+			nm_os_free(p);
+			return ENOMEM;
+		}
+		p->nthreads = bps->ncpus;
+		p->cpu_from = bps->cpu_from;
+		p->ports = NULL;
+		nm_bdg_pool = p;
+	} else if (p->nthreads != bps->ncpus || p->cpu_from != bps->cpu_from) {
+		nm_prerr("the polling pool runs on cpus %u-%u",
+			p->cpu_from, p->cpu_from + p->nthreads - 1);
+		return EBUSY;
+	} else {
+		nm_bdg_pool_stop(p);
+	}
+
+	bps->pool_next = p->ports;
+	p->ports = bps;
+	error = nm_bdg_pool_start(p);
+	if (error) {
+		p->ports = bps->pool_next;
+		bps->pool_next = NULL;
+		if (p->ports == NULL) {
+			nm_os_free(p->threads);
+			nm_os_free(p);
+			nm_bdg_pool = NULL;
+		} else if (nm_bdg_pool_start(p)) {
+			nm_prerr("failed to restart the polling pool");
+		}
+		return error;
+	}
+	bps->stopped = false;
+	return 0;
+}
+
+static void
+nm_bdg_pool_leave(struct nm_bdg_polling_state *bps)
+{
+	struct nm_bdg_pool *p = nm_bdg_pool;
+	struct nm_bdg_polling_state **pp;
+
+	NMG_LOCK_ASSERT();
+	if (p == NULL)
+		return;
+	nm_bdg_pool_stop(p);
+	for (pp = &p->ports; *pp; pp = &(*pp)->pool_next) {
+		if (*pp == bps) {
+			*pp = bps->pool_next;
+			break;
+		}
+	}
+	bps->pool_next = NULL;
 	bps->stopped = true;
+	if (p->ports == NULL) {
+		nm_os_free(p->threads);
+		nm_os_free(p);
+		nm_bdg_pool = NULL;
+	} else if (nm_bdg_pool_start(p)) {
+		nm_prerr("failed to restart the polling pool");
+	}
 }
 
 static int
@@ -725,6 +1401,18 @@ get_polling_cfg(struct nmreq_vale_polling *req, struct netmap_adapter *na,
 		qfirst = 0;
 		qlast = nma_get_nrings(na, NR_RX);
 		core_from = i;
+	} else if (req->nr_mode == NETMAP_POLLING_MODE_SHARED) {
+		/* All the rings join the shared pool, which runs
+		 * nr_num_polling_cpus kthreads starting at core
+		 * nr_first_cpu_id. */
+		if (req->nr_flags & NETMAP_POLLING_ADAPTIVE) {
+			nm_prerr("adaptive polling is not supported by the "
+				"shared pool");
+			return EINVAL;
+		}
+		qfirst = 0;
+		qlast = nma_get_nrings(na, NR_RX);
+		core_from = i;
 	} else {
 		nm_prerr("Invalid polling mode");
 		return EINVAL;
@@ -736,8 +1424,9 @@ get_polling_cfg(struct nmreq_vale_polling *req, struct netmap_adapter *na,
 	bps->cpu_from = core_from;
 	bps->ncpus = req_cpus;
 	nm_prinf("%s qfirst %u qlast %u cpu_from %u ncpus %u",
-		req->nr_mode == NETMAP_POLLING_MODE_MULTI_CPU ?
-		"MULTI" : "SINGLE",
+		req->nr_mode == NETMAP_POLLING_MODE_MULTI_CPU ? "MULTI" :
+		req->nr_mode == NETMAP_POLLING_MODE_SHARED ? "SHARED" :
+		"SINGLE",
 		qfirst, qlast, core_from, req_cpus);
 	return 0;
 }
@@ -760,16 +1449,39 @@ nm_bdg_ctl_polling_start(struct nmreq_vale_polling *req, struct netmap_adapter *
 		return ENOMEM;
 	bps->configured = false;
 	bps->stopped = true;
+	bps->adaptive = !!(req->nr_flags & NETMAP_POLLING_ADAPTIVE);
+	bps->pool_next = NULL;
+	bps->kthreads = NULL;
+	bps->sleepers = 0;
+	bps->irq_gen = 0;
 
 	if (get_polling_cfg(req, na, bps)) {
 		nm_os_free(bps);
 		return EINVAL;
 	}
 
+	if (bps->mode == NETMAP_POLLING_MODE_SHARED) {
+		bps->bna = bna;
+		NM_MTX_INIT(bps->intr_lock);
+		/* disable interrupts if possible */
+		nma_intr_enable(bna->hwna, 0);
+		error = nm_bdg_pool_join(bps);
+		if (error) {
+			nma_intr_enable(bna->hwna, 1);
+			NM_MTX_DESTROY(bps->intr_lock);
+			nm_os_free(bps);
+			return error;
+		}
+		bps->configured = true;
+		bna->na_polling_state = bps;
+		return 0;
+	}
+
 	if (nm_bdg_create_kthreads(bps)) {
 		nm_os_free(bps);
 		return EFAULT;
 	}
+	NM_MTX_INIT(bps->intr_lock);
 
 	bps->configured = true;
 	bna->na_polling_state = bps;
@@ -781,9 +1493,11 @@ nm_bdg_ctl_polling_start(struct nmreq_vale_polling *req, struct netmap_adapter *
 	error = nm_bdg_polling_start_kthreads(bps);
 	if (error) {
 		nm_prerr("ERROR nm_bdg_polling_start_kthread()");
-		nm_os_free(bps->kthreads);
-		nm_os_free(bps);
 		bna->na_polling_state = NULL;
+		nm_bdg_sync(bna->up.na_bdg);
+		nm_bdg_polling_delete_kthreads(bps);
+		NM_MTX_DESTROY(bps->intr_lock);
+		nm_os_free(bps);
 		nma_intr_enable(bna->hwna, 1);
 	}
 	return error;
@@ -800,10 +1514,22 @@ nm_bdg_ctl_polling_stop(struct netmap_adapter *na)
 		return EFAULT;
 	}
 	bps = bna->na_polling_state;
-	nm_bdg_polling_stop_delete_kthreads(bna->na_polling_state);
+	if (bps->mode == NETMAP_POLLING_MODE_SHARED) {
+		nm_bdg_pool_leave(bps);
+	} else {
+		nm_bdg_polling_stop_kthreads(bps);
+	}
+	/* the sleeping kthreads may have left the interrupts on: turn
+	 * them off and wait for the handlers that may still look at bps
+	 * (netmap_bwrap_intr_notify()) before freeing it */
+	nma_intr_enable(bna->hwna, 0);
+	bna->na_polling_state = NULL;
+	nm_bdg_sync(bna->up.na_bdg);
+	if (bps->mode != NETMAP_POLLING_MODE_SHARED)
+		nm_bdg_polling_delete_kthreads(bps);
 	bps->configured = false;
+	NM_MTX_DESTROY(bps->intr_lock);
 	nm_os_free(bps);
-	bna->na_polling_state = NULL;
 	/* reenable interrupts */
 	nma_intr_enable(bna->hwna, 1);
 	return 0;
@@ -866,25 +1592,29 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 		goto unlock_regops;
 	}
 
-	BDG_WLOCK(b);
 	if (!bdg_ops) {
 		/* resetting the bridge */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
 		b->bdg_ops = b->bdg_saved_ops;
 		b->private_data = b->ht;
+		/* nobody uses the table after the sync */
+		nm_bdg_publish_lookup(b);
+		nm_bdg_ht_flush(b->ht, -1);
 	} else {
 		/* modifying the bridge */
 		b->private_data = private_data;
 #define nm_bdg_override(m) if (bdg_ops->m) b->bdg_ops.m = bdg_ops->m
 		nm_bdg_override(lookup);
+		/* the default batch lookup would bypass a custom lookup */
+		if (bdg_ops->lookup)
+			b->bdg_ops.lookup_batch = NULL;
+		nm_bdg_override(lookup_batch);
 		nm_bdg_override(config);
 		nm_bdg_override(dtor);
 		nm_bdg_override(vp_create);
 		nm_bdg_override(bwrap_attach);
 #undef nm_bdg_override
-
+		nm_bdg_publish_lookup(b);
 	}
-	BDG_WUNLOCK(b);
 
 unlock_regops:
 	NMG_UNLOCK();
@@ -897,6 +1627,7 @@ netmap_bdg_config(struct nm_ifreq *nr)
 {
 	struct nm_bridge *b;
 	int error = EINVAL;
+	u_int e;
 
 	NMG_LOCK();
 	b = nm_find_bridge(nr->nifr_name, 0, NULL);
@@ -905,11 +1636,12 @@ netmap_bdg_config(struct nm_ifreq *nr)
 		return error;
 	}
 	NMG_UNLOCK();
-	/* Don't call config() with NMG_LOCK() held */
-	BDG_RLOCK(b);
+	/* Don't call config() with NMG_LOCK() held. netmap_bdg_regops()
+	 * waits for us before the module can go away. */
+	e = nm_bdg_epoch_enter(b);
 	if (b->bdg_ops.config != NULL)
 		error = b->bdg_ops.config(nr);
-	BDG_RUNLOCK(b);
+	nm_bdg_epoch_exit(b, e);
 	return error;
 }
 
@@ -923,11 +1655,6 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 	enum txrx t;
 	int i;
 
-	/* persistent ports may be put in netmap mode
-	 * before being attached to a bridge
-	 */
-	if (vpna->na_bdg)
-		BDG_WLOCK(vpna->na_bdg);
 	if (onoff) {
 		for_rx_tx(t) {
 			for (i = 0; i < netmap_real_rings(na, t); i++) {
@@ -953,9 +1680,14 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 					kring->nr_mode = NKR_NETMAP_OFF;
 			}
 		}
+		/* the rings may go away when we return, wait for the
+		 * senders that still see them on. Persistent ports may
+		 * be put in netmap mode before being attached to a
+		 * bridge.
+		 */
+		if (vpna->na_bdg)
+			nm_bdg_sync(vpna->na_bdg);
 	}
-	if (vpna->na_bdg)
-		BDG_WUNLOCK(vpna->na_bdg);
 	return 0;
 }
 
@@ -1115,6 +1847,8 @@ netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
 	struct netmap_bwrap_adapter *bna = na->na_private;
 	struct netmap_kring *bkring;
 	struct netmap_vp_adapter *vpna = &bna->up;
+	struct nm_bdg_polling_state *bps;
+	struct nm_bridge *b;
 	u_int ring_nr = kring->ring_id;
 	int ret = NM_IRQ_COMPLETED;
 	int error;
@@ -1124,6 +1858,26 @@ netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
 
 	bkring = vpna->up.tx_rings[ring_nr];
 
+	/* in polling mode interrupts only arrive while the adaptive
+	 * kthreads sleep (the kthreads also come through here, without
+	 * NKR_PENDINTR): wake them up */
+	b = vpna->na_bdg;
+	if (b && (kring->nr_kflags & NKR_PENDINTR)) {
+		u_int e = nm_bdg_epoch_enter(b);
+
+		bps = NM_ACCESS_ONCE(bna->na_polling_state);
+		if (bps) {
+			bps->irq_gen++;
+			if (bps->adaptive && bps->kthreads) {
+				u_int i;
+
+				for (i = 0; i < bps->ncpus; i++)
+					nm_os_kctx_wakeup(bps->kthreads[i].nmk);
+			}
+		}
+		nm_bdg_epoch_exit(b, e);
+	}
+
 	/* make sure the ring is not disabled */
 	if (nm_kr_tryget(kring, 0 /* can't sleep */, NULL)) {
 		return EIO;
@@ -1265,6 +2019,7 @@ netmap_bwrap_reg(struct netmap_adapter *na, int onoff)
 		hwna->na_lut.plut = NULL;
 		hwna->na_lut.objtotal = 0;
 		hwna->na_lut.objsize = 0;
+		hwna->na_lut.vbase = NULL;
 
 		/* pass ownership of the netmap rings to the hwna */
 		for_rx_tx(t) {
@@ -1617,27 +2372,15 @@ err_put:
 struct nm_bridge *
 netmap_init_bridges2(u_int n)
 {
-	int i;
-	struct nm_bridge *b;
-
-	b = nm_os_malloc(sizeof(struct nm_bridge) * n);
-	if (b == NULL)
-		return NULL;
-	for (i = 0; i < n; i++)
-		BDG_RWINIT(&b[i]);
-	return b;
+	/* zeroed, which is also the initial state of the epochs */
+	return nm_os_malloc(sizeof(struct nm_bridge) * n);
 }
 
 void
 netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
 {
-	int i;
-
 	if (b == NULL)
 		return;
-
-	for (i = 0; i < n; i++)
-		BDG_RWDESTROY(&b[i]);
 	nm_os_free(b);
 }
 
@@ -1647,7 +2390,8 @@ netmap_init_bridges(void)
 #ifdef CONFIG_NET_NS
 	return netmap_bns_register();
 #else
-	nm_bridges = netmap_init_bridges2(NM_BRIDGES);
+	nm_num_bridges = netmap_bridges > 0 ? netmap_bridges : 1;
+	nm_bridges = netmap_init_bridges2(nm_num_bridges);
 	if (nm_bridges == NULL)
 		return ENOMEM;
 	return 0;
@@ -1660,6 +2404,6 @@ netmap_uninit_bridges(void)
 #ifdef CONFIG_NET_NS
 	netmap_bns_unregister();
 #else
-	netmap_uninit_bridges2(nm_bridges, NM_BRIDGES);
+	netmap_uninit_bridges2(nm_bridges, nm_num_bridges);
 #endif
 }
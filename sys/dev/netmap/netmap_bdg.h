@@ -31,16 +31,12 @@
 #define _NET_NETMAP_BDG_H_
 
 #if defined(__FreeBSD__)
-#define BDG_RWLOCK_T		struct rwlock // struct rwlock
-
-#define	BDG_RWINIT(b)		\
-	rw_init_flags(&(b)->bdg_lock, "bdg lock", RW_NOWITNESS)
-#define BDG_WLOCK(b)		rw_wlock(&(b)->bdg_lock)
-#define BDG_WUNLOCK(b)		rw_wunlock(&(b)->bdg_lock)
-#define BDG_RLOCK(b)		rw_rlock(&(b)->bdg_lock)
-#define BDG_RTRYLOCK(b)		rw_try_rlock(&(b)->bdg_lock)
-#define BDG_RUNLOCK(b)		rw_runlock(&(b)->bdg_lock)
-#define BDG_RWDESTROY(b)	rw_destroy(&(b)->bdg_lock)
+/* reader counters of the bridge epochs, see nm_bdg_sync() */
+#define BDG_ATOMIC_T		volatile u_int
+#define BDG_ATOMIC_INC(p)	atomic_add_int((p), 1)
+#define BDG_ATOMIC_DEC(p)	atomic_subtract_int((p), 1)
+#define BDG_ATOMIC_READ(p)	atomic_load_acq_int(p)
+#define BDG_MB()		atomic_thread_fence_seq_cst()
 
 #endif /* __FreeBSD__ */
 
@@ -55,6 +51,17 @@
  */
 typedef uint32_t (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
 		struct netmap_vp_adapter *, void *private_data);
+/*
+ * Optional lookup over a whole batch of n slots. For the first fragment
+ * of each packet the function must set ft_dst_port and may change
+ * ft_dst_ring, as the scalar lookup does with its return value and
+ * *ring_nr. Packets with ft_dst_port already set to NM_BDG_NOPORT must
+ * be skipped. When present, it is used instead of the scalar lookup.
+ * Unlike the scalar lookup, it may also return NM_BDG_MCAST(g) to send
+ * a packet to the members of group g of the bridge forwarding table.
+ */
+typedef void (*bdg_lookup_batch_fn_t)(struct nm_bdg_fwd *ft, u_int n,
+		struct netmap_vp_adapter *, void *private_data);
 typedef int (*bdg_config_fn_t)(struct nm_ifreq *);
 typedef void (*bdg_dtor_fn_t)(const struct netmap_vp_adapter *);
 typedef void *(*bdg_update_private_data_fn_t)(void *private_data, void *callback_data, int *error);
@@ -64,6 +71,7 @@ typedef int (*bdg_vp_create_fn_t)(struct nmreq_header *hdr,
 typedef int (*bdg_bwrap_attach_fn_t)(const char *nr_name, struct netmap_adapter *hwna);
 struct netmap_bdg_ops {
 	bdg_lookup_fn_t lookup;
+	bdg_lookup_batch_fn_t lookup_batch;
 	bdg_config_fn_t config;
 	bdg_dtor_fn_t	dtor;
 	bdg_vp_create_fn_t	vp_create;
@@ -73,18 +81,87 @@ struct netmap_bdg_ops {
 int netmap_bwrap_attach(const char *name, struct netmap_adapter *, struct netmap_bdg_ops *);
 int netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *private_data, void *auth_token);
 
-#define	NM_BRIDGES		8	/* number of bridges */
-#define	NM_BDG_MAXPORTS		254	/* up to 254 */
+#define	NM_BRIDGES		8	/* default number of bridges */
+/*
+ * Ports are allocated on demand, starting from NM_BDG_MINPORTS and
+ * doubling up to NM_BDG_MAXPORTS. Port numbers must fit in 12 bits,
+ * since (port, ring) pairs are stored in 16 bits in nm_vale_flush().
+ */
+#define	NM_BDG_MINPORTS		16
+#define	NM_BDG_MAXPORTS		4094
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
 #define	NM_BDG_NOPORT		(NM_BDG_MAXPORTS+1)
+/* lookup result for the multicast group g of the bridge forwarding table */
+#define	NM_BDG_MCAST(g)		(NM_BDG_NOPORT+1+(g))
 
-/* XXX Should go away after fixing find_bridge() - Michio */
-#define NM_BDG_HASH		1024	/* forwarding table entries */
+/*
+ * Forwarding table of the learning bridge. The table is organized
+ * in buckets of NM_BDG_HASH_WAYS entries (one cache line each), and
+ * a MAC address can be stored in any entry of its bucket.
+ * The number of buckets is a power of 2 and can be changed at runtime
+ * with NETMAP_REQ_VALE_FDB_SET.
+ */
+#define NM_BDG_HASH		1024	/* default number of buckets */
+#define NM_BDG_HASH_MIN		64
+#define NM_BDG_HASH_MAX		(1 << 18)
+#define NM_BDG_HASH_WAYS	4	/* entries per bucket */
+#define NM_BDG_AGEING		300	/* default ageing time (seconds) */
 
-/* XXX revise this */
 struct nm_hash_ent {
-	uint64_t	mac;	/* the top 2 bytes are the epoch */
-	uint64_t	ports;
+	uint64_t	mac;	/* the top 2 bytes hold NM_HASH_ENT_VALID */
+	uint32_t	ports;
+	uint32_t	ts;	/* last time the address was seen */
+};
+#define NM_HASH_ENT_VALID	(1ULL << 48)
+
+/*
+ * Multicast groups learned by IGMP/MLD snooping. Groups are identified
+ * by their MAC address; NM_MCAST_TS(ht, p, g) is the time of the last
+ * membership report for group g seen on port p, or 0 if p is not a
+ * member. Slots are allocated in order, so only the first ht_mcast_used
+ * may be in use. One more column, NM_BDG_MCAST_ROUTER, holds the time
+ * of the last query seen on each port, i.e. the multicast routers.
+ * The timestamps are allocated together with the ports of the bridge,
+ * see nm_bdg_grow().
+ */
+#define NM_BDG_MCAST_GROUPS	64
+#define NM_BDG_MCAST_ROUTER	NM_BDG_MCAST_GROUPS
+#define NM_BDG_MCAST_COLS	(NM_BDG_MCAST_GROUPS + 1)
+#define NM_MCAST_TS(ht, p, g)	((ht)->ht_mcast_ts[(p) * NM_BDG_MCAST_COLS + (g)])
+
+struct nm_vale_cls;	/* match/action rules, see netmap_vale.c */
+
+/* Lookup counters of one CPU, in a cache line of their own, so that
+ * the senders running on different CPUs do not share them. */
+struct nm_ht_pcpu {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	pad[6];
+};
+
+struct nm_hash_table {
+	struct nm_hash_ent *ht_ent;	/* NM_BDG_HASH_WAYS per bucket */
+	uint32_t	ht_buckets;
+	uint32_t	ht_ageing;	/* seconds, 0 means no ageing */
+	uint64_t	ht_mcast[NM_BDG_MCAST_GROUPS];	/* group addresses */
+	uint32_t	*ht_mcast_ts;	/* see NM_MCAST_TS() */
+	uint32_t	ht_mcast_used;
+	uint32_t	ht_mcast_ports;	/* ports in ht_mcast_ts */
+	/* rules applied before the lookup, set with
+	 * NETMAP_REQ_VALE_RULES_SET, NULL if none */
+	struct nm_vale_cls *ht_cls;
+	/* statistics, updated without locks */
+	struct nm_ht_pcpu *ht_pcpu;	/* ht_ncpus entries */
+	uint32_t	ht_ncpus;
+	uint64_t	ht_learned;
+	uint64_t	ht_evictions;
+	uint64_t	ht_expired;
+};
+
+struct nm_bdg_lookup {
+	bdg_lookup_fn_t		lookup;
+	bdg_lookup_batch_fn_t	lookup_batch;
+	void			*private_data;
 };
 
 /* Default size for the Maximum Frame Size. */
@@ -100,25 +177,32 @@ struct nm_hash_ent {
  * The bridge is non blocking on the transmit ports: excess
  * packets are dropped if there is no room on the output port.
  *
- * bdg_lock protects accesses to the bdg_ports array.
- * This is a rw lock (or equivalent).
+ * The datapath does not lock the bridge. Each batch runs within
+ * nm_bdg_epoch_enter()/nm_bdg_epoch_exit(), and the writers (which
+ * hold NMG_LOCK) publish the new state and then call nm_bdg_sync()
+ * to wait for the readers that may still be using the old one,
+ * before freeing it. The arrays below are only grown or replaced,
+ * never shrunk in place.
  */
 #define NM_BDG_IFNAMSIZ IFNAMSIZ
 struct nm_bridge {
 	/* XXX what is the proper alignment/layout ? */
-	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ports */
+	BDG_ATOMIC_T	bdg_readers[2];	/* readers in each epoch */
+	u_int		bdg_epoch;	/* current epoch (low bit) */
 	int		bdg_namelen;
 	uint32_t	bdg_active_ports;
+	uint32_t	bdg_max_ports;	/* size of the arrays below */
 	char		bdg_basename[NM_BDG_IFNAMSIZ];
 
 	/* Indexes of active ports (up to active_ports)
 	 * and all other remaining ports.
 	 */
-	uint32_t	bdg_port_index[NM_BDG_MAXPORTS];
-	/* used by netmap_bdg_detach_common() */
-	uint32_t	tmp_bdg_port_index[NM_BDG_MAXPORTS];
+	uint32_t	*bdg_port_index;
+	/* used by netmap_bdg_detach_common() to build the new
+	 * bdg_port_index, the two are swapped on detach */
+	uint32_t	*tmp_bdg_port_index;
 
-	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
+	struct netmap_vp_adapter **bdg_ports;
 
 	/*
 	 * Programmable lookup functions to figure out the destination port.
@@ -138,7 +222,15 @@ struct nm_bridge {
 	 * otherwise will point to the data structure received by netmap_bdg_regops().
 	 */
 	void *private_data;
-	struct nm_hash_ent *ht;
+	struct nm_hash_table *ht;
+
+	/*
+	 * What the datapath uses of bdg_ops and private_data, published
+	 * as a whole by nm_bdg_publish_lookup() so that readers never
+	 * see a lookup function with the data of another one.
+	 */
+	struct nm_bdg_lookup	*bdg_lookup;
+	struct nm_bdg_lookup	bdg_lookup_buf[2];
 
 	/* Currently used to specify if the bridge is still in use while empty and
 	 * if it has been put in exclusive mode by an external module, see netmap_bdg_regops()
@@ -170,6 +262,29 @@ nm_bdg_valid_auth_token(struct nm_bridge *b, void *auth_token)
 	return !(b->bdg_flags & NM_BDG_EXCLUSIVE) || b->ht == auth_token;
 }
 
+/*
+ * Enter and leave the current epoch of the bridge. Readers may sleep
+ * within the epoch, but writers wait for them in nm_bdg_sync().
+ */
+static inline u_int
+nm_bdg_epoch_enter(struct nm_bridge *b)
+{
+	u_int e = b->bdg_epoch & 1;
+
+	BDG_ATOMIC_INC(&b->bdg_readers[e]);
+	BDG_MB();
+	return e;
+}
+
+static inline void
+nm_bdg_epoch_exit(struct nm_bridge *b, u_int e)
+{
+	BDG_MB();
+	BDG_ATOMIC_DEC(&b->bdg_readers[e]);
+}
+
+void nm_bdg_sync(struct nm_bridge *b);
+
 int netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	struct netmap_mem_d *nmd, int create, struct netmap_bdg_ops *ops);
 
@@ -191,6 +306,12 @@ int netmap_bdg_update_private_data(const char *name, bdg_update_private_data_fn_
 	void *callback_data, void *auth_token);
 int netmap_bdg_config(struct nm_ifreq *nifr);
 int nm_is_bwrap(struct netmap_adapter *);
+void netmap_bwrap_lut_refresh(struct netmap_adapter *);
+
+struct nm_hash_table *nm_bdg_ht_create(void);
+void nm_bdg_ht_destroy(struct nm_hash_table *ht);
+int nm_bdg_ht_resize(struct nm_bridge *b, u_int buckets);
+void nm_bdg_ht_flush(struct nm_hash_table *ht, int port);
 
 #define NM_NEED_BWRAP (-2)
 #endif /* _NET_NETMAP_BDG_H_ */
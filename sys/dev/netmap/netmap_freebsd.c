@@ -38,9 +38,13 @@
 #include <sys/conf.h>	/* DEV_MODULE_ORDERED */
 #include <sys/endian.h>
 #include <sys/syscallsubr.h> /* kern_ioctl() */
+#include <sys/capsicum.h> /* cap_ioctl_rights */
+#include <sys/file.h> /* fget(), fdrop() */
+#include <sys/vnode.h>
 
 #include <sys/rwlock.h>
 
+#include <sys/domainset.h> /* DOMAINSET_PREF() */
 #include <vm/vm.h>      /* vtophys */
 #include <vm/pmap.h>    /* vtophys */
 #include <vm/vm_param.h>
@@ -64,6 +68,7 @@
 #include <net/ethernet.h> /* ether_ifdetach */
 #include <net/if_dl.h> /* LLADDR */
 #include <machine/bus.h>        /* bus_dmamap_* */
+#include <machine/cpu.h>	/* cpu_spinwait() */
 #include <netinet/in.h>		/* in6_cksum_pseudo() */
 #include <machine/in_cksum.h>  /* in_pseudo(), in_cksum_hdr() */
 
@@ -109,6 +114,44 @@ nm_os_free(void *addr)
 	free(addr, M_DEVBUF);
 }
 
+/*
+ * Superpage-aligned contiguous memory is mapped with large pages by
+ * the direct map; user mappings still go through the device pager.
+ */
+void *
+nm_os_hugemalloc(size_t size, int node)
+{
+	if (node >= 0)
+		return contigmalloc_domainset(size, M_DEVBUF,
+		    DOMAINSET_PREF(node), M_NOWAIT | M_ZERO,
+		    (vm_paddr_t)0, ~(vm_paddr_t)0, size, 0);
+	return contigmalloc(size, M_DEVBUF, M_NOWAIT | M_ZERO,
+	    (vm_paddr_t)0, ~(vm_paddr_t)0, size, 0);
+}
+
+void
+nm_os_hugefree(void *addr, size_t size)
+{
+	contigfree(addr, size, M_DEVBUF);
+}
+
+void *
+nm_os_contigmalloc(size_t size, int node)
+{
+	if (node >= 0)
+		return contigmalloc_domainset(size, M_DEVBUF,
+		    DOMAINSET_PREF(node), M_NOWAIT | M_ZERO,
+		    (vm_paddr_t)0, ~(vm_paddr_t)0, PAGE_SIZE, 0);
+	return contigmalloc(size, M_DEVBUF, M_NOWAIT | M_ZERO,
+	    (vm_paddr_t)0, ~(vm_paddr_t)0, PAGE_SIZE, 0);
+}
+
+void
+nm_os_contigfree(void *addr, size_t size)
+{
+	contigfree(addr, size, M_DEVBUF);
+}
+
 void
 nm_os_ifnet_lock(void)
 {
@@ -283,6 +326,42 @@ nm_os_mbuf_has_seg_offld(struct mbuf *m)
 	return m->m_pkthdr.csum_flags & CSUM_TSO;
 }
 
+u_int
+nm_os_mbuf_seg_size(struct mbuf *m)
+{
+	return (m->m_pkthdr.csum_flags & CSUM_TSO) ? m->m_pkthdr.tso_segsz : 0;
+}
+
+#if __FreeBSD_version >= 1200051
+static void
+nm_os_zcopy_free(struct mbuf *m)
+{
+	netmap_mem_buf_return(m->m_ext.ext_arg1,
+			(uint32_t)(uintptr_t)m->m_ext.ext_arg2);
+}
+#endif /* __FreeBSD_version >= 1200051 */
+
+/* lend the netmap buffer to the stack as the external storage of an mbuf */
+struct mbuf *
+nm_os_mbuf_zcopy(struct ifnet *ifp, void *buf, u_int len,
+		void *cookie, uint32_t idx)
+{
+#if __FreeBSD_version >= 1200051
+	struct mbuf *m;
+
+	m = m_gethdr(M_NOWAIT, MT_DATA);
+	if (m == NULL)
+		return NULL;
+	m_extadd(m, buf, len, nm_os_zcopy_free, cookie,
+		 (void *)(uintptr_t)idx, 0, EXT_NET_DRV);
+	m->m_len = m->m_pkthdr.len = len;
+	m->m_pkthdr.rcvif = ifp;
+	return m;
+#else
+	return NULL;
+#endif /* __FreeBSD_version >= 1200051 */
+}
+
 static void
 freebsd_generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 {
@@ -1144,6 +1223,59 @@ nm_os_ncpus(void)
 	return mp_maxid + 1;
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return curcpu;
+}
+
+uint64_t
+nm_os_nanotime(void)
+{
+	struct timespec ts;
+
+	nanotime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+extern struct cdevsw netmap_cdevsw;
+
+struct netmap_priv_d *
+nm_os_priv_get(int fd, void **filp)
+{
+	struct thread *td = curthread;
+	struct netmap_priv_d *priv = NULL;
+	struct file *fp, *fpop;
+	struct vnode *vp;
+
+	if (fget(td, fd, &cap_ioctl_rights, &fp) != 0)
+		return NULL;
+	vp = fp->f_vnode;
+	if (fp->f_type != DTYPE_VNODE || vp == NULL || vp->v_type != VCHR ||
+	    vp->v_rdev == NULL || vp->v_rdev->si_devsw != &netmap_cdevsw) {
+		fdrop(fp, td);
+		return NULL;
+	}
+	/* devfs_get_cdevpriv() looks at the file being operated upon */
+	fpop = td->td_fpop;
+	td->td_fpop = fp;
+	if (devfs_get_cdevpriv((void **)&priv) != 0)
+		priv = NULL;
+	td->td_fpop = fpop;
+	if (priv == NULL) {
+		fdrop(fp, td);
+		return NULL;
+	}
+	*filp = fp;
+	return priv;
+}
+
+void
+nm_os_priv_put(void *filp)
+{
+	fdrop((struct file *)filp, curthread);
+}
+
 struct nm_kctx_ctx {
 	/* Userspace thread (kthread creator). */
 	struct thread *user_td;
@@ -1165,6 +1297,7 @@ struct nm_kctx {
 	int run;			/* used to stop kthread */
 	int attach_user;		/* kthread attached to user_process */
 	int affinity;
+	int wakeup;			/* see nm_os_kctx_sleep() */
 };
 
 static void
@@ -1205,6 +1338,39 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	nmk->affinity = affinity;
 }
 
+void
+nm_os_kctx_pause(int how)
+{
+	switch (how) {
+	case NM_KCTX_RELAX:
+		cpu_spinwait();
+		break;
+	case NM_KCTX_YIELD:
+		kern_yield(PRI_USER);
+		break;
+	}
+}
+
+void
+nm_os_kctx_sleep(struct nm_kctx *nmk, u_int us)
+{
+	mtx_lock(&nmk->worker_lock);
+	if (!nmk->wakeup && nmk->run)
+		msleep_sbt(nmk, &nmk->worker_lock, 0, "nmkslp",
+			SBT_1US * us, SBT_1US * us / 4, 0);
+	nmk->wakeup = 0;
+	mtx_unlock(&nmk->worker_lock);
+}
+
+void
+nm_os_kctx_wakeup(struct nm_kctx *nmk)
+{
+	mtx_lock(&nmk->worker_lock);
+	nmk->wakeup = 1;
+	wakeup(nmk);
+	mtx_unlock(&nmk->worker_lock);
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, void *opaque)
 {
@@ -1271,7 +1437,10 @@ nm_os_kctx_worker_stop(struct nm_kctx *nmk)
 		return;
 
 	/* tell to kthread to exit from main loop */
+	mtx_lock(&nmk->worker_lock);
 	nmk->run = 0;
+	wakeup(nmk);
+	mtx_unlock(&nmk->worker_lock);
 
 	/* wake up kthread if it sleeps */
 	kthread_resume(nmk->worker);
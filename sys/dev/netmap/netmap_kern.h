@@ -322,6 +322,12 @@ void *nm_os_vmalloc(size_t);
 void *nm_os_realloc(void *, size_t new_size, size_t old_size);
 void nm_os_free(void *);
 void nm_os_vfree(void *);
+/* physically contiguous, size-aligned memory for hugepage clusters */
+void *nm_os_hugemalloc(size_t, int node);
+void nm_os_hugefree(void *, size_t);
+/* physically contiguous, page-aligned memory for a whole pool */
+void *nm_os_contigmalloc(size_t, int node);
+void nm_os_contigfree(void *, size_t);
 
 /* os specific attach/detach enter/exit-netmap-mode routines */
 void nm_os_onattach(struct ifnet *);
@@ -339,6 +345,22 @@ void *nm_os_send_up(struct ifnet *, struct mbuf *m, struct mbuf *prev);
 
 int nm_os_mbuf_has_seg_offld(struct mbuf *m);
 int nm_os_mbuf_has_csum_offld(struct mbuf *m);
+/* TCP segment size of a TSO/GSO mbuf, 0 if it needs some other kind
+ * of segmentation. */
+u_int nm_os_mbuf_seg_size(struct mbuf *m);
+/* Wrap len bytes of the netmap buffer buf (index idx) in an mbuf for
+ * the host stack of ifp, without copying them, or return NULL. When the
+ * stack releases the data, the OS calls netmap_mem_buf_return(cookie, idx).
+ * Only FreeBSD implements it: elsewhere it always returns NULL, and
+ * NM_OS_MBUF_ZCOPY lets the callers skip the lending altogether.
+ */
+struct mbuf *nm_os_mbuf_zcopy(struct ifnet *ifp, void *buf, u_int len,
+		void *cookie, uint32_t idx);
+#ifdef __FreeBSD__
+#define NM_OS_MBUF_ZCOPY	1
+#else
+#define NM_OS_MBUF_ZCOPY	0
+#endif
 
 #include "netmap_mbq.h"
 
@@ -414,8 +436,9 @@ struct netmap_zmon_list {
  * for NIC rings, and for TX rings attached to the host stack.
  *
  * RX rings attached to the host stack use an mbq (rx_queue) on both
- * rxsync_from_host() and netmap_transmit(). The mbq is protected
- * by its internal lock.
+ * rxsync_from_host() and netmap_transmit(). netmap_transmit() uses
+ * the lock-free multi-producer side of the mbq, while the consumers
+ * are serialized by its internal lock.
  *
  * RX rings attached to the VALE switch are accessed by both senders
  * and receiver. They are protected through the q_lock on the RX ring.
@@ -454,6 +477,9 @@ struct netmap_kring {
 #define NKR_NETMAP_ON	0x1
 
 	uint32_t	nkr_num_slots;
+	uint64_t	*nkr_tstamp;	/* per-slot rx timestamps (ns), in
+					 * the ring pool, or NULL (see
+					 * NR_RX_TSTAMP) */
 
 	/*
 	 * On a NIC reset, the NIC ring indexes may be reset but the
@@ -488,6 +514,24 @@ struct netmap_kring {
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
 	uint32_t	nkr_hwlease;
 	uint32_t	nkr_lease_idx;
+	/* deficit round robin state of the senders, see nm_vale_fair() */
+	struct nm_vale_fair *nkr_fair;
+	uint32_t	nkr_fair_round;
+	uint32_t	nkr_fair_cur;	/* nr_hwcur when the round started */
+	/* Forwarding counters, reported by NETMAP_REQ_VALE_STATS_GET.
+	 * On tx krings they are only written by the owner of the
+	 * txsync, on rx krings under q_lock, so they need no atomics.
+	 * The drop and bcast fields are only used on tx krings. */
+	struct nm_bdg_stats {
+		uint64_t	pkts;
+		uint64_t	bytes;
+		uint64_t	drop_lookup;	/* no or invalid destination */
+		uint64_t	drop_down;	/* destination not in netmap mode */
+		uint64_t	drop_nospace;	/* destination ring full */
+		uint64_t	retries;	/* lease retries */
+		uint64_t	bcast;		/* broadcast/multicast copies */
+		uint64_t	pad;		/* fill a cache line */
+	} nkr_bdg_stats;
 
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
@@ -655,6 +699,9 @@ struct netmap_lut {
 	struct plut_entry *plut;
 	uint32_t objtotal;	/* max buffer index */
 	uint32_t objsize;	/* buffer size */
+	char *vbase;		/* buffer i is at vbase + i * objsize, or
+				 * NULL if the buffers are not virtually
+				 * contiguous and lut must be used */
 };
 
 struct netmap_vp_adapter; // forward
@@ -717,7 +764,9 @@ struct netmap_adapter {
 				 */
 #define NAF_HOST_RINGS  64	/* the adapter supports the host rings */
 #define NAF_FORCE_NATIVE 128	/* the adapter is always NATIVE */
-/* free */
+#define NAF_HWTSTAMP	256	/* rxsync stores the NIC timestamp of each
+				 * new slot in nkr_tstamp (0 if the NIC
+				 * did not stamp the packet) */
 #define NAF_MOREFRAG	512	/* the adapter supports NS_MOREFRAG */
 #define NAF_ZOMBIE	(1U<<30) /* the nic driver has been unloaded */
 #define	NAF_BUSY	(1U<<31) /* the adapter is used internally and
@@ -855,6 +904,10 @@ struct netmap_adapter {
  	struct netmap_mem_d *nm_mem;
 	struct netmap_mem_d *nm_mem_prev;
 	struct netmap_lut na_lut;
+	u_int na_extra_bufs;	/* extra buffers held by the bound fds */
+	/* next adapter that cached the lut of nm_mem, see
+	 * netmap_buf_pool_grow() */
+	struct netmap_adapter *nm_mem_next;
 
 	/* additional information attached to this adapter
 	 * by other netmap subsystems. Currently used by
@@ -965,8 +1018,17 @@ struct netmap_vp_adapter {	/* VALE software port */
 
 	/* Maximum Frame Size, used in bdg_mismatch_datapath() */
 	u_int mfs;
-	/* Last source MAC on this port */
+	/* Last source MAC on this port, and when it was last learned */
 	uint64_t last_smac;
+	uint32_t last_learn;
+	/* spread incoming flows over the rx rings (NR_VALE_PORT_RXHASH) */
+	int rxhash;
+	/* swap buffers with ports on the same allocator (NR_VALE_PORT_ZCOPY) */
+	int zcopy;
+	/* share the rx rings among the senders (NR_VALE_PORT_FAIR) */
+	int fair;
+	/* share of this port as a sender, 0 means 1 */
+	u_int weight;
 };
 
 
@@ -1103,6 +1165,10 @@ int nm_bdg_polling(struct nmreq_header *hdr);
 int netmap_vale_attach(struct nmreq_header *hdr, void *auth_token);
 int netmap_vale_detach(struct nmreq_header *hdr, void *auth_token);
 int netmap_vale_list(struct nmreq_header *hdr);
+int netmap_vale_fdb(struct nmreq_header *hdr);
+int netmap_vale_port(struct nmreq_header *hdr);
+int netmap_vale_stats(struct nmreq_header *hdr);
+int netmap_vale_rules(struct nmreq_header *hdr);
 int netmap_vi_create(struct nmreq_header *hdr, int);
 int nm_vi_create(struct nmreq_header *);
 int nm_vi_destroy(const char *name);
@@ -1468,6 +1534,8 @@ int netmap_get_hw_na(struct ifnet *ifp,
 #ifdef WITH_VALE
 uint32_t netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		struct netmap_vp_adapter *, void *private_data);
+void netmap_vale_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		struct netmap_vp_adapter *, void *private_data);
 
 /* these are redefined in case of no VALE support */
 int netmap_get_vale_na(struct nmreq_header *hdr, struct netmap_adapter **na,
@@ -1519,11 +1587,13 @@ void netmap_bns_put(struct net *);
 void netmap_bns_getbridges(struct nm_bridge **, u_int *);
 #else
 extern struct nm_bridge *nm_bridges;
+extern u_int nm_num_bridges;
 #define netmap_bns_get()
 #define netmap_bns_put(_1)
 #define netmap_bns_getbridges(b, n) \
-	do { *b = nm_bridges; *n = NM_BRIDGES; } while (0)
+	do { *b = nm_bridges; *n = nm_num_bridges; } while (0)
 #endif
+extern int netmap_bridges;
 
 /* Various prototypes */
 int netmap_poll(struct netmap_priv_d *, int events, NM_SELRECORD_T *td);
@@ -1603,6 +1673,7 @@ enum {                                  /* debug flags */
 extern int netmap_txsync_retry;
 extern int netmap_flags;
 extern int netmap_generic_hwcsum;
+extern int netmap_host_zcopy;
 extern int netmap_generic_mit;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
@@ -1655,6 +1726,10 @@ extern int netmap_generic_txqdisc;
  * Returns -ENOMEM in case the domain is different */
 #define nm_iommu_group_id(dev) (0)
 
+/* NUMA node of the device (-1 if unknown), and node sanity check */
+#define nm_numa_node_id(dev) (-1)
+#define nm_numa_node_valid(n) ((n) < vm_ndomains)
+
 /* Callback invoked by the dma machinery after a successful dmamap_load */
 static void netmap_dmamap_cb(__unused void *arg,
     __unused bus_dma_segment_t * segs, __unused int nseg, __unused int error)
@@ -1701,6 +1776,8 @@ netmap_reload_map(struct netmap_adapter *na,
 #else /* linux */
 
 int nm_iommu_group_id(bus_dma_tag_t dev);
+int nm_numa_node_id(bus_dma_tag_t dev);
+#define nm_numa_node_valid(n) ((n) < nr_node_ids && node_online(n))
 #include <linux/dma-mapping.h>
 
 /*
@@ -1865,24 +1942,33 @@ struct netmap_obj_pool;
 
 /*
  * NMB return the virtual address of a buffer (buffer 0 on bad index)
+ * NMB_IDX does the same for an index the caller has already read
  * PNMB also fills the physical address
+ * When the buffer pool is virtually contiguous the address is computed
+ * from the index, and the lut is only read for the physical address.
  */
+static inline void *
+NMB_IDX(struct netmap_adapter *na, uint32_t i)
+{
+	if (unlikely(i >= na->na_lut.objtotal))
+		i = 0;
+	if (likely(na->na_lut.vbase != NULL))
+		return na->na_lut.vbase + (size_t)i * na->na_lut.objsize;
+	return na->na_lut.lut[i].vaddr;
+}
+
 static inline void *
 NMB(struct netmap_adapter *na, struct netmap_slot *slot)
 {
-	struct lut_entry *lut = na->na_lut.lut;
-	uint32_t i = slot->buf_idx;
-	return (unlikely(i >= na->na_lut.objtotal)) ?
-		lut[0].vaddr : lut[i].vaddr;
+	return NMB_IDX(na, slot->buf_idx);
 }
 
 static inline void *
 PNMB(struct netmap_adapter *na, struct netmap_slot *slot, uint64_t *pp)
 {
 	uint32_t i = slot->buf_idx;
-	struct lut_entry *lut = na->na_lut.lut;
 	struct plut_entry *plut = na->na_lut.plut;
-	void *ret = (i >= na->na_lut.objtotal) ? lut[0].vaddr : lut[i].vaddr;
+	void *ret = NMB(na, slot);
 
 #ifdef _WIN32
 	*pp = (i >= na->na_lut.objtotal) ? (uint64_t)plut[0].paddr.QuadPart : (uint64_t)plut[i].paddr.QuadPart;
@@ -2079,12 +2165,24 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
-	uint16_t ft_offset;	/* dst port (unused) */
+	uint8_t ft_dst_ring;	/* dst ring, set by the lookup */
+	uint16_t ft_offset;	/* offset of the ethernet header */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
+	uint16_t ft_dst_port;	/* dst port, set by the lookup */
+	uint32_t ft_slot;	/* src slot, for zero-copy */
+	uint32_t ft_buf_idx;	/* buffer index behind ft_buf, for zero-copy */
 };
 
+/* The fragment where the ethernet header starts, which is the second
+ * one if the first fragment only contains the virtio-net header. */
+static inline struct nm_bdg_fwd *
+nm_bdg_ft_start(struct nm_bdg_fwd *ft)
+{
+	return ft->ft_offset < ft->ft_len ? ft : ft + 1;
+}
+
 /* struct 'virtio_net_hdr' from linux. */
 struct nm_vnet_hdr {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM     1	/* Use csum_start, csum_offset */
@@ -2170,6 +2268,9 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   struct netmap_ring *dst_ring,
 			   u_int *j, u_int lim, u_int *howmany);
 
+u_int netmap_host_offload(struct netmap_kring *kring, struct mbuf *m,
+			  u_int mss, u_int nm_i, u_int avail);
+
 /* persistent virtual port routines */
 int nm_os_vi_persist(const char *, struct ifnet **);
 void nm_os_vi_detach(struct ifnet *);
@@ -2195,7 +2296,23 @@ int nm_os_kctx_worker_start(struct nm_kctx *);
 void nm_os_kctx_worker_stop(struct nm_kctx *);
 void nm_os_kctx_destroy(struct nm_kctx *);
 void nm_os_kctx_worker_setaff(struct nm_kctx *, int);
+/* back off from busy polling, called by a kctx worker */
+#define NM_KCTX_RELAX	1	/* hint the CPU that we are spinning */
+#define NM_KCTX_YIELD	2	/* let other threads run */
+void nm_os_kctx_pause(int how);
+/* Called by the worker of a kctx, sleep for at most 'us' microseconds,
+ * or until nm_os_kctx_wakeup() (callable from interrupt context) or
+ * nm_os_kctx_worker_stop(). A wakeup sent while the worker is running
+ * makes its next sleep return immediately. */
+void nm_os_kctx_sleep(struct nm_kctx *, u_int us);
+void nm_os_kctx_wakeup(struct nm_kctx *);
 u_int nm_os_ncpus(void);
+u_int nm_os_curcpu(void);
+uint64_t nm_os_nanotime(void);	/* wall clock, in nanoseconds */
+/* priv of the netmap file descriptor fd of the current process, or NULL.
+ * The file is held until nm_os_priv_put(*filp). */
+struct netmap_priv_d *nm_os_priv_get(int fd, void **filp);
+void nm_os_priv_put(void *filp);
 
 int netmap_sync_kloop(struct netmap_priv_d *priv,
 		      struct nmreq_header *hdr);
@@ -216,9 +216,13 @@ nmreq_from_legacy(struct nmreq *nmr, u_long ioctl_cmd)
 			case NR_REG_ALL_NIC:
 				req->nr_mode = NETMAP_POLLING_MODE_SINGLE_CPU;
 				break;
+			case NR_REG_NIC_SW:
+				req->nr_mode = NETMAP_POLLING_MODE_SHARED;
+				break;
 			}
 			req->nr_first_cpu_id = nmr->nr_ringid & NETMAP_RING_MASK;
 			req->nr_num_polling_cpus = nmr->nr_arg1;
+			req->nr_flags = nmr->nr_arg3 ? NETMAP_POLLING_ADAPTIVE : 0;
 			break;
 		}
 		case NETMAP_PT_HOST_CREATE:
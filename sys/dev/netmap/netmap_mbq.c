@@ -50,6 +50,8 @@ static inline void __mbq_init(struct mbq *q)
 {
     q->head = q->tail = NULL;
     q->count = 0;
+    q->inbox = NULL;
+    mbq_atomic_set(&q->inbox_len, 0);
 }
 
 
@@ -129,11 +131,67 @@ struct mbuf *mbq_dequeue(struct mbq *q)
 }
 
 
+void mbq_mpsc_enqueue(struct mbq *q, struct mbuf *m)
+{
+    struct mbuf *first;
+
+    /* Count the mbuf first, so that inbox_len never underflows
+     * in mbq_mpsc_drain(). */
+    mbq_atomic_add(&q->inbox_len, 1);
+    do {
+        first = q->inbox;
+        m->m_nextpkt = first;
+    } while (!mbq_cmpset_rel_ptr(&q->inbox, first, m));
+}
+
+
+unsigned int mbq_mpsc_drain(struct mbq *q)
+{
+    struct mbuf *m, *next, *last, *list = NULL;
+    unsigned int n = 0;
+
+    /* Detach the whole inbox; it is never popped one mbuf at a time,
+     * so there is no ABA problem. */
+    do {
+        m = q->inbox;
+    } while (m != NULL && !mbq_cmpset_acq_ptr(&q->inbox, m, NULL));
+
+    /* The inbox is a stack, reverse it to get the FIFO order. */
+    for (last = m; m != NULL; m = next) {
+        next = m->m_nextpkt;
+        m->m_nextpkt = list;
+        list = m;
+        n++;
+    }
+    if (n == 0)
+        return 0;
+    mbq_atomic_add(&q->inbox_len, -(int)n);
+
+    /* Append the batch to the queue in one step. */
+    if (q->tail) {
+        q->tail->m_nextpkt = list;
+    } else {
+        q->head = list;
+    }
+    q->tail = last;
+    q->count += n;
+
+    return n;
+}
+
+
 /* XXX seems pointless to have a generic purge */
 static void __mbq_purge(struct mbq *q, int safe)
 {
     struct mbuf *m;
 
+    if (safe) {
+        mbq_lock(q);
+        mbq_mpsc_drain(q);
+        mbq_unlock(q);
+    } else {
+        mbq_mpsc_drain(q);
+    }
     for (;;) {
         m = safe ? mbq_safe_dequeue(q) : mbq_dequeue(q);
         if (m) {
@@ -43,18 +43,45 @@
 /* XXX probably rely on a previous definition of SPINLOCK_T */
 #ifdef linux
 #define SPINLOCK_T  safe_spinlock_t
+#define MBQ_ATOMIC_T			atomic_t
+#define mbq_atomic_set(p, v)		atomic_set((p), (v))
+#define mbq_atomic_add(p, v)		atomic_add((v), (p))
+#define mbq_atomic_read(p)		atomic_read(p)
+#define mbq_cmpset_rel_ptr(p, o, n)	(cmpxchg((p), (o), (n)) == (o))
+#define mbq_cmpset_acq_ptr(p, o, n)	(cmpxchg((p), (o), (n)) == (o))
 #elif defined (_WIN32)
 #define SPINLOCK_T 	win_spinlock_t
+#define MBQ_ATOMIC_T			volatile LONG
+#define mbq_atomic_set(p, v)		InterlockedExchange((p), (v))
+#define mbq_atomic_add(p, v)		InterlockedExchangeAdd((p), (v))
+#define mbq_atomic_read(p)		(*(p))
+#define mbq_cmpset_rel_ptr(p, o, n)	\
+	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o)) == (o))
+#define mbq_cmpset_acq_ptr(p, o, n)	mbq_cmpset_rel_ptr(p, o, n)
 #else
 #define SPINLOCK_T  struct mtx
+#define MBQ_ATOMIC_T			volatile u_int
+#define mbq_atomic_set(p, v)		atomic_store_rel_int((p), (v))
+#define mbq_atomic_add(p, v)		atomic_add_int((p), (v))
+#define mbq_atomic_read(p)		atomic_load_acq_int(p)
+#define mbq_cmpset_rel_ptr(p, o, n)	atomic_cmpset_rel_ptr( \
+	(volatile uintptr_t *)(p), (uintptr_t)(o), (uintptr_t)(n))
+#define mbq_cmpset_acq_ptr(p, o, n)	atomic_cmpset_acq_ptr( \
+	(volatile uintptr_t *)(p), (uintptr_t)(o), (uintptr_t)(n))
 #endif
 
-/* A FIFO queue of mbufs with an optional lock. */
+/* A FIFO queue of mbufs with an optional lock.
+ * Producers that do not want to take the lock can instead push mbufs
+ * on the lock-free 'inbox' stack (mbq_mpsc_enqueue()), which the
+ * consumer moves into the queue in batches (mbq_mpsc_drain()).
+ */
 struct mbq {
     struct mbuf *head;
     struct mbuf *tail;
     int count;
     SPINLOCK_T lock;
+    struct mbuf * volatile inbox;	/* LIFO, linked by m_nextpkt */
+    MBQ_ATOMIC_T inbox_len;
 };
 
 /* We should clarify whether init can be used while
@@ -96,4 +123,19 @@ static inline unsigned int mbq_len(struct mbq *q)
     return q->count;
 }
 
+/* Multi-producer side of the queue: mbq_mpsc_enqueue() can be called
+ * concurrently without holding the lock, while mbq_mpsc_drain() must be
+ * called with the lock held (or by the only user of the queue). It
+ * appends the pending mbufs to the queue in enqueue order, and returns
+ * how many they were.
+ */
+void mbq_mpsc_enqueue(struct mbq *q, struct mbuf *m);
+unsigned int mbq_mpsc_drain(struct mbq *q);
+
+/* Queued plus pending mbufs, only a hint without the lock. */
+static inline unsigned int mbq_mpsc_len(struct mbq *q)
+{
+    return q->count + mbq_atomic_read(&q->inbox_len);
+}
+
 #endif /* _NET_NETMAP_MBQ_H_ */
@@ -44,8 +44,10 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 241723 2012-10-19 09:41:45Z gle
 #include <sys/malloc.h>
 #include <sys/kernel.h>		/* MALLOC_DEFINE */
 #include <sys/proc.h>
+#include <sys/domainset.h>	/* DOMAINSET_PREF() */
 #include <vm/vm.h>	/* vtophys */
 #include <vm/pmap.h>	/* vtophys */
+#include <vm/vm_phys.h>	/* vm_ndomains */
 #include <sys/socket.h> /* sockaddrs */
 #include <sys/selinfo.h>
 #include <sys/sysctl.h>
@@ -53,6 +55,7 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 241723 2012-10-19 09:41:45Z gle
 #include <net/if_var.h>
 #include <net/vnet.h>
 #include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/taskqueue.h>
 
 /* M_NETMAP only used in here */
 MALLOC_DECLARE(M_NETMAP);
@@ -67,6 +70,9 @@ MALLOC_DEFINE(M_NETMAP, "netmap", "Network memory map");
 #include <net/netmap.h>
 #include <dev/netmap/netmap_kern.h>
 #include <net/netmap_virt.h>
+#ifdef WITH_VALE
+#include <dev/netmap/netmap_bdg.h>	/* netmap_bwrap_lut_refresh() */
+#endif /* WITH_VALE */
 #include "netmap_mem2.h"
 
 #ifdef _WIN32_USE_SMALL_GENERIC_DEVICES_MEMORY
@@ -94,6 +100,31 @@ struct netmap_obj_params {
 	u_int last_num;
 };
 
+/*
+ * Buffers of the pool lent to the host stack by netmap_mem_bufs_lend(),
+ * created on the first loan. The stack returns them from any context
+ * with netmap_mem_buf_return(), which only appends the index to ret[]
+ * under the loans lock; they go back to the pool the next time the
+ * allocator lock is taken to lend or to reset the pool, or from a
+ * task scheduled when the last lent buffer comes back, as no port may
+ * be left to take the allocator lock.
+ * The allocator holds a reference to itself while buffers are out or
+ * the task is pending, and neither reclaims nor reconfigures the lent
+ * buffers.
+ */
+struct netmap_buf_loans {
+	NM_LOCK_T lock;		/* protects the fields below, but lentmap */
+	u_int lent;		/* out of the pool, also NMA_LOCK to change */
+	u_int max;		/* entries of ret[] */
+	u_int nret;		/* returned indices in ret[] */
+	int done_pending;	/* done_task is scheduled */
+#ifdef __FreeBSD__
+	struct task done_task;	/* runs netmap_buf_loans_done() */
+#endif
+	uint32_t *lentmap;	/* bitmap of the lent buffers, NMA_LOCK */
+	uint32_t ret[0];
+};
+
 struct netmap_obj_pool {
 	char name[NETMAP_POOL_MAX_NAMSZ];	/* name of the allocator */
 
@@ -101,13 +132,25 @@ struct netmap_obj_pool {
 	/* these are only meaningful if the pool is finalized */
 	/* (see 'finalized' field in netmap_mem_d)            */
 	u_int objtotal;         /* actual total number of objects. */
+	u_int objmax;		/* objects the lut can hold (see
+				 * netmap_buf_pool_grow()) */
 	u_int memtotal;		/* actual total memory space */
 	u_int numclusters;	/* actual number of clusters */
+	u_int huge_shift;	/* clusters are hugepages of this order */
+	char *contig;		/* object i is at contig + i * _objsize,
+				 * NULL if the pool is not virtually
+				 * contiguous (see netmap_obj_contig_check()) */
+	int contig_alloc;	/* the clusters were allocated as one area */
+	int numa_node;		/* preferred node of the clusters, -1 if any */
 
 	u_int objfree;          /* number of free objects. */
+	u_int hiwat;		/* most objects in use at the same time */
+	uint64_t nfail;		/* allocations that could not be satisfied */
 
 	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
+	uint32_t *freelist;	/* stack of the indices of the free objects,
+				 * objfree entries (see netmap_obj_malloc()) */
 	uint32_t *invalid_bitmap;/* one bit per buffer, 1 means invalid */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
 	int	alloc_done;	/* we have allocated the memory */
@@ -125,6 +168,8 @@ struct netmap_obj_pool {
 	u_int _clustsize;       /* cluster size */
 	u_int _clustentries;    /* objects per cluster */
 	u_int _numclusters;	/* number of clusters */
+	u_int _objgrow;		/* objects that can be added at runtime */
+	int _contig;		/* allocate the clusters as one area */
 
 	/* requested values */
 	u_int r_objtotal;
@@ -180,10 +225,33 @@ struct netmap_mem_d {
 
 	struct netmap_obj_params params[NETMAP_POOLS_NR];
 
+	int huge_shift;		/* requested hugepages, -1 for the default */
+	u_int huge_cur;		/* hugepages used by the current config */
+
+	int nm_node;		/* requested NUMA node, -1 to follow the device */
+	int dev_node;		/* NUMA node of the devices using the allocator */
+	int node_cur;		/* NUMA node used by the current config */
+	u_int grow_cur;		/* buffers the current config can grow by */
+	int contig_cur;		/* buffer pool allocated as one area */
+
+	/* usage counters, see NETMAP_REQ_POOLS_STATS_GET */
+	u_int extra_bufs;	/* buffers handed out as extra buffers */
+	uint64_t leaked;	/* buffers reclaimed by netmap_mem_deref() */
+
+	struct netmap_buf_loans *loans;	/* buffers in the host stack */
+
+	/* adapters that may cache the lut, linked through nm_mem_next
+	 * (see netmap_buf_pool_grow()) */
+	struct netmap_adapter *users;
+
 #define NM_MEM_NAMESZ	16
 	char name[NM_MEM_NAMESZ];
 };
 
+static void netmap_mem_lut_refresh(struct netmap_adapter *);
+static void netmap_mem_link(struct netmap_mem_d *, struct netmap_adapter *);
+static void netmap_mem_unlink(struct netmap_mem_d *, struct netmap_adapter *);
+
 int
 netmap_mem_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
 {
@@ -290,6 +358,7 @@ netmap_mem_rings_create(struct netmap_adapter *na)
 
 	NMA_LOCK(nmd);
 	rv = nmd->ops->nmd_rings_create(na);
+	netmap_mem_lut_refresh(na);
 	NMA_UNLOCK(nmd);
 
 	return rv;
@@ -308,6 +377,11 @@ netmap_mem_rings_delete(struct netmap_adapter *na)
 static int netmap_mem_map(struct netmap_obj_pool *, struct netmap_adapter *);
 static int netmap_mem_unmap(struct netmap_obj_pool *, struct netmap_adapter *);
 static int nm_mem_assign_group(struct netmap_mem_d *, struct device *);
+static void *netmap_clust_malloc(struct netmap_obj_pool *);
+static void netmap_mem_count_leaked(struct netmap_mem_d *);
+static int netmap_buf_loans_drain(struct netmap_mem_d *, int);
+static void netmap_buf_loans_keep(struct netmap_mem_d *);
+static void netmap_buf_loans_free(struct netmap_mem_d *);
 static void nm_mem_release_id(struct netmap_mem_d *);
 
 nm_memid_t
@@ -355,9 +429,9 @@ int
 netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 	int lasterr = 0;
-	if (nm_mem_assign_group(nmd, na->pdev) < 0) {
-		return ENOMEM;
-	}
+	lasterr = nm_mem_assign_group(nmd, na->pdev);
+	if (lasterr)
+		return lasterr;
 
 	NMA_LOCK(nmd);
 
@@ -365,6 +439,7 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 		goto out;
 
 	nmd->active++;
+	netmap_mem_link(nmd, na);
 
 	nmd->lasterr = nmd->ops->nmd_finalize(nmd);
 
@@ -389,14 +464,39 @@ nm_isset(uint32_t *bitmap, u_int i)
 }
 
 
+/* the free list has one entry per object, like the lut: allocate it
+ * in the same way, as it may be too large for a contiguous allocation */
+static void *
+nm_alloc_objarray(size_t n)
+{
+#ifdef linux
+	return vmalloc(n);
+#else
+	return nm_os_malloc(n);
+#endif
+}
+
+static void
+nm_free_objarray(void *a)
+{
+#ifdef linux
+	vfree(a);
+#else
+	nm_os_free(a);
+#endif
+}
+
+/*
+ * The first 'reserved' objects of the pool are never handed out.
+ */
 static int
-netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
+netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p, u_int reserved)
 {
 	u_int n, j;
 
 	if (p->bitmap == NULL) {
-		/* Allocate the bitmap */
-		n = (p->objtotal + 31) / 32;
+		/* Allocate the bitmap, leaving room for growth */
+		n = (p->objmax + 31) / 32;
 		p->bitmap = nm_os_malloc(sizeof(p->bitmap[0]) * n);
 		if (p->bitmap == NULL) {
 			nm_prerr("Unable to create bitmap (%d entries) for allocator '%s'", (int)n,
@@ -404,6 +504,14 @@ netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
 			return ENOMEM;
 		}
 		p->bitmap_slots = n;
+		p->freelist = nm_alloc_objarray(sizeof(p->freelist[0]) * p->objmax);
+		if (p->freelist == NULL) {
+			nm_prerr("Unable to create free list (%u entries) for allocator '%s'",
+			    p->objmax, p->name);
+			nm_os_free(p->bitmap);
+			p->bitmap = NULL;
+			return ENOMEM;
+		}
 	} else {
 		memset(p->bitmap, 0, p->bitmap_slots * sizeof(p->bitmap[0]));
 	}
@@ -412,16 +520,17 @@ netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
 	/*
 	 * Set all the bits in the bitmap that have
 	 * corresponding buffers to 1 to indicate they are
-	 * free.
+	 * free, and push them on the free list, highest index
+	 * first, so that the lowest ones are allocated first.
 	 */
-	for (j = 0; j < p->objtotal; j++) {
+	for (j = p->objtotal; j-- > reserved; ) {
 		if (p->invalid_bitmap && nm_isset(p->invalid_bitmap, j)) {
 			if (netmap_debug & NM_DEBUG_MEM)
 				nm_prinf("skipping %s %d", p->name, j);
 			continue;
 		}
 		p->bitmap[ (j>>5) ] |=  ( 1U << (j & 31U) );
-		p->objfree++;
+		p->freelist[p->objfree++] = j;
 	}
 
 	if (netmap_verbose)
@@ -443,26 +552,16 @@ netmap_mem_init_bitmaps(struct netmap_mem_d *nmd)
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		struct netmap_obj_pool *p = &nmd->pools[i];
 
-		error = netmap_init_obj_allocator_bitmap(p);
-		if (error)
+		/*
+		 * buffers 0 and 1 are reserved
+		 */
+		error = netmap_init_obj_allocator_bitmap(p,
+				i == NETMAP_BUF_POOL ? 2 : 0);
+		if (error) {
+			if (i == NETMAP_BUF_POOL)
+				nm_prerr("%s: not enough buffers", p->name);
 			return error;
-	}
-
-	/*
-	 * buffers 0 and 1 are reserved
-	 */
-	if (nmd->pools[NETMAP_BUF_POOL].objfree < 2) {
-		nm_prerr("%s: not enough buffers", nmd->pools[NETMAP_BUF_POOL].name);
-		return ENOMEM;
-	}
-
-	nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
-	if (nmd->pools[NETMAP_BUF_POOL].bitmap) {
-		/* XXX This check is a workaround that prevents a
-		 * NULL pointer crash which currently happens only
-		 * with ptnetmap guests.
-		 * Removed shared-info --> is the bug still there? */
-		nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3U;
+		}
 	}
 	return 0;
 }
@@ -470,18 +569,24 @@ netmap_mem_init_bitmaps(struct netmap_mem_d *nmd)
 int
 netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
-	int last_user = 0;
+	int last_user = 0, put = 0;
 	NMA_LOCK(nmd);
-	if (na->active_fds <= 0)
+	if (na->active_fds <= 0) {
 		netmap_mem_unmap(&nmd->pools[NETMAP_BUF_POOL], na);
+		netmap_mem_unlink(nmd, na);
+		na->na_extra_bufs = 0;
+	}
 	if (nmd->active == 1) {
 		last_user = 1;
 		/*
 		 * Reset the allocator when it falls out of use so that any
 		 * pool resources leaked by unclean application exits are
-		 * reclaimed.
+		 * reclaimed. The buffers still in the host stack are not.
 		 */
+		put = netmap_buf_loans_drain(nmd, 0);
+		netmap_mem_count_leaked(nmd);
 		netmap_mem_init_bitmaps(nmd);
+		netmap_buf_loans_keep(nmd);
 	}
 	nmd->ops->nmd_deref(nmd);
 
@@ -492,6 +597,8 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 	}
 
 	NMA_UNLOCK(nmd);
+	if (put)
+		netmap_mem_put(nmd);
 	return last_user;
 }
 
@@ -506,6 +613,7 @@ netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
 #endif
 	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
 	lut->objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	lut->vbase = nmd->pools[NETMAP_BUF_POOL].contig;
 
 	return 0;
 }
@@ -574,6 +682,10 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 
 	.nm_id = 1,
 	.nm_grp = -1,
+	.huge_shift = -1,
+	.nm_node = -1,
+	.dev_node = -1,
+	.node_cur = -1,
 
 	.prev = &nm_mem,
 	.next = &nm_mem,
@@ -612,6 +724,10 @@ static const struct netmap_mem_d nm_blueprint = {
 	},
 
 	.nm_grp = -1,
+	.huge_shift = -1,
+	.nm_node = -1,
+	.dev_node = -1,
+	.node_cur = -1,
 
 	.flags = NETMAP_MEM_PRIVATE,
 
@@ -646,6 +762,60 @@ DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
 
+/*
+ * Default page size of the pools (see NETMAP_REQ_POOLS_CONFIG_SET),
+ * used by the allocators configured afterwards.
+ */
+static int netmap_hugepage_shift = 0;
+SYSBEGIN(mem2_huge);
+SYSCTL_INT(_dev_netmap, OID_AUTO, hugepage_shift, CTLFLAG_RW,
+    &netmap_hugepage_shift, 0,
+    "Hugepages for the netmap pools (0, 21 for 2MB, 30 for 1GB)");
+SYSEND;
+
+/*
+ * Binding a port to an allocator whose pools live on a different NUMA
+ * node is only reported, unless numa_strict is set.
+ */
+static int netmap_numa_strict = 0;
+SYSBEGIN(mem2_numa);
+SYSCTL_INT(_dev_netmap, OID_AUTO, numa_strict, CTLFLAG_RW,
+    &netmap_numa_strict, 0,
+    "Refuse to bind ports to memory on a different NUMA node");
+SYSEND;
+
+/*
+ * Number of buffers that can be appended to a buffer pool while it is
+ * in use, when a new port would otherwise run out of them. The lookup
+ * table is sized for the grown pool when the allocator is configured.
+ */
+static u_int netmap_buf_grow_max = 0;
+SYSBEGIN(mem2_grow);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, buf_grow_max, CTLFLAG_RW,
+    &netmap_buf_grow_max, 0,
+    "Buffers that can be added to a pool in use (0 to disable)");
+SYSEND;
+
+/*
+ * Allocate the buffer pools (on normal pages) as a single physically
+ * contiguous area, falling back to separate clusters if there is no
+ * such area. The buffers are then virtually contiguous and NMB() does
+ * not need the lookup table. Such pools cannot grow.
+ */
+static int netmap_buf_contig = 0;
+SYSBEGIN(mem2_contig);
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_contig, CTLFLAG_RW,
+    &netmap_buf_contig, 0,
+    "Allocate the buffer pools as a single contiguous area");
+SYSEND;
+
+static int
+netmap_hugepage_valid(int shift)
+{
+	return shift == 0 || shift == NETMAP_HUGEPAGE_2M ||
+		shift == NETMAP_HUGEPAGE_1G;
+}
+
 /* call with nm_mem_list_lock held */
 static int
 nm_mem_assign_id_locked(struct netmap_mem_d *nmd)
@@ -726,10 +896,11 @@ netmap_mem_find(nm_memid_t id)
 static int
 nm_mem_assign_group(struct netmap_mem_d *nmd, struct device *dev)
 {
-	int err = 0, id;
+	int err = 0, id, node;
 	id = nm_iommu_group_id(dev);
+	node = nm_numa_node_id(dev);
 	if (netmap_debug & NM_DEBUG_MEM)
-		nm_prinf("iommu_group %d", id);
+		nm_prinf("iommu_group %d numa node %d", id, node);
 
 	NMA_LOCK(nmd);
 
@@ -743,17 +914,40 @@ nm_mem_assign_group(struct netmap_mem_d *nmd, struct device *dev)
 		nmd->lasterr = err = ENOMEM;
 	}
 
+	/*
+	 * The first user of an idle allocator decides where the pools
+	 * go, unless a node was explicitly requested. Later users on a
+	 * different node work, but every packet crosses the interconnect.
+	 */
+	if (!err && node >= 0 && nmd->ops == &netmap_mem_global_ops) {
+		int cur;
+
+		if (!nmd->active)
+			nmd->dev_node = node;
+		cur = nmd->nm_node >= 0 ? nmd->nm_node : nmd->dev_node;
+		if (cur >= 0 && cur != node) {
+			if (netmap_numa_strict) {
+				nm_prerr("%s: device on numa node %d, memory on node %d",
+						nmd->name, node, cur);
+				err = EXDEV;
+			} else {
+				nm_prlim(1, "%s: device on numa node %d, memory on node %d",
+						nmd->name, node, cur);
+			}
+		}
+	}
+
 	NMA_UNLOCK(nmd);
 	return err;
 }
 
 static struct lut_entry *
-nm_alloc_lut(u_int nobj)
+nm_alloc_lut(u_int nobj, int node)
 {
 	size_t n = sizeof(struct lut_entry) * nobj;
 	struct lut_entry *lut;
 #ifdef linux
-	lut = vmalloc(n);
+	lut = node >= 0 ? vmalloc_node(n, node) : vmalloc(n);
 #else
 	lut = nm_os_malloc(n);
 #endif
@@ -806,6 +1000,8 @@ netmap_mem2_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 	for (i = 0; i < NETMAP_POOLS_NR; offset -= p[i].memtotal, i++) {
 		if (offset >= p[i].memtotal)
 			continue;
+		if (offset >= (vm_ooffset_t)p[i].numclusters * p[i]._clustsize)
+			break; /* hugepage alignment padding */
 		// now lookup the cluster's address
 #ifndef _WIN32
 		pa = vtophys(p[i].lut[offset / p[i]._objsize].vaddr) +
@@ -1003,15 +1199,28 @@ netmap_mem2_if_offset(struct netmap_mem_d *nmd, const void *addr)
 }
 
 /*
- * report the index, and use start position as a hint,
- * otherwise buffer allocation becomes terribly expensive.
+ * Free objects are kept on a stack (p->freelist), so both allocation
+ * and release are O(1) whatever the size and occupancy of the pool,
+ * and the most recently freed (likely cache-hot) objects are reused
+ * first. The bitmap is only kept to catch double frees.
+ * The caller must make sure that the pool is not empty.
  */
+static inline uint32_t
+netmap_obj_pop(struct netmap_obj_pool *p)
+{
+	uint32_t j = p->freelist[--p->objfree];
+
+	p->bitmap[j >> 5] &= ~(1U << (j & 31U)); /* mark object as in use */
+	if (p->objtotal - p->objfree > p->hiwat)
+		p->hiwat = p->objtotal - p->objfree;
+	return j;
+}
+
+/* report the index */
 static void *
-netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_t *index)
+netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *index)
 {
-	uint32_t i = 0;			/* index in the bitmap */
-	uint32_t mask, j = 0;		/* slot counter */
-	void *vaddr = NULL;
+	uint32_t j;
 
 	if (len > p->_objsize) {
 		nm_prerr("%s request size %d too large", p->name, len);
@@ -1020,37 +1229,18 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 
 	if (p->objfree == 0) {
 		nm_prerr("no more %s objects", p->name);
+		p->nfail++;
 		return NULL;
 	}
-	if (start)
-		i = *start;
-
-	/* termination is guaranteed by p->free, but better check bounds on i */
-	while (vaddr == NULL && i < p->bitmap_slots)  {
-		uint32_t cur = p->bitmap[i];
-		if (cur == 0) { /* bitmask is fully used */
-			i++;
-			continue;
-		}
-		/* locate a slot */
-		for (j = 0, mask = 1; (cur & mask) == 0; j++, mask <<= 1)
-			;
-
-		p->bitmap[i] &= ~mask; /* mark object as in use */
-		p->objfree--;
-
-		vaddr = p->lut[i * 32 + j].vaddr;
-		if (index)
-			*index = i * 32 + j;
-	}
-	ND("%s allocator: allocated object @ [%d][%d]: vaddr %p",p->name, i, j, vaddr);
 
-	if (start)
-		*start = i;
-	return vaddr;
+	j = netmap_obj_pop(p);
+	if (index)
+		*index = j;
+	ND("%s allocator: allocated object %u: vaddr %p", p->name, j,
+	    p->lut[j].vaddr);
+	return p->lut[j].vaddr;
 }
 
-
 /*
  * free by index, not by address.
  * XXX should we also cleanup the content ?
@@ -1071,7 +1261,7 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 		return 1;
 	} else {
 		*ptr |= mask;
-		p->objfree++;
+		p->freelist[p->objfree++] = j;
 		return 0;
 	}
 }
@@ -1108,12 +1298,12 @@ netmap_mem_bufsize(struct netmap_mem_d *nmd)
 	return nmd->pools[NETMAP_BUF_POOL]._objsize;
 }
 
-#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL, NULL)
+#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL)
 #define netmap_if_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_IF_POOL], (v))
-#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL, NULL)
+#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL)
 #define netmap_ring_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_RING_POOL], (v))
-#define netmap_buf_malloc(n, _pos, _index)			\
-	netmap_obj_malloc(&(n)->pools[NETMAP_BUF_POOL], netmap_mem_bufsize(n), _pos, _index)
+#define netmap_buf_malloc(n, _index)			\
+	netmap_obj_malloc(&(n)->pools[NETMAP_BUF_POOL], netmap_mem_bufsize(n), _index)
 
 
 #if 0 /* currently unused */
@@ -1122,6 +1312,133 @@ netmap_mem_bufsize(struct netmap_mem_d *nmd)
     (netmap_obj_offset(&(n)->pools[NETMAP_BUF_POOL], (v)) / NETMAP_BDG_BUF_SIZE(n))
 #endif
 
+/*
+ * Count the buffers that are still in use when the last user of the
+ * allocator goes away, just before netmap_mem_init_bitmaps() reclaims
+ * them. Call with NMA_LOCK held.
+ */
+static void
+netmap_mem_count_leaked(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int j, n = 0;
+
+	nmd->extra_bufs = 0;
+	if (p->bitmap == NULL)
+		return;
+	for (j = 2; j < p->objtotal; j++) {
+		if (nm_isset(p->bitmap, j))
+			continue;
+		if (p->invalid_bitmap && nm_isset(p->invalid_bitmap, j))
+			continue;
+		n++;
+	}
+	if (nmd->loans != NULL)
+		n -= min(n, nmd->loans->lent);
+	if (n && netmap_verbose)
+		nm_prinf("%s: reclaiming %u leaked buffers", nmd->name, n);
+	nmd->leaked += n;
+}
+
+/* tell the processes using the memory region its current size */
+static void
+netmap_mem_if_set_memsize(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_IF_POOL];
+	u_int j;
+
+	for (j = 0; j < p->objtotal; j++) {
+		struct netmap_if *nifp = p->lut[j].vaddr;
+
+		if (nm_isset(p->bitmap, j))
+			continue; /* not in use */
+		*(uint32_t *)(uintptr_t)&nifp->ni_memsize = nmd->nm_totalsize;
+	}
+}
+
+/*
+ * Append clusters to the buffer pool, so that at least 'need' buffers
+ * are free. The lut, the bitmap and the free list were sized for objmax
+ * objects by netmap_finalize_obj_allocator(), so nothing moves and the
+ * adapters using the pool are not disturbed: every adapter linked in
+ * nmd->users sees the new buffers through netmap_mem_lut_refresh()
+ * before any of them is handed out. The new clusters extend the mmap()ed
+ * region, and processes that mapped it before learn the new size from
+ * ni_memsize.
+ * Call with NMA_LOCK held.
+ */
+static int
+netmap_buf_pool_grow(struct netmap_mem_d *nmd, u_int need)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_adapter *na;
+	u_int i, j, lim, memtotal;
+
+	if (p->objfree >= need)
+		return 0;
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED) || !p->alloc_done ||
+			p->objtotal % p->_clustentries)
+		return ENOMEM;
+	lim = p->objtotal + need - p->objfree;
+	lim += (p->_clustentries - lim % p->_clustentries) % p->_clustentries;
+	if (lim > p->objmax) {
+		nm_prlim(1, "%s: cannot grow beyond %u objects", p->name,
+				p->objmax);
+		return ENOMEM;
+	}
+
+	for (i = p->objtotal; i < lim; ) {
+		char *clust = netmap_clust_malloc(p);
+
+		if (clust == NULL) {
+			nm_prerr("Unable to create cluster at %u for '%s' allocator",
+			    i, p->name);
+			break;
+		}
+		for (j = 0; j < p->_clustentries; j++, i++, clust += p->_objsize) {
+			p->lut[i].vaddr = clust;
+#if !defined(linux) && !defined(_WIN32)
+			p->lut[i].paddr = vtophys(clust);
+#endif
+		}
+	}
+	if (i == p->objtotal)
+		return ENOMEM;
+
+	/* the new objects are free, the lowest index on top */
+	for (j = i; j-- > p->objtotal; ) {
+		p->bitmap[j >> 5] |= 1U << (j & 31U);
+		p->freelist[p->objfree++] = j;
+	}
+	if (netmap_verbose)
+		nm_prinf("%s: grown from %u to %u objects", p->name,
+				p->objtotal, i);
+	p->objtotal = i;
+	p->numclusters = i / p->_clustentries;
+	memtotal = p->numclusters * p->_clustsize;
+	if (nmd->huge_cur) {
+		u_int align = 1U << nmd->huge_cur;
+
+		memtotal = (memtotal + align - 1) & ~(align - 1);
+	}
+	nmd->nm_totalsize += memtotal - p->memtotal;
+	p->memtotal = memtotal;
+	netmap_mem_if_set_memsize(nmd);
+	for (na = nmd->users; na != NULL; na = na->nm_mem_next)
+		netmap_mem_lut_refresh(na);
+
+	return p->objfree >= need ? 0 : ENOMEM;
+}
+
+/* push buffer 'idx' on the extra buffers list starting at *head */
+static inline void
+netmap_extra_link(struct netmap_obj_pool *p, uint32_t *head, uint32_t idx)
+{
+	ND(5, "allocate buffer %d -> %d", idx, *head);
+	*(uint32_t *)p->lut[idx].vaddr = *head; /* link to previous head */
+	*head = idx;
+}
+
 /*
  * allocate extra buffers in a linked list.
  * returns the actual number.
@@ -1130,28 +1447,32 @@ uint32_t
 netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 {
 	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t i;
 
 	NMA_LOCK(nmd);
 
 	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
-		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
+	if (p->objfree < n)
+		netmap_buf_pool_grow(nmd, n);
+	for (i = 0; i < n; i++) {
+		if (p->objfree == 0) {
 			nm_prerr("no more buffers after %d of %d", i, n);
-			*head = cur; /* restore */
+			p->nfail++;
 			break;
 		}
-		ND(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
+		netmap_extra_link(p, head, netmap_obj_pop(p));
 	}
+	netmap_mem_lut_refresh(na);
+	na->na_extra_bufs += i;
+	nmd->extra_bufs += i;
 
 	NMA_UNLOCK(nmd);
 
 	return i;
 }
 
+/* call with NMA_LOCK held */
 static void
 netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 {
@@ -1169,12 +1490,426 @@ netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 		if (netmap_obj_free(p, cur))
 			break;
 	}
+	na->na_extra_bufs -= min(i, na->na_extra_bufs);
+	nmd->extra_bufs -= min(i, nmd->extra_bufs);
 	if (head != 0)
 		nm_prerr("breaking with head %d", head);
 	if (netmap_debug & NM_DEBUG_MEM)
 		nm_prinf("freed %d buffers", i);
 }
 
+#ifdef __FreeBSD__
+static void netmap_buf_loans_done(void *, int);
+#endif
+
+/* create the loans of the buffer pool, call with NMA_LOCK held */
+static struct netmap_buf_loans *
+netmap_buf_loans_get(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_buf_loans *l = nmd->loans;
+	u_int max = netmap_host_zcopy;
+
+	if (l != NULL || max == 0)
+		return l;
+	l = nm_os_malloc(sizeof(*l) + max * sizeof(l->ret[0]));
+	if (l == NULL)
+		return NULL;
+	l->lentmap = nm_os_malloc(sizeof(l->lentmap[0]) * ((p->objmax + 31) / 32));
+	if (l->lentmap == NULL) {
+		nm_os_free(l);
+		return NULL;
+	}
+	mtx_init(&l->lock, "nm_buf_loans", NULL, MTX_DEF);
+#ifdef __FreeBSD__
+	TASK_INIT(&l->done_task, 0, netmap_buf_loans_done, nmd);
+#endif
+	l->max = max;
+	nmd->loans = l;
+	return l;
+}
+
+/* only called when no buffer is lent and done_task is not pending */
+static void
+netmap_buf_loans_free(struct netmap_mem_d *nmd)
+{
+	struct netmap_buf_loans *l = nmd->loans;
+
+	if (l == NULL)
+		return;
+	if (l->lent)
+		nm_prerr("%s: %u buffers still in the host stack", nmd->name,
+				l->lent);
+	mtx_destroy(&l->lock);
+	nm_os_free(l->lentmap);
+	nm_os_free(l);
+	nmd->loans = NULL;
+}
+
+/*
+ * Put the buffers returned by the host stack back in the pool. 'done'
+ * is set by netmap_buf_loans_done(), which owns the reference while
+ * it is pending. Call with NMA_LOCK held. Return 1 if the caller must
+ * drop the reference to the allocator taken by the first loan.
+ */
+static int
+netmap_buf_loans_drain(struct netmap_mem_d *nmd, int done)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_buf_loans *l = nmd->loans;
+	u_int i, n;
+	int put;
+
+	if (l == NULL)
+		return 0;
+	mtx_lock(&l->lock);
+	if (done)
+		l->done_pending = 0;
+	n = l->nret;
+	for (i = 0; i < n; i++) {
+		uint32_t j = l->ret[i];
+
+		l->lentmap[j >> 5] &= ~(1U << (j & 31U));
+		netmap_obj_free(p, j);
+	}
+	l->nret = 0;
+	l->lent -= n;
+	put = (n > 0 || done) && l->lent == 0 && !l->done_pending;
+	mtx_unlock(&l->lock);
+	return put;
+}
+
+#ifdef __FreeBSD__
+/*
+ * Scheduled by netmap_mem_buf_return() when the host stack has given
+ * back all the lent buffers: put them back in the pool and drop the
+ * reference to the allocator, which may be its last one if no port
+ * uses it any more.
+ */
+static void
+netmap_buf_loans_done(void *arg, int pending)
+{
+	struct netmap_mem_d *nmd = arg;
+	int put;
+
+	(void)pending;
+	NMA_LOCK(nmd);
+	put = netmap_buf_loans_drain(nmd, 1);
+	NMA_UNLOCK(nmd);
+	if (put)
+		netmap_mem_put(nmd);
+}
+#endif /* __FreeBSD__ */
+
+/*
+ * After netmap_mem_init_bitmaps(), take the buffers that are still
+ * in the host stack out of the pool again. Call with NMA_LOCK held.
+ */
+static void
+netmap_buf_loans_keep(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_buf_loans *l = nmd->loans;
+	u_int i, n;
+
+	if (l == NULL || l->lent == 0)
+		return;
+	for (i = n = 0; i < p->objfree; i++) {
+		uint32_t j = p->freelist[i];
+
+		if (nm_isset(l->lentmap, j)) {
+			p->bitmap[j >> 5] &= ~(1U << (j & 31U));
+			continue;
+		}
+		p->freelist[n++] = j;
+	}
+	p->objfree = n;
+}
+
+/*
+ * Hand the buffers of n slots to the host stack of na without copying
+ * them, under a single acquisition of the allocator lock: each buffer
+ * is wrapped in an mbuf, returned in m[i], and the slot gets a new
+ * buffer from the pool and the NS_BUF_CHANGED flag. m[i] is NULL if
+ * the caller has to copy the packet of slot[i] (NULL slot, loans
+ * disabled or exhausted, no free buffers, or the OS cannot wrap the
+ * buffer).
+ */
+void
+netmap_mem_bufs_lend(struct netmap_adapter *na, struct netmap_slot **slot,
+		struct mbuf **m, u_int n)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_buf_loans *l;
+	u_int i, nlent = 0;
+	int put, get = 0;
+
+	bzero(m, n * sizeof(m[0]));
+	if (nmd->ops != &netmap_mem_global_ops)
+		return;
+
+	NMA_LOCK(nmd);
+	put = netmap_buf_loans_drain(nmd, 0);
+	l = netmap_buf_loans_get(nmd);
+	for (i = 0; l != NULL && i < n; i++) {
+		uint32_t idx, nidx;
+
+		/* lent only grows under NMA_LOCK, which we hold */
+		if (l->lent + nlent >= min(l->max, (u_int)netmap_host_zcopy) ||
+				p->objfree == 0)
+			break;
+		if (slot[i] == NULL)
+			continue;
+		idx = slot[i]->buf_idx;
+		if (idx < 2 || idx >= p->objtotal)
+			continue;
+		nidx = netmap_obj_pop(p);
+		m[i] = nm_os_mbuf_zcopy(na->ifp, p->lut[idx].vaddr,
+				slot[i]->len, nmd, idx);
+		if (m[i] == NULL) {
+			netmap_obj_free(p, nidx);
+			continue;
+		}
+		nlent++;
+		l->lentmap[idx >> 5] |= 1U << (idx & 31U);
+		slot[i]->buf_idx = nidx;
+		slot[i]->flags |= NS_BUF_CHANGED;
+	}
+	if (nlent) {
+		/* the mbufs are still ours, so none of these buffers can
+		 * come back before lent is updated */
+		mtx_lock(&l->lock);
+		if (l->lent == 0 && !l->done_pending)
+			get = 1;
+		l->lent += nlent;
+		mtx_unlock(&l->lock);
+	}
+	if (get) {
+		if (put)
+			put = 0;	/* keep the reference */
+		else
+			netmap_mem_get(nmd);
+	}
+	NMA_UNLOCK(nmd);
+	if (put)
+		netmap_mem_put(nmd);
+}
+
+/*
+ * Called by the OS when the host stack releases buffer idx, lent by
+ * netmap_mem_bufs_lend(). It may run in any context. When the last lent
+ * buffer comes back, netmap_buf_loans_done() is scheduled to release
+ * the loans from a context that can sleep.
+ */
+void
+netmap_mem_buf_return(void *cookie, uint32_t idx)
+{
+	struct netmap_mem_d *nmd = cookie;
+	struct netmap_buf_loans *l = nmd->loans;
+	int done;
+
+	mtx_lock(&l->lock);
+	l->ret[l->nret++] = idx;	/* nret <= lent <= max */
+	done = l->nret == l->lent && !l->done_pending;
+	if (done)
+		l->done_pending = 1;
+	mtx_unlock(&l->lock);
+#ifdef __FreeBSD__
+	if (done)
+		taskqueue_enqueue(taskqueue_thread, &l->done_task);
+#endif /* no other OS lends buffers, see NM_OS_MBUF_ZCOPY */
+}
+
+/*
+ * Buffer queues (see struct netmap_bufq in netmap.h). The queue is an
+ * object of the ring pool, allocated together with the netmap_if of a
+ * file descriptor bound with NR_BUFQ and freed with it. The buffers in
+ * the queue and those taken by the application are accounted as extra
+ * buffers of the adapter.
+ */
+static struct netmap_bufq *
+netmap_bufq_of(struct netmap_if *nifp)
+{
+	if (nifp->ni_bufq_ofs == 0)
+		return NULL;
+	return (struct netmap_bufq *)((char *)nifp + nifp->ni_bufq_ofs);
+}
+
+/*
+ * Allocate the rx timestamps of the rings bound to priv, in the ring
+ * pool. They live as long as the rings, and rxsync fills them when
+ * they exist (see nm_rxsync_tstamp()). Call with NMA_LOCK held.
+ */
+static int
+netmap_tstamp_create(struct netmap_adapter *na, struct netmap_priv_d *priv)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+	u_int i;
+
+	if (nmd->flags & NETMAP_MEM_IO)
+		return EOPNOTSUPP; /* the rings belong to the host */
+	for (i = priv->np_qfirst[NR_RX]; i < priv->np_qlast[NR_RX]; i++) {
+		struct netmap_kring *kring = na->rx_rings[i];
+		struct netmap_ring *ring = kring->ring;
+		size_t len = kring->nkr_num_slots * sizeof(uint64_t);
+		uint64_t *ts;
+
+		if (ring == NULL || kring->nkr_tstamp != NULL ||
+				(kring->nr_kflags & NKR_FAKERING))
+			continue;
+		ts = netmap_ring_malloc(nmd, len);
+		if (ts == NULL)
+			return ENOMEM;
+		bzero(ts, len);
+		*(int64_t *)(uintptr_t)&ring->tstamp_ofs =
+			netmap_ring_offset(nmd, ts) -
+			netmap_ring_offset(nmd, ring);
+		nm_stst_barrier(); /* the array is ready before rxsync sees it */
+		kring->nkr_tstamp = ts;
+	}
+	return 0;
+}
+
+/* call with NMA_LOCK held */
+static int
+netmap_bufq_new(struct netmap_mem_d *nmd, struct netmap_if *nifp)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_RING_POOL];
+	struct netmap_bufq *q;
+
+	q = netmap_ring_malloc(nmd, p->_objsize);
+	if (q == NULL)
+		return ENOMEM;
+	bzero(q, sizeof(*q));
+	*(uint32_t *)(uintptr_t)&q->nbq_num_slots =
+		(p->_objsize - sizeof(*q)) / (2 * sizeof(q->nbq_idx[0]));
+	*(int64_t *)(uintptr_t)&nifp->ni_bufq_ofs =
+		netmap_ring_offset(nmd, q) - netmap_if_offset(nmd, nifp);
+	return 0;
+}
+
+/*
+ * Return to the pool the buffers of queue 'idx' from 'tail' to 'head'
+ * (excluded). The indices come from the application, so they are
+ * checked, and so are 'head' and 'tail' by the callers.
+ * Returns the number of buffers actually freed. Call with NMA_LOCK held.
+ */
+static u_int
+netmap_bufq_reclaim(struct netmap_obj_pool *p, uint32_t *idx, u_int n,
+		u_int tail, u_int head)
+{
+	u_int freed = 0;
+
+	for (; tail != head; tail = nm_next(tail, n - 1)) {
+		if (idx[tail] < 2 || idx[tail] >= p->objtotal) {
+			nm_prlim(1, "invalid buffer %u in buffer queue",
+					idx[tail]);
+			continue;
+		}
+		if (netmap_obj_free(p, idx[tail]) == 0)
+			freed++;
+	}
+	return freed;
+}
+
+/* account for buffers given back through a buffer queue */
+static void
+netmap_bufq_count_freed(struct netmap_adapter *na, u_int freed)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+
+	na->na_extra_bufs -= min(freed, na->na_extra_bufs);
+	nmd->extra_bufs -= min(freed, nmd->extra_bufs);
+}
+
+/*
+ * NETMAP_REQ_BUFQ_SYNC: reclaim the free queue, then top up the alloc
+ * queue to nbq_want buffers. Call with NMG_LOCK held.
+ */
+int
+netmap_mem_bufq_sync(struct netmap_adapter *na, struct netmap_if *nifp)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_bufq *q = netmap_bufq_of(nifp);
+	u_int n, head, tail, avail, want;
+	int error = 0;
+
+	if (q == NULL)
+		return EINVAL;
+	n = q->nbq_num_slots;
+
+	NMA_LOCK(nmd);
+	/* read once what the application may change under our feet */
+	head = q->nbq_free_head;
+	tail = q->nbq_free_tail;
+	if (head >= n || tail >= n) {
+		error = EINVAL;
+		goto out;
+	}
+	netmap_bufq_count_freed(na,
+		netmap_bufq_reclaim(p, q->nbq_idx + n, n, tail, head));
+	*(uint32_t *)(uintptr_t)&q->nbq_free_tail = head;
+
+	head = q->nbq_alloc_head;
+	tail = q->nbq_alloc_tail;
+	want = min(q->nbq_want, n - 1);
+	if (head >= n || tail >= n) {
+		error = EINVAL;
+		goto out;
+	}
+	avail = tail >= head ? tail - head : tail + n - head;
+	if (avail >= want)
+		goto out;
+
+	if (p->objfree < want - avail)
+		netmap_buf_pool_grow(nmd, want - avail);
+	na->na_extra_bufs += min(want - avail, p->objfree);
+	nmd->extra_bufs += min(want - avail, p->objfree);
+	for (; avail < want && p->objfree; avail++) {
+		q->nbq_idx[tail] = netmap_obj_pop(p);
+		tail = nm_next(tail, n - 1);
+	}
+	*(uint32_t *)(uintptr_t)&q->nbq_alloc_tail = tail;
+	netmap_mem_lut_refresh(na);
+	if (avail < want) {
+		nm_prlim(1, "no more buffers, %u of %u in the queue",
+				avail, want);
+		p->nfail++;
+		error = ENOMEM;
+	}
+out:
+	NMA_UNLOCK(nmd);
+	return error;
+}
+
+/*
+ * Give back the buffers still in the queues and free the queue.
+ * Call with NMA_LOCK held.
+ */
+static void
+netmap_bufq_delete(struct netmap_adapter *na, struct netmap_if *nifp)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_bufq *q = netmap_bufq_of(nifp);
+	u_int n, freed = 0;
+
+	if (q == NULL)
+		return;
+	n = q->nbq_num_slots;
+	if (q->nbq_alloc_head < n && q->nbq_alloc_tail < n)
+		freed += netmap_bufq_reclaim(p, q->nbq_idx, n,
+				q->nbq_alloc_head, q->nbq_alloc_tail);
+	if (q->nbq_free_head < n && q->nbq_free_tail < n)
+		freed += netmap_bufq_reclaim(p, q->nbq_idx + n, n,
+				q->nbq_free_tail, q->nbq_free_head);
+	netmap_bufq_count_freed(na, freed);
+	netmap_ring_free(nmd, q);
+	*(int64_t *)(uintptr_t)&nifp->ni_bufq_ofs = 0;
+}
+
 
 /* Return nonzero on error */
 static int
@@ -1182,31 +1917,25 @@ netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 {
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
 	u_int i = 0;	/* slot counter */
-	uint32_t pos = 0;	/* slot in p->bitmap */
-	uint32_t index = 0;	/* buffer index */
 
+	/* fill the whole ring at once, or nothing */
+	if (p->objfree < n)
+		netmap_buf_pool_grow(nmd, n);
+	if (p->objfree < n) {
+		nm_prerr("no more buffers: %u needed, %u available", n, p->objfree);
+		p->nfail++;
+		bzero(slot, n * sizeof(slot[0]));
+		return (ENOMEM);
+	}
 	for (i = 0; i < n; i++) {
-		void *vaddr = netmap_buf_malloc(nmd, &pos, &index);
-		if (vaddr == NULL) {
-			nm_prerr("no more buffers after %d of %d", i, n);
-			goto cleanup;
-		}
-		slot[i].buf_idx = index;
+		slot[i].buf_idx = netmap_obj_pop(p);
 		slot[i].len = p->_objsize;
 		slot[i].flags = 0;
 		slot[i].ptr = 0;
 	}
 
-	ND("%s: allocated %d buffers, %d available, first at %d", p->name, n, p->objfree, pos);
+	ND("%s: allocated %d buffers, %d available", p->name, n, p->objfree);
 	return (0);
-
-cleanup:
-	while (i > 0) {
-		i--;
-		netmap_obj_free(p, slot[i].buf_idx);
-	}
-	bzero(slot, n * sizeof(slot[0]));
-	return (ENOMEM);
 }
 
 static void
@@ -1249,6 +1978,29 @@ netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 			p->name, p->objfree);
 }
 
+/* allocate/free one cluster of the pool */
+static void *
+netmap_clust_malloc(struct netmap_obj_pool *p)
+{
+	if (p->huge_shift)
+		return nm_os_hugemalloc(p->_clustsize, p->numa_node);
+	if (p->numa_node >= 0)
+		return contigmalloc_domainset(p->_clustsize, M_NETMAP,
+		    DOMAINSET_PREF(p->numa_node), M_NOWAIT | M_ZERO,
+		    (size_t)0, -1UL, PAGE_SIZE, 0);
+	return contigmalloc(p->_clustsize, M_NETMAP, M_NOWAIT | M_ZERO,
+	    (size_t)0, -1UL, PAGE_SIZE, 0);
+}
+
+static void
+netmap_clust_free(struct netmap_obj_pool *p, void *clust)
+{
+	if (p->huge_shift)
+		nm_os_hugefree(clust, p->_clustsize);
+	else
+		contigfree(clust, p->_clustsize, M_NETMAP);
+}
+
 static void
 netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 {
@@ -1258,6 +2010,11 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	if (p->bitmap)
 		nm_os_free(p->bitmap);
 	p->bitmap = NULL;
+	if (p->freelist)
+		nm_free_objarray(p->freelist);
+	p->freelist = NULL;
+	p->hiwat = 0;
+	p->nfail = 0;
 	if (p->invalid_bitmap)
 		nm_os_free(p->invalid_bitmap);
 	p->invalid_bitmap = NULL;
@@ -1276,13 +2033,21 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 		 * addresses are stored at multiples of p->_clusterentries
 		 * in the lut.
 		 */
-		for (i = 0; i < p->objtotal; i += p->_clustentries) {
-			contigfree(p->lut[i].vaddr, p->_clustsize, M_NETMAP);
+		if (p->contig_alloc) {
+			nm_os_contigfree(p->lut[0].vaddr,
+			    (size_t)p->numclusters * p->_clustsize);
+		} else {
+			for (i = 0; i < p->objtotal; i += p->_clustentries) {
+				netmap_clust_free(p, p->lut[i].vaddr);
+			}
 		}
 		nm_free_lut(p->lut, p->objtotal);
 	}
 	p->lut = NULL;
+	p->contig = NULL;
+	p->contig_alloc = 0;
 	p->objtotal = 0;
+	p->objmax = 0;
 	p->memtotal = 0;
 	p->numclusters = 0;
 	p->objfree = 0;
@@ -1314,7 +2079,8 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
 
 /* call with NMA_LOCK held */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize,
+		u_int huge_shift, int huge_round)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -1371,6 +2137,39 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	}
 	/* compute clustsize */
 	clustsize = clustentries * objsize;
+	/*
+	 * With hugepages each cluster is a single hugepage, which must
+	 * hold a whole number of objects. With huge_round the objects are
+	 * enlarged to the next power of two to get there. A pool smaller
+	 * than a hugepage, or that would exceed nummax once rounded to
+	 * whole hugepages, keeps using normal pages.
+	 */
+	p->huge_shift = 0;
+	if (huge_shift) {
+		u_int hsize = 1U << huge_shift, hobjsize = objsize, hentries;
+
+		if (huge_round) {
+			for (hobjsize = LINE_ROUND; hobjsize < objsize; )
+				hobjsize <<= 1;
+		}
+		hentries = hsize / hobjsize;
+		if (hobjsize > p->objmaxsize || hsize % hobjsize) {
+			if (netmap_verbose)
+				nm_prinf("%s: objsize %u does not divide the hugepage size, "
+					"using normal pages", p->name, objsize);
+		} else if ((uint64_t)objtotal * hobjsize < hsize ||
+				(uint64_t)(objtotal + hentries - 1) / hentries *
+				hentries > p->nummax) {
+			if (netmap_verbose)
+				nm_prinf("%s: %u objects do not fit the hugepages, "
+					"using normal pages", p->name, objtotal);
+		} else {
+			objsize = hobjsize;
+			clustentries = hentries;
+			clustsize = hsize;
+			p->huge_shift = huge_shift;
+		}
+	}
 	if (netmap_debug & NM_DEBUG_MEM)
 		nm_prinf("objsize %d clustsize %d objects %d",
 			objsize, clustsize, clustentries);
@@ -1390,12 +2189,60 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	return 0;
 }
 
+/*
+ * Allocate all the clusters of p as a single area, laid out as they
+ * would be one after the other.
+ */
+static int
+netmap_obj_contig_alloc(struct netmap_obj_pool *p)
+{
+	size_t size = (size_t)p->numclusters * p->_clustsize;
+	char *base = nm_os_contigmalloc(size, p->numa_node);
+	u_int i;
+
+	if (base == NULL) {
+		nm_prinf("%s: no contiguous area of %u KB, using clusters",
+		    p->name, (u_int)(size >> 10));
+		return ENOMEM;
+	}
+	for (i = 0; i < p->objtotal; i++) {
+		p->lut[i].vaddr = base + (size_t)i * p->_objsize;
+#if !defined(linux) && !defined(_WIN32)
+		p->lut[i].paddr = vtophys(p->lut[i].vaddr);
+#endif
+	}
+	p->contig_alloc = 1;
+	return 0;
+}
+
+/*
+ * Set p->contig if the objects are virtually contiguous, which is the
+ * case when the clusters were allocated as one area, when there is a
+ * single cluster, or when the clusters just happen to be adjacent.
+ * A pool that may grow is never contiguous, as the new clusters could
+ * be anywhere and the adapters could not all be told at once.
+ */
+static void
+netmap_obj_contig_check(struct netmap_obj_pool *p)
+{
+	char *base = p->lut[0].vaddr;
+	u_int i;
+
+	p->contig = NULL;
+	if (p->objtotal == 0 || p->objmax != p->objtotal)
+		return;
+	for (i = p->_clustentries; i < p->objtotal; i += p->_clustentries) {
+		if (p->lut[i].vaddr != base + (size_t)i * p->_objsize)
+			return;
+	}
+	p->contig = base;
+}
+
 /* call with NMA_LOCK held */
 static int
 netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 {
 	int i; /* must be signed */
-	size_t n;
 
 	if (p->lut) {
 		/* if the lut is already there we assume that also all the
@@ -1411,9 +2258,10 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	/* optimistically assume we have enough memory */
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
+	p->objmax = p->_objtotal + p->_objgrow;
 	p->alloc_done = 1;
 
-	p->lut = nm_alloc_lut(p->objtotal);
+	p->lut = nm_alloc_lut(p->objmax, p->numa_node);
 	if (p->lut == NULL) {
 		nm_prerr("Unable to create lookup table for '%s'", p->name);
 		goto clean;
@@ -1423,8 +2271,11 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	 * Allocate clusters, init pointers
 	 */
 
-	n = p->_clustsize;
-	for (i = 0; i < (int)p->objtotal;) {
+	i = 0;
+	if (p->_contig && netmap_obj_contig_alloc(p) == 0)
+		i = p->objtotal; /* nothing left to allocate */
+
+	for (; i < (int)p->objtotal;) {
 		int lim = i + p->_clustentries;
 		char *clust;
 
@@ -1435,8 +2286,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * can live with standard malloc, because the hardware will not
 		 * access the pages directly.
 		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		clust = netmap_clust_malloc(p);
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
@@ -1449,8 +2299,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 			lim = i / 2;
 			for (i--; i >= lim; i--) {
 				if (i % p->_clustentries == 0 && p->lut[i].vaddr)
-					contigfree(p->lut[i].vaddr,
-						n, M_NETMAP);
+					netmap_clust_free(p, p->lut[i].vaddr);
 				p->lut[i].vaddr = NULL;
 			}
 		out:
@@ -1477,10 +2326,12 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		}
 	}
 	p->memtotal = p->numclusters * p->_clustsize;
+	netmap_obj_contig_check(p);
 	if (netmap_verbose)
-		nm_prinf("Pre-allocated %d clusters (%d/%dKB) for '%s'",
+		nm_prinf("Pre-allocated %d clusters (%d/%dKB) for '%s'%s",
 		    p->numclusters, p->_clustsize >> 10,
-		    p->memtotal >> 10, p->name);
+		    p->memtotal >> 10, p->name,
+		    p->contig ? ", contiguous" : "");
 
 	return 0;
 
@@ -1515,6 +2366,8 @@ netmap_mem_reset_all(struct netmap_mem_d *nmd)
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		netmap_reset_obj_allocator(&nmd->pools[i]);
 	}
+	nmd->extra_bufs = 0;
+	nmd->leaked = 0;
 	nmd->flags  &= ~NETMAP_MEM_FINALIZED;
 }
 
@@ -1553,6 +2406,37 @@ netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
 	return 0;
 }
 
+#ifdef linux
+/* dma-map the clusters of objects [from, to) for the device of na */
+static int
+netmap_mem_map_range(struct netmap_obj_pool *p, struct netmap_adapter *na,
+		int from, int to)
+{
+	struct netmap_lut *lut = &na->na_lut;
+	int i, error = 0;
+
+	for (i = from; i < to; i += p->_clustentries) {
+		int j;
+
+		if (p->lut[i].vaddr == NULL)
+			continue;
+
+		error = netmap_load_map(na, (bus_dma_tag_t) na->pdev, &lut->plut[i].paddr,
+				p->lut[i].vaddr, p->_clustsize);
+		if (error) {
+			nm_prerr("Failed to map cluster #%d from the %s pool", i, p->name);
+			break;
+		}
+
+		for (j = 1; j < p->_clustentries; j++) {
+			lut->plut[i + j].paddr = lut->plut[i + j - 1].paddr + p->_objsize;
+		}
+	}
+
+	return error;
+}
+#endif /* linux */
+
 static int
 netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
 {
@@ -1582,40 +2466,87 @@ netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
 	}
 
 	ND("allocating physical lut for %s", na->name);
-	lut->plut = nm_alloc_plut(lim);
+	/* leave room for the clusters added by netmap_buf_pool_grow() */
+	lut->plut = nm_alloc_plut(p->objmax);
 	if (lut->plut == NULL) {
 		nm_prerr("Failed to allocate physical lut for %s", na->name);
 		return ENOMEM;
 	}
 
-	for (i = 0; i < lim; i += p->_clustentries) {
+	for (i = 0; i < (int)p->objmax; i += p->_clustentries) {
 		lut->plut[i].paddr = 0;
 	}
 
-	for (i = 0; i < lim; i += p->_clustentries) {
-		int j;
+	error = netmap_mem_map_range(p, na, 0, lim);
+	if (error)
+		netmap_mem_unmap(p, na);
 
-		if (p->lut[i].vaddr == NULL)
-			continue;
+#endif /* linux */
 
-		error = netmap_load_map(na, (bus_dma_tag_t) na->pdev, &lut->plut[i].paddr,
-				p->lut[i].vaddr, p->_clustsize);
-		if (error) {
-			nm_prerr("Failed to map cluster #%d from the %s pool", i, p->name);
-			break;
-		}
+	return error;
+}
 
-		for (j = 1; j < p->_clustentries; j++) {
-			lut->plut[i + j].paddr = lut->plut[i + j - 1].paddr + p->_objsize;
+/*
+ * Adapters bound to the allocator, from netmap_mem_finalize() until
+ * netmap_mem_deref() unmaps the pool for them. Each one is linked
+ * once, however many of its fds are bound. Call with NMA_LOCK held.
+ */
+static void
+netmap_mem_link(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	struct netmap_adapter *u;
+
+	for (u = nmd->users; u != NULL; u = u->nm_mem_next) {
+		if (u == na)
+			return;
+	}
+	na->nm_mem_next = nmd->users;
+	nmd->users = na;
+}
+
+static void
+netmap_mem_unlink(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	struct netmap_adapter **pu;
+
+	for (pu = &nmd->users; *pu != NULL; pu = &(*pu)->nm_mem_next) {
+		if (*pu == na) {
+			*pu = na->nm_mem_next;
+			na->nm_mem_next = NULL;
+			return;
 		}
 	}
+}
 
-	if (error)
-		netmap_mem_unmap(p, na);
+/*
+ * The buffer pool may have grown since the adapter cached the lut
+ * (see netmap_buf_pool_grow()): map the new clusters for its device,
+ * if any, and only then let it see the new buffers. The lut itself
+ * does not move, so the datapath can keep running meanwhile.
+ * Call with NMA_LOCK held.
+ */
+static void
+netmap_mem_lut_refresh(struct netmap_adapter *na)
+{
+	struct netmap_obj_pool *p = &na->nm_mem->pools[NETMAP_BUF_POOL];
+	struct netmap_lut *lut = &na->na_lut;
 
+	if (na->nm_mem->ops != &netmap_mem_global_ops ||
+			lut->lut != p->lut || lut->objtotal >= p->objtotal)
+		return;
+#ifdef linux
+	if (na->pdev != NULL && lut->plut != NULL &&
+			netmap_mem_map_range(p, na, lut->objtotal, p->objtotal)) {
+		nm_prerr("%s: cannot map the new buffers", na->name);
+		return;
+	}
 #endif /* linux */
-
-	return error;
+	nm_stst_barrier();
+	lut->objtotal = p->objtotal;
+#ifdef WITH_VALE
+	if (nm_is_bwrap(na))
+		netmap_bwrap_lut_refresh(na);
+#endif /* WITH_VALE */
 }
 
 static int
@@ -1630,6 +2561,15 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
 		if (nmd->lasterr)
 			goto error;
+		if (nmd->huge_cur) {
+			/* keep every pool aligned to the hugepage size in
+			 * the mmap()ed region, so that it can be mapped
+			 * with large pages */
+			u_int align = 1U << nmd->huge_cur;
+
+			nmd->pools[i].memtotal = (nmd->pools[i].memtotal +
+				align - 1) & ~(align - 1);
+		}
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
 	}
 	nmd->lasterr = netmap_mem_init_bitmaps(nmd);
@@ -1709,7 +2649,7 @@ error:
 
 struct netmap_mem_d *
 netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
-		u_int extra_bufs, u_int npipes, int *perr)
+		u_int extra_bufs, u_int npipes, int node, int *perr)
 {
 	struct netmap_mem_d *d = NULL;
 	struct netmap_obj_params p[NETMAP_POOLS_NR];
@@ -1761,6 +2701,8 @@ netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
 			p[NETMAP_BUF_POOL].size);
 
 	d = _netmap_mem_private_new(sizeof(*d), p, &netmap_mem_global_ops, perr);
+	if (d != NULL)
+		d->nm_node = node;
 
 	return d;
 }
@@ -1770,10 +2712,32 @@ netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
 static int
 netmap_mem2_config(struct netmap_mem_d *nmd)
 {
-	int i;
+	int i, changed;
+	u_int huge_shift = nmd->huge_shift < 0 ?
+		netmap_hugepage_shift : nmd->huge_shift;
+	int node = nmd->nm_node >= 0 ? nmd->nm_node : nmd->dev_node;
+	u_int grow = netmap_buf_grow_max;
+	int contig = !!netmap_buf_contig;
 
-	if (!netmap_mem_params_changed(nmd->params))
+	if (nmd->loans != NULL && (nmd->loans->lent ||
+			nmd->loans->done_pending)) {
+		/* the host stack still holds some buffers */
+		goto out;
+	}
+	if (!netmap_hugepage_valid(huge_shift))
+		huge_shift = 0;
+	changed = netmap_mem_params_changed(nmd->params);
+	if (!changed && huge_shift == nmd->huge_cur && node == nmd->node_cur &&
+			grow == nmd->grow_cur && contig == nmd->contig_cur)
 		goto out;
+	nmd->huge_cur = huge_shift;
+	nmd->node_cur = node;
+	nmd->grow_cur = grow;
+	nmd->contig_cur = contig;
+	if (huge_shift)
+		nmd->flags |= NETMAP_MEM_HUGE;
+	else
+		nmd->flags &= ~NETMAP_MEM_HUGE;
 
 	ND("reconfiguring");
 
@@ -1784,12 +2748,33 @@ netmap_mem2_config(struct netmap_mem_d *nmd)
 		}
 		nmd->flags &= ~NETMAP_MEM_FINALIZED;
 	}
+	netmap_buf_loans_free(nmd);	/* sized for the old pool */
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		/* only the buffer and ring pools are large enough to use
+		 * hugepages, and the rings are enlarged to fit them */
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				nmd->params[i].num, nmd->params[i].size);
+				nmd->params[i].num, nmd->params[i].size,
+				i == NETMAP_IF_POOL ? 0 : huge_shift,
+				i == NETMAP_RING_POOL);
 		if (nmd->lasterr)
 			goto out;
+		nmd->pools[i].numa_node = node;
+		nmd->pools[i]._objgrow = 0;
+		nmd->pools[i]._contig = 0;
+	}
+	if (contig && !nmd->pools[NETMAP_BUF_POOL].huge_shift) {
+		nmd->pools[NETMAP_BUF_POOL]._contig = 1;
+		grow = 0;
+	}
+	if (grow) {
+		struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+		/* whole clusters, within the pool limits */
+		if (grow > p->nummax - p->_objtotal)
+			grow = p->nummax > p->_objtotal ?
+				p->nummax - p->_objtotal : 0;
+		p->_objgrow = grow - grow % p->_clustentries;
 	}
 
 out:
@@ -1820,6 +2805,7 @@ netmap_mem2_delete(struct netmap_mem_d *nmd)
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 	    netmap_destroy_obj_allocator(&nmd->pools[i]);
 	}
+	netmap_buf_loans_free(nmd);
 
 	NMA_LOCK_DESTROY(nmd);
 	if (nmd != &nm_mem)
@@ -1875,6 +2861,10 @@ netmap_free_rings(struct netmap_adapter *na)
 			} else {
 				ND("NOT freeing bufs for %s", kring->name);
 			}
+			if (kring->nkr_tstamp != NULL) {
+				netmap_ring_free(na->nm_mem, kring->nkr_tstamp);
+				kring->nkr_tstamp = NULL;
+			}
 			netmap_ring_free(na->nm_mem, ring);
 			kring->ring = NULL;
 		}
@@ -1921,6 +2911,7 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 			ND("txring at %p", ring);
 			kring->ring = ring;
 			*(uint32_t *)(uintptr_t)&ring->num_slots = ndesc;
+			*(int64_t *)(uintptr_t)&ring->tstamp_ofs = 0;
 			*(int64_t *)(uintptr_t)&ring->buf_ofs =
 			    (na->nm_mem->pools[NETMAP_IF_POOL].memtotal +
 				na->nm_mem->pools[NETMAP_RING_POOL].memtotal) -
@@ -2012,6 +3003,7 @@ netmap_mem2_if_new(struct netmap_adapter *na, struct netmap_priv_d *priv)
 	/* initialize base fields -- override const */
 	*(u_int *)(uintptr_t)&nifp->ni_tx_rings = na->num_tx_rings;
 	*(u_int *)(uintptr_t)&nifp->ni_rx_rings = na->num_rx_rings;
+	*(uint32_t *)(uintptr_t)&nifp->ni_memsize = na->nm_mem->nm_totalsize;
 	strlcpy(nifp->ni_name, na->name, sizeof(nifp->ni_name));
 
 	/*
@@ -2045,6 +3037,19 @@ netmap_mem2_if_new(struct netmap_adapter *na, struct netmap_priv_d *priv)
 		*(ssize_t *)(uintptr_t)&nifp->ring_ofs[i+n[NR_TX]] = ofs;
 	}
 
+	if ((priv->np_flags & NR_RX_TSTAMP) && netmap_tstamp_create(na, priv)) {
+		nm_prerr("%s: cannot allocate the rx timestamps", na->name);
+		netmap_if_free(na->nm_mem, nifp);
+		return NULL;
+	}
+
+	*(int64_t *)(uintptr_t)&nifp->ni_bufq_ofs = 0;
+	if ((priv->np_flags & NR_BUFQ) && netmap_bufq_new(na->nm_mem, nifp)) {
+		nm_prerr("%s: cannot allocate the buffer queue", na->name);
+		netmap_if_free(na->nm_mem, nifp);
+		return NULL;
+	}
+
 	return (nifp);
 }
 
@@ -2056,6 +3061,7 @@ netmap_mem2_if_delete(struct netmap_adapter *na, struct netmap_if *nifp)
 		return;
 	if (nifp->ni_bufs_head)
 		netmap_extra_free(na, nifp->ni_bufs_head);
+	netmap_bufq_delete(na, nifp);
 	netmap_if_free(na->nm_mem, nifp);
 }
 
@@ -2108,11 +3114,106 @@ netmap_mem_pools_info_get(struct nmreq_pools_info *req,
 			     nmd->pools[NETMAP_RING_POOL].memtotal;
 	req->nr_buf_pool_objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
 	req->nr_buf_pool_objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	req->nr_hugepage_shift = nmd->huge_cur;
+	req->nr_numa_node = nmd->node_cur;
+	NMA_UNLOCK(nmd);
+
+	return 0;
+}
+
+int
+netmap_mem_pools_stats_get(struct nmreq_pools_stats *req,
+				struct netmap_mem_d *nmd)
+{
+	struct nmreq_pool_stats *ps[NETMAP_POOLS_NR] = {
+		[NETMAP_IF_POOL] = &req->nr_if_pool,
+		[NETMAP_RING_POOL] = &req->nr_ring_pool,
+		[NETMAP_BUF_POOL] = &req->nr_buf_pool,
+	};
+	int i;
+
+	NMA_LOCK(nmd);
+	req->nr_mem_id = nmd->nm_id;
+	req->nr_users = nmd->active;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+
+		ps[i]->nr_objtotal = p->objtotal;
+		ps[i]->nr_objfree = p->objfree;
+		ps[i]->nr_hiwat = p->hiwat;
+		ps[i]->nr_failures = p->nfail;
+	}
+	req->nr_extra_bufs = nmd->extra_bufs;
+	req->nr_leaked = nmd->leaked;
 	NMA_UNLOCK(nmd);
 
 	return 0;
 }
 
+int
+netmap_mem_pools_config(struct netmap_mem_d *nmd,
+			struct nmreq_pools_config *req)
+{
+	int error;
+
+	if (!netmap_hugepage_valid(req->nr_hugepage_shift))
+		return EINVAL;
+	if ((req->nr_flags & NETMAP_POOLS_CONFIG_NUMA) &&
+			req->nr_numa_node >= 0 &&
+			!nm_numa_node_valid(req->nr_numa_node))
+		return EINVAL;
+#ifdef _WIN32
+	if (req->nr_hugepage_shift)
+		return EOPNOTSUPP;
+#endif /* _WIN32 */
+
+	NMA_LOCK(nmd);
+	if (nmd->ops != &netmap_mem_global_ops) {
+		/* external or passed-through memory */
+		error = EOPNOTSUPP;
+	} else if (nmd->active) {
+		error = EBUSY;
+	} else {
+		nmd->huge_shift = req->nr_hugepage_shift;
+		if (req->nr_flags & NETMAP_POOLS_CONFIG_NUMA)
+			nmd->nm_node = req->nr_numa_node < 0 ?
+				-1 : req->nr_numa_node;
+		error = netmap_mem_config(nmd);
+	}
+	NMA_UNLOCK(nmd);
+
+	return error;
+}
+
+/*
+ * Return the hugepage order of the pool that contains offset 'off' of
+ * the mmap()ed region, or 0 if the pool uses normal pages.
+ * Hugepage-backed pools start at offsets aligned to the hugepage size,
+ * so the OS can map them with large pages.
+ */
+int
+netmap_mem_ofs_hugeshift(struct netmap_mem_d *nmd, vm_ooffset_t off)
+{
+	int i, shift = 0;
+
+	NMA_LOCK(nmd);
+	if (nmd->ops == &netmap_mem_global_ops &&
+			(nmd->flags & NETMAP_MEM_FINALIZED)) {
+		for (i = 0; i < NETMAP_POOLS_NR; i++) {
+			struct netmap_obj_pool *p = &nmd->pools[i];
+
+			if (off < p->memtotal) {
+				shift = p->huge_shift;
+				break;
+			}
+			off -= p->memtotal;
+		}
+	}
+	NMA_UNLOCK(nmd);
+
+	return shift;
+}
+
 #ifdef WITH_EXTMEM
 struct netmap_mem_ext {
 	struct netmap_mem_d up;
@@ -2279,7 +3380,7 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 		p->_clustsize = o->size;
 		p->_clustentries = 1;
 
-		p->lut = nm_alloc_lut(o->num);
+		p->lut = nm_alloc_lut(o->num, -1);
 		if (p->lut == NULL) {
 			error = ENOMEM;
 			goto out_delete;
@@ -2336,6 +3437,7 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 			off = noff;
 		}
 		p->objtotal = j;
+		p->objmax = j;
 		p->numclusters = p->objtotal;
 		p->memtotal = j * p->_objsize;
 		ND("%d memtotal %u", j, p->memtotal);
@@ -2548,7 +3650,7 @@ netmap_mem_pt_guest_finalize(struct netmap_mem_d *nmd)
 	/* allocate the lut */
 	if (ptnmd->buf_lut.lut == NULL) {
 		D("allocating lut");
-		ptnmd->buf_lut.lut = nm_alloc_lut(nbuffers);
+		ptnmd->buf_lut.lut = nm_alloc_lut(nbuffers, -1);
 		if (ptnmd->buf_lut.lut == NULL) {
 			D("lut allocation failed");
 			return ENOMEM;
@@ -2569,6 +3671,8 @@ netmap_mem_pt_guest_finalize(struct netmap_mem_d *nmd)
 
 	ptnmd->buf_lut.objtotal = nbuffers;
 	ptnmd->buf_lut.objsize = bufsize;
+	/* the BAR maps the whole pool linearly */
+	ptnmd->buf_lut.vbase = (char *)(ptnmd->nm_addr) + poolofs;
 	nmd->nm_totalsize = (unsigned int)mem_size;
 
 	/* Initialize these fields as are needed by
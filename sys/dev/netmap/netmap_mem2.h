@@ -142,7 +142,7 @@ int	   netmap_mem_get_info(struct netmap_mem_d *, uint64_t *size,
 				u_int *memflags, nm_memid_t *id);
 ssize_t    netmap_mem_if_offset(struct netmap_mem_d *, const void *vaddr);
 struct netmap_mem_d* netmap_mem_private_new( u_int txr, u_int txd, u_int rxr, u_int rxd,
-		u_int extra_bufs, u_int npipes, int* error);
+		u_int extra_bufs, u_int npipes, int node, int* error);
 
 #define netmap_mem_get(d) __netmap_mem_get(d, __FUNCTION__, __LINE__)
 #define netmap_mem_put(d) __netmap_mem_put(d, __FUNCTION__, __LINE__)
@@ -167,14 +167,24 @@ struct netmap_mem_d* netmap_mem_pt_guest_attach(struct ptnetmap_memdev *, uint16
 int netmap_mem_pt_guest_ifp_del(struct netmap_mem_d *, struct ifnet *);
 #endif /* WITH_PTNETMAP */
 
+int netmap_mem_pools_config(struct netmap_mem_d *,
+				struct nmreq_pools_config *);
+int netmap_mem_ofs_hugeshift(struct netmap_mem_d *, vm_ooffset_t);
 int netmap_mem_pools_info_get(struct nmreq_pools_info *,
 				struct netmap_mem_d *);
+int netmap_mem_pools_stats_get(struct nmreq_pools_stats *,
+				struct netmap_mem_d *);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
 #define NETMAP_MEM_EXT		0x10	/* external memory (not remappable) */
+#define NETMAP_MEM_HUGE		0x20	/* pools may use hugepages */
 
 uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
+int netmap_mem_bufq_sync(struct netmap_adapter *, struct netmap_if *);
+void netmap_mem_bufs_lend(struct netmap_adapter *, struct netmap_slot **,
+		struct mbuf **, u_int);
+void netmap_mem_buf_return(void *cookie, uint32_t idx);
 
 #ifdef WITH_EXTMEM
 #include <net/netmap_virt.h>
@@ -997,6 +997,7 @@ netmap_get_monitor_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 				mna->up.num_rx_desc,
 				0, /* extra bufs */
 				0, /* pipes */
+				nm_numa_node_id(pna->pdev),
 				&error);
 		if (mna->up.nm_mem == NULL)
 			goto put_out;
@@ -490,3 +490,146 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	*j = j_cur;
 	*howmany -= dst_slots;
 }
+
+/* Room for the headers of a packet from the host stack: Ethernet with
+ * one VLAN tag, IPv4 with options and TCP with options. */
+#define NM_HOST_HDR_MAX	(18 + 60 + 60)
+
+/*
+ * Copy a packet coming from the host stack into the host RX ring,
+ * starting at slot nm_i, and do in software the offloads that the
+ * stack left to the device. If 'mss' is zero, the packet is copied
+ * into a single slot and its TCP/UDP checksum is computed. Otherwise
+ * the packet is a TCP TSO/GSO one, and it is split into segments of
+ * at most 'mss' payload bytes, one per slot, each one with its own
+ * copy of the headers fixed up by gso_fix_segment().
+ *
+ * At most 'avail' slots are used. Returns the number of slots filled,
+ * or 0 if the packet cannot be handled and must be dropped.
+ */
+u_int
+netmap_host_offload(struct netmap_kring *kring, struct mbuf *m, u_int mss,
+		u_int nm_i, u_int avail)
+{
+	struct netmap_adapter *na = kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int len = MBUF_LEN(m);
+	uint64_t hdrbuf[howmany(NM_HOST_HDR_MAX, sizeof(uint64_t))];
+	uint8_t *hdr = (uint8_t *)hdrbuf;
+	u_int hlen = MIN(len, NM_HOST_HDR_MAX);
+	u_int ethhlen = 14, iphlen, l4hlen, hdrlen, datalen;
+	u_int ethertype, ipv4, tcp, off, idx;
+	uint8_t proto;
+
+	m_copydata(m, 0, hlen, (caddr_t)hdr);
+
+	/* Parse the Ethernet, IP and TCP/UDP headers. */
+	if (hlen < ethhlen + 4)
+		goto bad;
+	ethertype = (hdr[12] << 8) | hdr[13];
+	if (ethertype == 0x8100) { /* 802.1Q */
+		ethhlen += 4;
+		ethertype = (hdr[16] << 8) | hdr[17];
+	}
+	if (ethertype == 0x0800) {
+		struct nm_iphdr *iph = (struct nm_iphdr *)(hdr + ethhlen);
+
+		if (hlen < ethhlen + sizeof(*iph))
+			goto bad;
+		ipv4 = 1;
+		iphlen = 4 * (iph->version_ihl & 0x0F);
+		proto = iph->protocol;
+		datalen = be16toh(iph->tot_len);
+		if (iphlen < sizeof(*iph) || datalen < iphlen)
+			goto bad;
+		datalen -= iphlen;
+	} else if (ethertype == 0x86DD) {
+		struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(hdr + ethhlen);
+
+		if (hlen < ethhlen + sizeof(*ip6h))
+			goto bad;
+		/* Extension headers are not supported. */
+		ipv4 = 0;
+		iphlen = sizeof(*ip6h);
+		proto = ip6h->nexthdr;
+		datalen = be16toh(ip6h->payload_len);
+	} else {
+		goto bad;
+	}
+	if (proto == 6) {
+		struct nm_tcphdr *tcph =
+			(struct nm_tcphdr *)(hdr + ethhlen + iphlen);
+
+		if (hlen < ethhlen + iphlen + sizeof(*tcph))
+			goto bad;
+		tcp = 1;
+		l4hlen = 4 * (tcph->doff >> 4);
+		if (l4hlen < sizeof(*tcph))
+			goto bad;
+	} else if (proto == 17 && mss == 0) {
+		tcp = 0;
+		l4hlen = sizeof(struct nm_udphdr);
+	} else {
+		goto bad;
+	}
+	hdrlen = ethhlen + iphlen + l4hlen;
+	if (hdrlen > hlen)
+		goto bad;
+
+	if (mss == 0) {
+		struct netmap_slot *slot = &ring->slot[nm_i];
+		uint8_t *dst = NMB(na, slot);
+		uint8_t *l4 = dst + ethhlen + iphlen;
+		uint16_t *check;
+
+		/* Trust the IP length fields only if they fit the frame. */
+		if (len > NETMAP_BUF_SIZE(na) ||
+				datalen > len - ethhlen - iphlen)
+			goto bad;
+		m_copydata(m, 0, len, (caddr_t)dst);
+		check = tcp ? &((struct nm_tcphdr *)l4)->check :
+			&((struct nm_udphdr *)l4)->check;
+		*check = 0;
+		if (ipv4) {
+			struct nm_iphdr *iph = (struct nm_iphdr *)(dst + ethhlen);
+
+			/* FreeBSD may defer the IP header checksum, too. */
+			iph->check = 0;
+			iph->check = nm_os_csum_ipv4(iph);
+			nm_os_csum_tcpudp_ipv4(iph, l4, datalen, check);
+		} else {
+			nm_os_csum_tcpudp_ipv6((struct nm_ipv6hdr *)(dst + ethhlen),
+					l4, datalen, check);
+		}
+		if (!tcp && *check == 0)
+			*check = 0xFFFF; /* zero means no UDP checksum */
+		slot->len = len;
+		slot->flags = 0;
+		return 1;
+	}
+
+	if (len <= hdrlen || hdrlen + mss > NETMAP_BUF_SIZE(na) ||
+			howmany(len - hdrlen, mss) > avail)
+		goto bad;
+	for (idx = 0, off = hdrlen; off < len; idx++) {
+		struct netmap_slot *slot = &ring->slot[nm_i];
+		uint8_t *dst = NMB(na, slot);
+		u_int seglen = MIN(mss, len - off);
+
+		memcpy(dst, hdr, hdrlen);
+		m_copydata(m, off, seglen, (caddr_t)(dst + hdrlen));
+		gso_fix_segment(dst + ethhlen, hdrlen - ethhlen + seglen, ipv4,
+				iphlen, tcp, idx, off - hdrlen, off + seglen == len);
+		slot->len = hdrlen + seglen;
+		slot->flags = 0;
+		off += seglen;
+		nm_i = nm_next(nm_i, lim);
+	}
+	return idx;
+
+bad:
+	RD(1, "%s: cannot offload %s packet, len %u", na->name,
+			mss ? "TSO" : "checksum", len);
+	return 0;
+}
@@ -85,9 +85,8 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 /*
  * system parameters (most of them in netmap_kern.h)
  * NM_BDG_NAME	prefix for switch port names, default "vale"
- * NM_BDG_MAXPORTS	number of ports
- * NM_BRIDGES	max number of switches in the system.
- *	XXX should become a sysctl or tunable
+ * NM_BDG_MAXPORTS	max number of ports, allocated on demand
+ * netmap_bridges	number of switches in the system (load-time tunable)
  *
  * Switch ports are named valeX:Y where X is the switch name and Y
  * is the port. If Y matches a physical interface name, the port is
@@ -107,6 +106,14 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NETMAP_MAX_FRAGS)
 /* NM_FT_NULL terminates a list of slots in the ft */
 #define NM_FT_NULL		NM_BDG_BATCH_MAX
+/* destination queues in the scratch area, a power of 2 larger than
+ * the number of distinct destinations a batch can have */
+#define NM_VALE_DSTQ		2048
+#define NM_VALE_DSTQ_SHIFT	11
+#define NM_VALE_NOKEY		0xffff	/* empty destination queue */
+/* senders tracked by each rx ring of a fair port, a power of 2 */
+#define NM_VALE_FAIR_SLOTS	64
+#define NM_VALE_FAIR_MAXW	256	/* max weight of a sender */
 
 
 /*
@@ -115,12 +122,19 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * last packet in the block may overflow the size.
  */
 static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
+/* slots that a sender with weight 1 may lease per round on a fair port */
+static int bridge_fair_quantum = 64;
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0,
 		"Max batch size to be used in the bridge");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_fair_quantum, CTLFLAG_RW,
+		&bridge_fair_quantum, 0,
+		"Slots per round for each sender to a fair VALE port");
 SYSEND;
 
+static int nm_vale_mcast_empty(const struct nm_hash_table *ht, u_int g,
+		uint32_t now);
 static int netmap_vale_vp_create(struct nmreq_header *hdr, struct ifnet *,
 		struct netmap_mem_d *nmd, struct netmap_vp_adapter **);
 static int netmap_vale_vp_bdg_attach(const char *, struct netmap_adapter *,
@@ -131,16 +145,62 @@ static int netmap_vale_bwrap_attach(const char *, struct netmap_adapter *);
  * For each output interface, nm_vale_q is used to construct a list.
  * bq_len is the number of output buffers (we can have coalescing
  * during the copy).
+ * The queues live in a small open-addressing table indexed by
+ * bq_key (port * NM_BDG_MAXRINGS + ring), so that the scratch area
+ * does not depend on the number of ports of the bridge.
  */
 struct nm_vale_q {
 	uint16_t bq_head;
 	uint16_t bq_tail;
+	uint16_t bq_key;	/* destination, or NM_VALE_NOKEY */
+	uint16_t bq_pkts;	/* number of packets */
 	uint32_t bq_len;	/* number of buffers */
 };
 
+/*
+ * Match/action rules set with NETMAP_REQ_VALE_RULES_SET. Each rule is
+ * compiled into a value and a mask over a fixed key built from the
+ * packet headers, so matching a rule costs a few and/xor operations
+ * whatever the fields it looks at:
+ *	k[0]	destination MAC, ethertype << 48
+ *	k[1]	source MAC, source port << 48
+ *	k[2]	IPv4 source, IPv4 destination << 32
+ *	k[3]	L4 source port, L4 destination port << 16, protocol << 32
+ * k[2] and k[3] are only filled if some rule needs them. The table is
+ * replaced as a whole, and the old one freed after nm_bdg_sync().
+ */
+#define NM_VALE_MAX_RULES	256
+#define NM_VALE_KEY_WORDS	4
+#define NM_VALE_MATCH_FIELDS	0x1ff	/* all the NR_VALE_MATCH_* */
+#define NM_VALE_MAC_MASK	0xffffffffffffULL
+#define NM_VALE_CLS_LEARN	0xffff	/* go on with the lookup */
+#define NM_VALE_CLS_HDR		128	/* bytes copied from NS_INDIRECT slots */
+
+struct nm_vale_crule {
+	uint64_t	cr_val[NM_VALE_KEY_WORDS];
+	uint64_t	cr_mask[NM_VALE_KEY_WORDS];
+	uint16_t	cr_port;	/* result of nm_vale_classify() */
+	uint8_t		cr_ring;	/* or NR_VALE_RING_ANY */
+};
+
+struct nm_vale_cls {
+	u_int			cls_count;
+	int			cls_l3;		/* some rule needs k[2], k[3] */
+	struct nm_vale_crule	*cls_rules;
+	/* the rules as given by the user, with the hit counters */
+	struct nmreq_vale_rule	*cls_src;
+};
+
+/* credit of a sender on an rx ring of a fair port */
+struct nm_vale_fair {
+	uint32_t	vf_round;	/* last round we were refilled */
+	uint32_t	vf_deficit;	/* slots we can still lease */
+};
+
 /* Holds the default callbacks */
 struct netmap_bdg_ops vale_bdg_ops = {
 	.lookup = netmap_vale_learning,
+	.lookup_batch = netmap_vale_learning_batch,
 	.config = NULL,
 	.dtor = NULL,
 	.vp_create = netmap_vale_vp_create,
@@ -209,8 +269,8 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 	struct netmap_kring **kring;
 
 	NMG_LOCK_ASSERT();
-	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
+	/* destination queues + broadcast */
+	num_dstq = NM_VALE_DSTQ + 1;
 	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
 	l += sizeof(struct nm_vale_q) * num_dstq;
 	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
@@ -230,7 +290,9 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 		dstq = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
 		for (j = 0; j < num_dstq; j++) {
 			dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
+			dstq[j].bq_key = NM_VALE_NOKEY;
 			dstq[j].bq_len = 0;
+			dstq[j].bq_pkts = 0;
 		}
 		kring[i]->nkr_ft = ft;
 	}
@@ -364,9 +426,9 @@ netmap_vale_list(struct nmreq_header *hdr)
 		j = req->nr_port_idx;
 
 		NMG_LOCK();
-		for (error = ENOENT; i < NM_BRIDGES; i++) {
+		for (error = ENOENT; i < num_bridges; i++) {
 			b = bridges + i;
-			for ( ; j < NM_BDG_MAXPORTS; j++) {
+			for ( ; j < b->bdg_max_ports; j++) {
 				if (b->bdg_ports[j] == NULL)
 					continue;
 				vpna = b->bdg_ports[j];
@@ -387,6 +449,405 @@ netmap_vale_list(struct nmreq_header *hdr)
 	return error;
 }
 
+/* Process NETMAP_REQ_VALE_FDB_GET and NETMAP_REQ_VALE_FDB_SET. */
+int
+netmap_vale_fdb(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_fdb *req =
+		(struct nmreq_vale_fdb *)(uintptr_t)hdr->nr_body;
+	struct nm_hash_table *ht;
+	struct nm_bridge *b;
+	uint32_t now = time_second;
+	u_int i, n;
+	int error = 0;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+		return EINVAL;
+	}
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (!b) {
+		error = ENOENT;
+		goto out;
+	}
+	ht = b->ht;
+
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_FDB_SET) {
+		if (!nm_bdg_valid_auth_token(b, NULL)) {
+			error = EACCES;
+			goto out;
+		}
+		if (req->nr_buckets > NM_BDG_HASH_MAX) {
+			error = EINVAL;
+			goto out;
+		}
+		if (req->nr_buckets) {
+			error = nm_bdg_ht_resize(b, req->nr_buckets);
+			if (error)
+				goto out;
+		}
+		if (req->nr_flags & NR_VALE_FDB_NO_AGEING)
+			ht->ht_ageing = 0;
+		else if (req->nr_ageing)
+			ht->ht_ageing = req->nr_ageing;
+		if (req->nr_flags & NR_VALE_FDB_FLUSH)
+			nm_bdg_ht_flush(ht, -1);
+		if (req->nr_flags & NR_VALE_FDB_CLEAR_STATS) {
+			bzero(ht->ht_pcpu,
+				sizeof(*ht->ht_pcpu) * ht->ht_ncpus);
+			ht->ht_learned = 0;
+			ht->ht_evictions = ht->ht_expired = 0;
+		}
+		goto out;
+	}
+
+	req->nr_buckets = ht->ht_buckets;
+	req->nr_ways = NM_BDG_HASH_WAYS;
+	req->nr_ageing = ht->ht_ageing;
+	req->nr_flags = ht->ht_ageing ? 0 : NR_VALE_FDB_NO_AGEING;
+	req->nr_entries = 0;
+	/* the table cannot be resized, as we hold NMG_LOCK */
+	n = ht->ht_buckets * NM_BDG_HASH_WAYS;
+	for (i = 0; i < n; i++) {
+		struct nm_hash_ent *e = ht->ht_ent + i;
+
+		if ((e->mac & NM_HASH_ENT_VALID) &&
+				!(ht->ht_ageing && now - e->ts > ht->ht_ageing))
+			req->nr_entries++;
+	}
+	req->nr_groups = 0;
+	for (i = 0; i < ht->ht_mcast_used; i++) {
+		if (!nm_vale_mcast_empty(ht, i, now))
+			req->nr_groups++;
+	}
+	req->nr_hits = req->nr_misses = 0;
+	for (i = 0; i < ht->ht_ncpus; i++) {
+		req->nr_hits += ht->ht_pcpu[i].hits;
+		req->nr_misses += ht->ht_pcpu[i].misses;
+	}
+	req->nr_learned = ht->ht_learned;
+	req->nr_evictions = ht->ht_evictions;
+	req->nr_expired = ht->ht_expired;
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+/*
+ * Find the port named 'name' (e.g. "vale0:v1") among the active ports
+ * of its bridge. Returns NULL and sets *error if there is none.
+ * Must be called with NMG_LOCK held.
+ */
+static struct netmap_vp_adapter *
+nm_vale_find_port(const char *name, int *error)
+{
+	struct netmap_vp_adapter *vpna;
+	struct nm_bridge *b;
+	u_int j;
+
+	if (strncmp(name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+		*error = EINVAL;
+		return NULL;
+	}
+	b = nm_find_bridge(name, 0 /* don't create */, NULL);
+	if (!b) {
+		*error = ENOENT;
+		return NULL;
+	}
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		vpna = b->bdg_ports[b->bdg_port_index[j]];
+		if (vpna && !strcmp(vpna->up.name, name))
+			return vpna;
+	}
+	*error = ENXIO;
+	return NULL;
+}
+
+/* Process NETMAP_REQ_VALE_PORT_GET and NETMAP_REQ_VALE_PORT_SET. */
+int
+netmap_vale_port(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_port *req =
+		(struct nmreq_vale_port *)(uintptr_t)hdr->nr_body;
+	struct netmap_vp_adapter *vpna;
+	int error = 0;
+
+	NMG_LOCK();
+	vpna = nm_vale_find_port(hdr->nr_name, &error);
+	if (vpna == NULL)
+		goto out;
+
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_PORT_SET) {
+		if (!nm_bdg_valid_auth_token(vpna->na_bdg, NULL)) {
+			error = EACCES;
+			goto out;
+		}
+		if ((req->nr_flags & ~(NR_VALE_PORT_RXHASH |
+		    NR_VALE_PORT_ZCOPY | NR_VALE_PORT_FAIR)) ||
+		    req->nr_weight > NM_VALE_FAIR_MAXW) {
+			error = EINVAL;
+			goto out;
+		}
+		/* the buffers of NICs and host rings are not ours to swap */
+		if ((req->nr_flags & NR_VALE_PORT_ZCOPY) &&
+				vpna->up.nm_register != netmap_vp_reg) {
+			error = EOPNOTSUPP;
+			goto out;
+		}
+		vpna->rxhash = !!(req->nr_flags & NR_VALE_PORT_RXHASH);
+		vpna->zcopy = !!(req->nr_flags & NR_VALE_PORT_ZCOPY);
+		vpna->fair = !!(req->nr_flags & NR_VALE_PORT_FAIR);
+		if (req->nr_weight)
+			vpna->weight = req->nr_weight;
+		goto out;
+	}
+
+	req->nr_flags = (vpna->rxhash ? NR_VALE_PORT_RXHASH : 0) |
+		(vpna->zcopy ? NR_VALE_PORT_ZCOPY : 0) |
+		(vpna->fair ? NR_VALE_PORT_FAIR : 0);
+	req->nr_rx_rings = vpna->up.num_rx_rings;
+	req->nr_weight = vpna->weight ? vpna->weight : 1;
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* MAC address in the same layout as the lookup reads it from a frame */
+static uint64_t
+nm_vale_mac64(const uint8_t *m)
+{
+	return (uint64_t)m[0] | (uint64_t)m[1] << 8 | (uint64_t)m[2] << 16 |
+		(uint64_t)m[3] << 24 | (uint64_t)m[4] << 32 |
+		(uint64_t)m[5] << 40;
+}
+
+static struct nm_vale_cls *
+nm_vale_cls_alloc(u_int n)
+{
+	struct nm_vale_cls *cls;
+
+	cls = nm_os_malloc(sizeof(*cls) + n * (sizeof(struct nm_vale_crule) +
+			sizeof(struct nmreq_vale_rule)));
+	if (cls == NULL)
+		return NULL;
+	cls->cls_count = n;
+	cls->cls_rules = (struct nm_vale_crule *)(cls + 1);
+	cls->cls_src = (struct nmreq_vale_rule *)(cls->cls_rules + n);
+	return cls;
+}
+
+/* Check the rules in cls->cls_src and fill cls->cls_rules. */
+static int
+nm_vale_cls_compile(struct nm_vale_cls *cls)
+{
+	u_int i;
+
+	for (i = 0; i < cls->cls_count; i++) {
+		struct nmreq_vale_rule *r = cls->cls_src + i;
+		struct nm_vale_crule *cr = cls->cls_rules + i;
+		uint64_t *v = cr->cr_val, *m = cr->cr_mask;
+		uint16_t f = r->nr_fields;
+		uint32_t ipm;
+
+		if ((f & ~NM_VALE_MATCH_FIELDS) ||
+		    r->nr_action > NR_VALE_ACT_BCAST ||
+		    r->nr_src_plen > 32 || r->nr_dst_plen > 32)
+			return EINVAL;
+		if (r->nr_action == NR_VALE_ACT_FWD &&
+		    (r->nr_out_port >= NM_BDG_MAXPORTS ||
+		     (r->nr_out_ring >= NM_BDG_MAXRINGS &&
+		      r->nr_out_ring != NR_VALE_RING_ANY)))
+			return EINVAL;
+		r->nr_hits = 0;
+
+		/* the IP fields only exist in IPv4 packets */
+		if ((f & (NR_VALE_MATCH_SRC_IP | NR_VALE_MATCH_DST_IP)) &&
+		    !(f & NR_VALE_MATCH_ETHERTYPE)) {
+			m[0] |= 0xffffULL << 48;
+			v[0] |= 0x0800ULL << 48;
+		}
+		if (f & NR_VALE_MATCH_ETHERTYPE) {
+			m[0] |= 0xffffULL << 48;
+			v[0] = (v[0] & NM_VALE_MAC_MASK) |
+				(uint64_t)r->nr_ethertype << 48;
+		}
+		if (f & NR_VALE_MATCH_DST_MAC) {
+			m[0] |= NM_VALE_MAC_MASK;
+			v[0] |= nm_vale_mac64(r->nr_dst_mac);
+		}
+		if (f & NR_VALE_MATCH_SRC_MAC) {
+			m[1] |= NM_VALE_MAC_MASK;
+			v[1] |= nm_vale_mac64(r->nr_src_mac);
+		}
+		if (f & NR_VALE_MATCH_IN_PORT) {
+			m[1] |= 0xffffULL << 48;
+			v[1] |= (uint64_t)r->nr_in_port << 48;
+		}
+		if (f & NR_VALE_MATCH_SRC_IP) {
+			ipm = r->nr_src_plen ? ~0U << (32 - r->nr_src_plen) : 0;
+			m[2] |= ipm;
+			v[2] |= r->nr_src_ip & ipm;
+		}
+		if (f & NR_VALE_MATCH_DST_IP) {
+			ipm = r->nr_dst_plen ? ~0U << (32 - r->nr_dst_plen) : 0;
+			m[2] |= (uint64_t)ipm << 32;
+			v[2] |= (uint64_t)(r->nr_dst_ip & ipm) << 32;
+		}
+		if (f & NR_VALE_MATCH_SRC_PORT) {
+			m[3] |= 0xffff;
+			v[3] |= r->nr_src_port;
+		}
+		if (f & NR_VALE_MATCH_DST_PORT) {
+			m[3] |= 0xffffULL << 16;
+			v[3] |= (uint64_t)r->nr_dst_port << 16;
+		}
+		if (f & NR_VALE_MATCH_PROTO) {
+			m[3] |= 0xffULL << 32;
+			v[3] |= (uint64_t)r->nr_proto << 32;
+		}
+		if (m[2] | m[3])
+			cls->cls_l3 = 1;
+
+		cr->cr_ring = NR_VALE_RING_ANY;
+		switch (r->nr_action) {
+		case NR_VALE_ACT_LEARN:
+			cr->cr_port = NM_VALE_CLS_LEARN;
+			break;
+		case NR_VALE_ACT_FWD:
+			cr->cr_port = r->nr_out_port;
+			cr->cr_ring = r->nr_out_ring;
+			break;
+		case NR_VALE_ACT_DROP:
+			cr->cr_port = NM_BDG_NOPORT;
+			break;
+		case NR_VALE_ACT_BCAST:
+			cr->cr_port = NM_BDG_BROADCAST;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Process NETMAP_REQ_VALE_RULES_GET and NETMAP_REQ_VALE_RULES_SET. */
+int
+netmap_vale_rules(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_rules *req =
+		(struct nmreq_vale_rules *)(uintptr_t)hdr->nr_body;
+	struct nmreq_vale_rule *rules =
+		(struct nmreq_vale_rule *)(uintptr_t)req->nr_rules;
+	struct nm_vale_cls *cls = NULL, *old;
+	struct nm_bridge *b;
+	size_t len;
+	u_int n;
+	int error = 0;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+		return EINVAL;
+	}
+	req->nr_max = NM_VALE_MAX_RULES;
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_RULES_SET && req->nr_count) {
+		/* build the new table before taking the lock */
+		if (req->nr_count > NM_VALE_MAX_RULES || rules == NULL)
+			return EINVAL;
+		cls = nm_vale_cls_alloc(req->nr_count);
+		if (cls == NULL)
+			return ENOMEM;
+		len = sizeof(*rules) * req->nr_count;
+		/* nr_reserved tells if the body came from userspace */
+		if (hdr->nr_reserved)
+			error = copyin(rules, cls->cls_src, len);
+		else
+			memcpy(cls->cls_src, rules, len);
+		if (!error)
+			error = nm_vale_cls_compile(cls);
+		if (error) {
+			nm_os_free(cls);
+			return error;
+		}
+	}
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (!b) {
+		error = ENOENT;
+		goto out;
+	}
+	old = b->ht->ht_cls;
+
+	if (hdr->nr_reqtype == NETMAP_REQ_VALE_RULES_SET) {
+		if (!nm_bdg_valid_auth_token(b, NULL)) {
+			error = EACCES;
+			goto out;
+		}
+		BDG_MB();
+		b->ht->ht_cls = cls;
+		cls = old;	/* freed below, nobody uses it after the sync */
+		nm_bdg_sync(b);
+		goto out;
+	}
+
+	n = old ? old->cls_count : 0;
+	if (rules != NULL && n > 0) {
+		len = sizeof(*rules) * (n < req->nr_count ? n : req->nr_count);
+		if (hdr->nr_reserved)
+			error = copyout(old->cls_src, rules, len);
+		else
+			memcpy(rules, old->cls_src, len);
+	}
+	req->nr_count = n;
+out:
+	NMG_UNLOCK();
+	if (cls)
+		nm_os_free(cls);
+	return error;
+}
+
+/* Process NETMAP_REQ_VALE_STATS_GET. */
+int
+netmap_vale_stats(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_stats *req =
+		(struct nmreq_vale_stats *)(uintptr_t)hdr->nr_body;
+	struct netmap_vp_adapter *vpna;
+	struct netmap_adapter *na;
+	struct nm_bdg_stats *st;
+	u_int r = req->nr_ring_id;
+	int error = 0;
+
+	NMG_LOCK();
+	vpna = nm_vale_find_port(hdr->nr_name, &error);
+	if (vpna == NULL)
+		goto out;
+	na = &vpna->up;
+	req->nr_tx_rings = na->num_tx_rings;
+	req->nr_rx_rings = na->num_rx_rings;
+	if (r >= na->num_tx_rings && r >= na->num_rx_rings) {
+		error = EINVAL;
+		goto out;
+	}
+	/* The counters are read without stopping the datapath. The
+	 * krings only exist while the port is in netmap mode. */
+	if (r < na->num_tx_rings && na->tx_rings) {
+		st = &na->tx_rings[r]->nkr_bdg_stats;
+		req->nr_tx_pkts = st->pkts;
+		req->nr_tx_bytes = st->bytes;
+		req->nr_drop_lookup = st->drop_lookup;
+		req->nr_drop_down = st->drop_down;
+		req->nr_drop_nospace = st->drop_nospace;
+		req->nr_retries = st->retries;
+		req->nr_bcast = st->bcast;
+	}
+	if (r < na->num_rx_rings && na->rx_rings) {
+		st = &na->rx_rings[r]->nkr_bdg_stats;
+		req->nr_rx_pkts = st->pkts;
+		req->nr_rx_bytes = st->bytes;
+	}
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
 /* Process NETMAP_REQ_VALE_ATTACH.
  */
 int
@@ -553,8 +1014,8 @@ netmap_vale_vp_dtor(struct netmap_adapter *na)
 
 
 /* nm_krings_create callback for VALE ports.
- * Calls the standard netmap_krings_create, then adds leases on rx
- * rings and bdgfwd on tx rings.
+ * Calls the standard netmap_krings_create, then adds leases and
+ * fairness state on rx rings and bdgfwd on tx rings.
  */
 static int
 netmap_vale_vp_krings_create(struct netmap_adapter *na)
@@ -562,22 +1023,27 @@ netmap_vale_vp_krings_create(struct netmap_adapter *na)
 	u_int tailroom;
 	int error, i;
 	uint32_t *leases;
+	struct nm_vale_fair *fair;
 	u_int nrx = netmap_real_rings(na, NR_RX);
 
 	/*
 	 * Leases are attached to RX rings on vale ports
 	 */
-	tailroom = sizeof(uint32_t) * na->num_rx_desc * nrx;
+	tailroom = (sizeof(uint32_t) * na->num_rx_desc +
+		sizeof(struct nm_vale_fair) * NM_VALE_FAIR_SLOTS) * nrx;
 
 	error = netmap_krings_create(na, tailroom);
 	if (error)
 		return error;
 
 	leases = na->tailroom;
+	fair = (struct nm_vale_fair *)(leases + na->num_rx_desc * nrx);
 
 	for (i = 0; i < nrx; i++) { /* Receive rings */
 		na->rx_rings[i]->nkr_leases = leases;
 		leases += na->num_rx_desc;
+		na->rx_rings[i]->nkr_fair = fair;
+		fair += NM_VALE_FAIR_SLOTS;
 	}
 
 	error = nm_alloc_bdgfwd(na);
@@ -623,17 +1089,14 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
 	struct nm_bridge *b = na->na_bdg;
+	u_int e, pkts = 0;
+	uint64_t bytes = 0;
 
-	/* To protect against modifications to the bridge we acquire a
-	 * shared lock, waiting if we can sleep (if the source port is
-	 * attached to a user process) or with a trylock otherwise (NICs).
+	/* Modifications to the bridge do not stop us: the writers
+	 * wait for the batches in the epoch before freeing anything
+	 * we may be using.
 	 */
-	ND("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
-		BDG_RLOCK(b);
-	else if (!BDG_RTRYLOCK(b))
-		return j;
-	ND(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	e = nm_bdg_epoch_enter(b);
 	ft = kring->nkr_ft;
 
 	for (; likely(j != end); j = nm_next(j, lim)) {
@@ -643,6 +1106,7 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i].ft_len = slot->len;
 		ft[ft_i].ft_flags = slot->flags;
 		ft[ft_i].ft_offset = 0;
+		ft[ft_i].ft_slot = j;
 
 		ND("flags is 0x%x", slot->flags);
 		/* we do not use the buf changed flag, but we still need to reset it */
@@ -650,17 +1114,23 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 
 		/* this slot goes into a list so initialize the link field */
 		ft[ft_i].ft_next = NM_FT_NULL;
+		/* read the index once, the user may change it under us, and
+		 * the lookup and a zero-copy swap must see the same buffer */
+		ft[ft_i].ft_buf_idx = NM_ACCESS_ONCE(slot->buf_idx);
 		buf = ft[ft_i].ft_buf = (slot->flags & NS_INDIRECT) ?
-			(void *)(uintptr_t)slot->ptr : NMB(&na->up, slot);
+			(void *)(uintptr_t)slot->ptr :
+			NMB_IDX(&na->up, ft[ft_i].ft_buf_idx);
 		if (unlikely(buf == NULL)) {
 			nm_prlim(5, "NULL %s buffer pointer from %s slot %d len %d",
 				(slot->flags & NS_INDIRECT) ? "INDIRECT" : "DIRECT",
 				kring->name, j, ft[ft_i].ft_len);
 			buf = ft[ft_i].ft_buf = NETMAP_BUF_BASE(&na->up);
+			ft[ft_i].ft_buf_idx = 0;
 			ft[ft_i].ft_len = 0;
 			ft[ft_i].ft_flags = 0;
 		}
 		__builtin_prefetch(buf);
+		bytes += ft[ft_i].ft_len;
 		++ft_i;
 		if (slot->flags & NS_MOREFRAG) {
 			frags++;
@@ -670,6 +1140,7 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 			RD(5, "%d frags at %d", frags, ft_i - frags);
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
+		pkts++;
 		if (unlikely((int)ft_i >= bridge_batch))
 			ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
 	}
@@ -680,10 +1151,13 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i - 1].ft_flags &= ~NS_MOREFRAG;
 		ft[ft_i - frags].ft_frags = frags;
 		nm_prlim(5, "Truncate incomplete fragment at %d (%d frags)", ft_i, frags);
+		pkts++;
 	}
 	if (ft_i)
 		ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
-	BDG_RUNLOCK(b);
+	nm_bdg_epoch_exit(b, e);
+	kring->nkr_bdg_stats.pkts += pkts;
+	kring->nkr_bdg_stats.bytes += bytes;
 	return j;
 }
 
@@ -723,12 +1197,517 @@ nm_vale_rthash(const uint8_t *addr)
 	a += addr[0];
 
 	mix(a, b, c);
-#define BRIDGE_RTHASH_MASK	(NM_BDG_HASH-1)
-	return (c & BRIDGE_RTHASH_MASK);
+	return c;
 }
 
 #undef mix
 
+/* first entry of the bucket where addr may be stored */
+static __inline struct nm_hash_ent *
+nm_vale_ht_bucket(struct nm_hash_table *ht, const uint8_t *addr)
+{
+	return ht->ht_ent +
+		(nm_vale_rthash(addr) & (ht->ht_buckets - 1)) * NM_BDG_HASH_WAYS;
+}
+
+static __inline int
+nm_vale_ht_expired(const struct nm_hash_table *ht,
+		const struct nm_hash_ent *e, uint32_t now)
+{
+	return ht->ht_ageing && now - e->ts > ht->ht_ageing;
+}
+
+/*
+ * Record that smac has been seen on port 'src'. e is the bucket of
+ * smac. If the address is not in the table we use a free or expired
+ * entry of the bucket, or evict the least recently seen one.
+ */
+static void
+nm_vale_ht_learn(struct nm_hash_table *ht, struct nm_hash_ent *e,
+		uint64_t smac, u_int src, uint32_t now)
+{
+	struct nm_hash_ent *ent = NULL;
+	uint64_t key = smac | NM_HASH_ENT_VALID;
+	int i;
+
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		if (e[i].mac == key) {
+			ent = e + i;
+			break;
+		}
+	}
+	if (ent == NULL) {
+		for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+			if (!(e[i].mac & NM_HASH_ENT_VALID)) {
+				ent = e + i;
+				break;
+			}
+			if (nm_vale_ht_expired(ht, e + i, now)) {
+				ht->ht_expired++;
+				ent = e + i;
+				break;
+			}
+		}
+		if (ent == NULL) {
+			ent = e;
+			for (i = 1; i < NM_BDG_HASH_WAYS; i++) {
+				if ((int32_t)(e[i].ts - ent->ts) < 0)
+					ent = e + i;
+			}
+			ht->ht_evictions++;
+		}
+		ht->ht_learned++;
+		if (netmap_debug & NM_DEBUG_VALE)
+		    nm_prinf("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
+			(u_int)(smac & 0xff), (u_int)(smac >> 8) & 0xff,
+			(u_int)(smac >> 16) & 0xff, (u_int)(smac >> 24) & 0xff,
+			(u_int)(smac >> 32) & 0xff, (u_int)(smac >> 40) & 0xff,
+			src);
+	}
+	ent->ports = src;
+	ent->ts = now;
+	ent->mac = key;
+}
+
+/* xor the n bytes at a and b, folded in 32 bits */
+static __inline uint32_t
+nm_vale_xor(const uint8_t *a, const uint8_t *b, u_int n)
+{
+	uint32_t h = 0;
+	u_int i;
+
+	for (i = 0; i < n; i++)
+		h ^= (uint32_t)(a[i] ^ b[i]) << ((i & 3) << 3);
+	return h;
+}
+
+/*
+ * Hash the flow of an ethernet frame, for the selection of the
+ * destination ring. Source and destination addresses (and ports)
+ * are combined with xor, so that both directions of a connection
+ * hash to the same value. TCP, UDP and SCTP use the ports unless
+ * the packet is an IPv4 fragment; other IP traffic only uses the
+ * addresses, and non-IP frames the MAC addresses.
+ * The headers must be in the first fragment, otherwise we fall back
+ * to less specific fields.
+ */
+static uint32_t
+nm_vale_flow_hash(const uint8_t *buf, u_int len)
+{
+	u_int off = 14, l4 = 0, proto = 0;
+	uint16_t type = (buf[12] << 8) | buf[13];
+	uint32_t h, ports = 0;
+
+	if (type == 0x8100 && len >= 18) {	/* skip one vlan tag */
+		type = (buf[16] << 8) | buf[17];
+		off = 18;
+	}
+	if (type == 0x0800 && len >= off + 20) {
+		const uint8_t *ip = buf + off;
+
+		h = nm_vale_xor(ip + 12, ip + 16, 4);
+		proto = ip[9];
+		if (((ip[6] & 0x3f) | ip[7]) == 0)	/* not a fragment */
+			l4 = off + ((ip[0] & 0xf) << 2);
+	} else if (type == 0x86dd && len >= off + 40) {
+		const uint8_t *ip6 = buf + off;
+
+		h = nm_vale_xor(ip6 + 8, ip6 + 24, 16);
+		proto = ip6[6];
+		l4 = off + 40;
+	} else {
+		h = nm_vale_xor(buf, buf + 6, 6);
+	}
+	if (l4 && len >= l4 + 4 &&
+			(proto == 6 || proto == 17 || proto == 132))
+		ports = nm_vale_xor(buf + l4, buf + l4 + 2, 2);
+	h ^= (ports << 16) ^ ports ^ proto;
+	/* final mix, from murmur3 */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * Set the destination ring from the flow hash if dst asked for it.
+ * Only the first NM_BDG_MAXRINGS rings can be reached.
+ */
+static __inline void
+nm_vale_rxhash(struct nm_bridge *b, u_int dst, const uint8_t *buf,
+		u_int len, uint8_t *dst_ring)
+{
+	struct netmap_vp_adapter *vpna;
+	u_int nrings;
+
+	if (unlikely(dst >= b->bdg_max_ports))
+		return;
+	vpna = b->bdg_ports[dst];
+	if (vpna == NULL || !vpna->rxhash)
+		return;
+	nrings = vpna->up.num_rx_rings;
+	if (nrings > NM_BDG_MAXRINGS)
+		nrings = NM_BDG_MAXRINGS;
+	if (nrings > 1)
+		*dst_ring = nm_vale_flow_hash(buf, len) % nrings;
+}
+
+static __inline uint32_t
+nm_vale_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+}
+
+/* Build the key of the frame buf, see struct nm_vale_crule. */
+static __inline void
+nm_vale_cls_key(const uint8_t *buf, u_int len, u_int in_port, int l3,
+		uint64_t *k)
+{
+	u_int off = 14, l4 = 0;
+	uint16_t type = (buf[12] << 8) | buf[13];
+	uint8_t proto = 0;
+
+	if (type == 0x8100 && len >= 18) {	/* skip one vlan tag */
+		type = (buf[16] << 8) | buf[17];
+		off = 18;
+	}
+	k[0] = (le64toh(*(const uint64_t *)buf) & NM_VALE_MAC_MASK) |
+		(uint64_t)type << 48;
+	k[1] = (le64toh(*(const uint64_t *)(buf + 4)) >> 16) |
+		(uint64_t)in_port << 48;
+	k[2] = k[3] = 0;
+	if (!l3)
+		return;
+	if (type == 0x0800 && len >= off + 20) {
+		const uint8_t *ip = buf + off;
+
+		k[2] = nm_vale_be32(ip + 12) |
+			(uint64_t)nm_vale_be32(ip + 16) << 32;
+		proto = ip[9];
+		if (((ip[6] & 0x3f) | ip[7]) == 0)	/* not a fragment */
+			l4 = off + ((ip[0] & 0xf) << 2);
+	} else if (type == 0x86dd && len >= off + 40) {
+		proto = buf[off + 6];
+		l4 = off + 40;
+	}
+	if (l4 && len >= l4 + 4 &&
+			(proto == 6 || proto == 17 || proto == 132))
+		k[3] = (buf[l4] << 8 | buf[l4 + 1]) |
+			(uint64_t)(buf[l4 + 2] << 8 | buf[l4 + 3]) << 16;
+	k[3] |= (uint64_t)proto << 32;
+}
+
+/*
+ * Match the frame in ft, at least 14 bytes long, against the rules.
+ * Returns the destination chosen by the first rule that matches, or
+ * NM_VALE_CLS_LEARN if the forwarding table must be used.
+ */
+static u_int
+nm_vale_classify(struct nm_vale_cls *cls, const struct nm_bdg_fwd *ft,
+		struct netmap_vp_adapter *na, uint8_t *dst_ring)
+{
+	const uint8_t *buf = (const uint8_t *)ft->ft_buf + ft->ft_offset;
+	u_int len = ft->ft_len - ft->ft_offset, i;
+	uint8_t hdr[NM_VALE_CLS_HDR];
+	uint64_t k[NM_VALE_KEY_WORDS];
+
+	if (ft->ft_flags & NS_INDIRECT) {
+		if (len > sizeof(hdr))
+			len = sizeof(hdr);
+		if (copyin(buf, hdr, len))
+			return NM_BDG_NOPORT;
+		buf = hdr;
+	}
+	nm_vale_cls_key(buf, len, na->bdg_port, cls->cls_l3, k);
+	for (i = 0; i < cls->cls_count; i++) {
+		const struct nm_vale_crule *cr = cls->cls_rules + i;
+		const uint64_t *m = cr->cr_mask, *v = cr->cr_val;
+
+		if (((k[0] & m[0]) ^ v[0]) | ((k[1] & m[1]) ^ v[1]) |
+		    ((k[2] & m[2]) ^ v[2]) | ((k[3] & m[3]) ^ v[3]))
+			continue;
+		cls->cls_src[i].nr_hits++;
+		if (cr->cr_port < NM_BDG_BROADCAST) {
+			if (cr->cr_ring != NR_VALE_RING_ANY)
+				*dst_ring = cr->cr_ring;
+			else if (buf != hdr)
+				nm_vale_rxhash(na->na_bdg, cr->cr_port,
+					buf, len, dst_ring);
+		}
+		return cr->cr_port;
+	}
+	return NM_VALE_CLS_LEARN;
+}
+
+/*
+ * Look up dmac in its bucket e. Returns the port or NM_BDG_BROADCAST
+ * if the address is unknown.
+ */
+static __inline u_int
+nm_vale_ht_lookup(struct nm_hash_table *ht, struct nm_hash_ent *e,
+		uint64_t dmac, uint32_t now)
+{
+	uint64_t key = dmac | NM_HASH_ENT_VALID;
+	u_int dst = NM_BDG_BROADCAST;
+	int i;
+
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		if (e[i].mac != key)
+			continue;
+		if (nm_vale_ht_expired(ht, e + i, now)) {
+			e[i].mac = 0;
+			ht->ht_expired++;
+		} else {
+			dst = e[i].ports;	/* found dst */
+		}
+		break;
+	}
+	return dst;
+}
+
+/*
+ * Account lookup results on the counters of the current CPU. The
+ * sender may migrate meanwhile, and then race with the new owner of
+ * the counters, which is acceptable for statistics.
+ */
+static __inline void
+nm_vale_ht_count(struct nm_hash_table *ht, u_int hits, u_int misses)
+{
+	struct nm_ht_pcpu *pc = ht->ht_pcpu + nm_os_curcpu() % ht->ht_ncpus;
+
+	pc->hits += hits;
+	pc->misses += misses;
+}
+
+
+/*
+ * IGMP and MLD snooping. Membership reports and leave messages seen
+ * on a port update the multicast group table, so that the traffic
+ * for a known group only reaches the member ports and the router ports,
+ * i.e. the ports where queries have been seen. Traffic for unknown
+ * groups and for the link-local ones (224.0.0.0/24, ff02::/16), which
+ * are never learned, is flooded as broadcast, and so is the traffic of
+ * a known group that no port would receive (e.g. all the members left
+ * and no querier is known).
+ */
+static __inline int
+nm_vale_mcast_member(const struct nm_hash_table *ht, u_int g, u_int port,
+		uint32_t now)
+{
+	uint32_t ts = NM_MCAST_TS(ht, port, g);
+
+	return ts != 0 && !(ht->ht_ageing && now - ts > ht->ht_ageing);
+}
+
+/* non-zero if port receives the traffic of group g */
+static __inline int
+nm_vale_mcast_to_port(const struct nm_hash_table *ht, u_int g, u_int port,
+		uint32_t now)
+{
+	return nm_vale_mcast_member(ht, g, port, now) ||
+		nm_vale_mcast_member(ht, NM_BDG_MCAST_ROUTER, port, now);
+}
+
+/* non-zero if some port receives the traffic of group g */
+static int
+nm_vale_mcast_listened(const struct nm_hash_table *ht, u_int g, uint32_t now)
+{
+	u_int port;
+
+	for (port = 0; port < ht->ht_mcast_ports; port++) {
+		if (nm_vale_mcast_to_port(ht, g, port, now))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+nm_vale_mcast_empty(const struct nm_hash_table *ht, u_int g, uint32_t now)
+{
+	u_int port;
+
+	for (port = 0; port < ht->ht_mcast_ports; port++) {
+		if (nm_vale_mcast_member(ht, g, port, now))
+			return 0;
+	}
+	return 1;
+}
+
+/* index of the group with the given MAC address, or -1 */
+static __inline int
+nm_vale_mcast_find(const struct nm_hash_table *ht, uint64_t gmac)
+{
+	u_int g;
+
+	for (g = 0; g < ht->ht_mcast_used; g++) {
+		if (ht->ht_mcast[g] == gmac)
+			return g;
+	}
+	return -1;
+}
+
+static void
+nm_vale_mcast_update(struct nm_hash_table *ht, uint64_t gmac, u_int port,
+		int join, uint32_t now)
+{
+	int g = nm_vale_mcast_find(ht, gmac);
+	u_int i;
+
+	if (g < 0) {
+		if (!join)
+			return;
+		if (ht->ht_mcast_used < NM_BDG_MCAST_GROUPS) {
+			g = ht->ht_mcast_used;
+		} else {
+			/* reuse a group whose members are all gone */
+			for (g = 0; g < NM_BDG_MCAST_GROUPS; g++) {
+				if (nm_vale_mcast_empty(ht, g, now))
+					break;
+			}
+			if (g == NM_BDG_MCAST_GROUPS)
+				return; /* table full, keep flooding */
+		}
+		for (i = 0; i < ht->ht_mcast_ports; i++)
+			NM_MCAST_TS(ht, i, g) = 0;
+		ht->ht_mcast[g] = gmac;
+		if ((u_int)g == ht->ht_mcast_used)
+			ht->ht_mcast_used++;
+	}
+	/* 0 is reserved for non members */
+	NM_MCAST_TS(ht, port, g) = join ? (now | 1) : 0;
+}
+
+/* IPv4 group to MAC address (01:00:5e + low 23 bits) */
+static void
+nm_vale_igmp_group(struct nm_hash_table *ht, const uint8_t *grp,
+		u_int port, int join, uint32_t now)
+{
+	if (grp[0] < 224 || grp[0] > 239 ||
+	    (grp[0] == 224 && grp[1] == 0 && grp[2] == 0))
+		return;
+	nm_vale_mcast_update(ht, 0x5e0001ULL | (uint64_t)(grp[1] & 0x7f) << 24 |
+		(uint64_t)grp[2] << 32 | (uint64_t)grp[3] << 40, port, join, now);
+}
+
+/* IPv6 group to MAC address (33:33 + low 32 bits) */
+static void
+nm_vale_mld_group(struct nm_hash_table *ht, const uint8_t *grp,
+		u_int port, int join, uint32_t now)
+{
+	if (grp[0] != 0xff || (grp[1] & 0x0f) <= 2)
+		return;
+	nm_vale_mcast_update(ht, 0x3333ULL | (uint64_t)grp[12] << 16 |
+		(uint64_t)grp[13] << 24 | (uint64_t)grp[14] << 32 |
+		(uint64_t)grp[15] << 40, port, join, now);
+}
+
+/*
+ * Parse an IGMP (v1, v2, v3) or MLD (v1, v2) message in the frame
+ * 'buf' received on 'port'. Group records of IGMPv3/MLDv2 reports
+ * that leave the host with no sources are treated as a leave.
+ */
+static void
+nm_vale_snoop(struct nm_hash_table *ht, const uint8_t *buf, u_int len,
+		u_int port, uint32_t now)
+{
+	const uint8_t *p;
+	u_int hl, n, nsrc, rlen;
+	uint16_t etype;
+
+	if (len < 14)
+		return;
+	etype = (buf[12] << 8) | buf[13];
+	p = buf + 14;
+	len -= 14;
+	if (etype == 0x0800) {
+		if (len < 20 || p[9] != 2 /* IGMP */)
+			return;
+		hl = (p[0] & 0xf) << 2;
+		if (hl < 20 || len < hl + 8)
+			return;
+		p += hl;
+		len -= hl;
+		switch (p[0]) {
+		case 0x11: /* query, from a router or querier */
+			NM_MCAST_TS(ht, port, NM_BDG_MCAST_ROUTER) = now | 1;
+			break;
+		case 0x12: /* v1 report */
+		case 0x16: /* v2 report */
+		case 0x17: /* v2 leave */
+			nm_vale_igmp_group(ht, p + 4, port, p[0] != 0x17, now);
+			break;
+		case 0x22: /* v3 report */
+			n = (p[6] << 8) | p[7];
+			p += 8;
+			len -= 8;
+			for (; n > 0 && len >= 8; n--) {
+				nsrc = (p[2] << 8) | p[3];
+				rlen = 8 + nsrc * 4 + p[1] * 4;
+				if (p[0] != 6 /* BLOCK_OLD_SOURCES */ &&
+				    !(p[0] == 5 && nsrc == 0))
+					nm_vale_igmp_group(ht, p + 4, port,
+						p[0] == 2 || p[0] == 4 || nsrc > 0,
+						now);
+				if (len < rlen)
+					break;
+				p += rlen;
+				len -= rlen;
+			}
+			break;
+		}
+	} else if (etype == 0x86dd) {
+		uint8_t nh;
+
+		if (len < 40)
+			return;
+		nh = p[6];
+		p += 40;
+		len -= 40;
+		if (nh == 0) { /* hop-by-hop options, with router alert */
+			if (len < 8)
+				return;
+			hl = (p[1] + 1) << 3;
+			if (len < hl)
+				return;
+			nh = p[0];
+			p += hl;
+			len -= hl;
+		}
+		if (nh != 58 /* ICMPv6 */ || len < 8)
+			return;
+		switch (p[0]) {
+		case 130: /* query */
+			NM_MCAST_TS(ht, port, NM_BDG_MCAST_ROUTER) = now | 1;
+			break;
+		case 131: /* v1 report */
+		case 132: /* v1 done */
+			if (len >= 24)
+				nm_vale_mld_group(ht, p + 8, port, p[0] == 131, now);
+			break;
+		case 143: /* v2 report */
+			n = (p[6] << 8) | p[7];
+			p += 8;
+			len -= 8;
+			for (; n > 0 && len >= 20; n--) {
+				nsrc = (p[2] << 8) | p[3];
+				rlen = 20 + nsrc * 16 + p[1] * 4;
+				if (p[0] != 6 && !(p[0] == 5 && nsrc == 0))
+					nm_vale_mld_group(ht, p + 4, port,
+						p[0] == 2 || p[0] == 4 || nsrc > 0,
+						now);
+				if (len < rlen)
+					break;
+				p += rlen;
+				len -= rlen;
+			}
+			break;
+		}
+	}
+}
+
 
 /*
  * Lookup function for a learning bridge.
@@ -742,10 +1721,11 @@ netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 {
 	uint8_t *buf = ((uint8_t *)ft->ft_buf) + ft->ft_offset;
 	u_int buf_len = ft->ft_len - ft->ft_offset;
-	struct nm_hash_ent *ht = private_data;
-	uint32_t sh, dh;
-	u_int dst, mysrc = na->bdg_port;
+	struct nm_hash_table *ht = private_data;
+	struct nm_vale_cls *cls = ht->ht_cls;
+	u_int dst;
 	uint64_t smac, dmac;
+	uint32_t now;
 	uint8_t indbuf[12];
 
 	if (buf_len < 14) {
@@ -764,29 +1744,153 @@ netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 	smac >>= 16;
 
 	/*
-	 * The hash is somewhat expensive, there might be some
-	 * worthwhile optimizations here.
+	 * The hash is somewhat expensive, so we skip the update when
+	 * the source is the same as in the previous packet. The entry
+	 * timestamp is still refreshed once per second.
 	 */
-	if (((buf[6] & 1) == 0) && (na->last_smac != smac)) { /* valid src */
-		uint8_t *s = buf+6;
-		sh = nm_vale_rthash(s); /* hash of source */
+	now = time_second;
+	if (((buf[6] & 1) == 0) && (na->last_smac != smac ||
+				na->last_learn != now)) { /* valid src */
 		/* update source port forwarding entry */
-		na->last_smac = ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
-		if (netmap_debug & NM_DEBUG_VALE)
-		    nm_prinf("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
-			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
+		nm_vale_ht_learn(ht, nm_vale_ht_bucket(ht, buf + 6), smac,
+				na->bdg_port, now);
+		na->last_smac = smac;
+		na->last_learn = now;
+	}
+	if (cls != NULL) {
+		dst = nm_vale_classify(cls, ft, na, dst_ring);
+		if (dst != NM_VALE_CLS_LEARN)
+			return dst;
 	}
 	dst = NM_BDG_BROADCAST;
 	if ((buf[0] & 1) == 0) { /* unicast */
-		dh = nm_vale_rthash(buf); /* hash of dst */
-		if (ht[dh].mac == dmac) {	/* found dst */
-			dst = ht[dh].ports;
-		}
+		dst = nm_vale_ht_lookup(ht, nm_vale_ht_bucket(ht, buf),
+				dmac, now);
+		nm_vale_ht_count(ht, dst != NM_BDG_BROADCAST,
+				dst == NM_BDG_BROADCAST);
+		if (dst != NM_BDG_BROADCAST && !(ft->ft_flags & NS_INDIRECT))
+			nm_vale_rxhash(na->na_bdg, dst, buf, buf_len, dst_ring);
+	} else if ((buf[6] & 1) == 0 && !(ft->ft_flags & NS_INDIRECT)) {
+		nm_vale_snoop(ht, buf, buf_len, na->bdg_port, now);
 	}
 	return dst;
 }
 
+/*
+ * Batched version of netmap_vale_learning(), used by nm_vale_flush().
+ * Packets are processed in chunks: we first hash the addresses of all
+ * the packets in the chunk and prefetch their buckets, then we do the
+ * learning and the lookups, so that the table accesses of one packet
+ * overlap with the hashing of the following ones.
+ */
+#define NM_VALE_LOOKUP_CHUNK	16
+
+void
+netmap_vale_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_hash_table *ht = private_data;
+	struct nm_vale_cls *cls = ht->ht_cls;	/* once per batch */
+	struct nm_hash_ent *sbkt[NM_VALE_LOOKUP_CHUNK];
+	struct nm_hash_ent *dbkt[NM_VALE_LOOKUP_CHUNK];
+	uint64_t smac[NM_VALE_LOOKUP_CHUNK], dmac[NM_VALE_LOOKUP_CHUNK];
+	uint16_t idx[NM_VALE_LOOKUP_CHUNK];
+	struct nm_bridge *b = na->na_bdg;
+	uint64_t last_smac = na->last_smac;
+	uint32_t now = time_second;
+	int fresh = (na->last_learn == now);
+	u_int i = 0, k, cnt, hits = 0, misses = 0;
+
+	while (i < n) {
+		for (cnt = 0; i < n && cnt < NM_VALE_LOOKUP_CHUNK;
+				i += ft[i].ft_frags) {
+			struct nm_bdg_fwd *start_ft;
+			uint8_t *buf, indbuf[12];
+
+			if (ft[i].ft_dst_port == NM_BDG_NOPORT)
+				continue;
+			start_ft = nm_bdg_ft_start(ft + i);
+			if (start_ft->ft_len - start_ft->ft_offset < 14) {
+				ft[i].ft_dst_port = NM_BDG_NOPORT;
+				continue;
+			}
+			buf = ((uint8_t *)start_ft->ft_buf) + start_ft->ft_offset;
+			if (start_ft->ft_flags & NS_INDIRECT) {
+				if (copyin(buf, indbuf, sizeof(indbuf))) {
+					ft[i].ft_dst_port = NM_BDG_NOPORT;
+					continue;
+				}
+				buf = indbuf;
+			}
+			dmac[cnt] = le64toh(*(uint64_t *)(buf)) & 0xffffffffffff;
+			smac[cnt] = le64toh(*(uint64_t *)(buf + 4)) >> 16;
+			sbkt[cnt] = NULL;
+			if ((buf[6] & 1) == 0 &&
+					(smac[cnt] != last_smac || !fresh)) {
+				sbkt[cnt] = nm_vale_ht_bucket(ht, buf + 6);
+				__builtin_prefetch(sbkt[cnt]);
+				last_smac = smac[cnt];
+				fresh = 1;
+			}
+			dbkt[cnt] = NULL;
+			if ((buf[0] & 1) == 0) { /* unicast */
+				dbkt[cnt] = nm_vale_ht_bucket(ht, buf);
+				__builtin_prefetch(dbkt[cnt]);
+			} else if ((buf[6] & 1) == 0 && buf != indbuf) {
+				nm_vale_snoop(ht, buf, start_ft->ft_len -
+					start_ft->ft_offset, na->bdg_port, now);
+			}
+			idx[cnt++] = i;
+		}
+
+		for (k = 0; k < cnt; k++) {
+			uint16_t dst = NM_BDG_BROADCAST;
+
+			if (sbkt[k] != NULL)
+				nm_vale_ht_learn(ht, sbkt[k], smac[k],
+						na->bdg_port, now);
+			if (cls != NULL) {
+				u_int c = nm_vale_classify(cls,
+					nm_bdg_ft_start(ft + idx[k]), na,
+					&ft[idx[k]].ft_dst_ring);
+
+				if (c != NM_VALE_CLS_LEARN) {
+					ft[idx[k]].ft_dst_port = c;
+					continue;
+				}
+			}
+			if (dbkt[k] != NULL) {
+				struct nm_bdg_fwd *start_ft;
+
+				dst = nm_vale_ht_lookup(ht, dbkt[k], dmac[k], now);
+				if (dst == NM_BDG_BROADCAST)
+					misses++;
+				else
+					hits++;
+				start_ft = nm_bdg_ft_start(ft + idx[k]);
+				if (dst != NM_BDG_BROADCAST &&
+				    !(start_ft->ft_flags & NS_INDIRECT))
+					nm_vale_rxhash(b, dst,
+					    (uint8_t *)start_ft->ft_buf +
+					    start_ft->ft_offset, start_ft->ft_len -
+					    start_ft->ft_offset,
+					    &ft[idx[k]].ft_dst_ring);
+			} else if (ht->ht_mcast_used) {
+				int g = nm_vale_mcast_find(ht, dmac[k]);
+
+				if (g >= 0)
+					dst = NM_BDG_MCAST(g);
+			}
+			ft[idx[k]].ft_dst_port = dst;
+		}
+	}
+	if (hits | misses)
+		nm_vale_ht_count(ht, hits, misses);
+	na->last_smac = last_smac;
+	if (fresh)
+		na->last_learn = now;
+}
+
 
 /*
  * Available space in the ring. Only used in VALE code
@@ -863,10 +1967,136 @@ nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
 	return lease_idx;
 }
 
+/*
+ * Deficit round robin among the senders to an rx ring of a fair port.
+ * A round ends when the receiver has consumed a quarter of the ring
+ * since the round started. At its first lease in a round, a sender
+ * adds its quantum (bridge_fair_quantum slots times its weight) to
+ * the deficit carried over from the previous rounds, e.g. when the
+ * ring was too full to use it all; the deficit is capped to two
+ * quanta, so that an idle sender does not pile up credit.
+ * Besides its deficit, a sender can lease the free space in excess of
+ * a reserve kept for the other senders, so that a sender alone can
+ * still fill most of the ring; that space is not charged.
+ * Senders are told apart by their port number modulo NM_VALE_FAIR_SLOTS.
+ * Returns how many of the 'needed' slots 'src' may lease out of the
+ * 'space' free ones, and charges them to it.
+ * Called with the q_lock of the kring held.
+ */
+static __inline u_int
+nm_vale_fair(struct netmap_kring *kring, struct netmap_vp_adapter *src,
+		u_int space, u_int needed)
+{
+	struct nm_vale_fair *f = kring->nkr_fair +
+		(src->bdg_port & (NM_VALE_FAIR_SLOTS - 1));
+	u_int reserve = kring->nkr_num_slots / 4, n, extra, charged;
+	int consumed = kring->nr_hwcur - kring->nkr_fair_cur;
+
+	if (consumed < 0)
+		consumed += kring->nkr_num_slots;
+	if ((u_int)consumed >= reserve) {
+		kring->nkr_fair_cur = kring->nr_hwcur;
+		kring->nkr_fair_round++;
+	}
+	if (f->vf_round != kring->nkr_fair_round) {
+		u_int quantum = bridge_fair_quantum *
+			(src->weight ? src->weight : 1);
+
+		f->vf_round = kring->nkr_fair_round;
+		f->vf_deficit += quantum;
+		if (f->vf_deficit > 2 * quantum)
+			f->vf_deficit = 2 * quantum;
+	}
+	extra = space > reserve ? space - reserve : 0;
+	n = f->vf_deficit + extra;
+	if (n > space)
+		n = space;
+	if (n > needed)
+		n = needed;
+	/* the free space beyond the reserve is used first */
+	charged = n > extra ? n - extra : 0;
+	f->vf_deficit -= charged;
+	return n;
+}
+
+/* append the packet starting at ft[i] to queue d, return 1 if d was empty */
+static __inline int
+nm_vale_q_append(struct nm_vale_q *d, struct nm_bdg_fwd *ft, u_int i)
+{
+	int first = (d->bq_head == NM_FT_NULL);
+
+	if (first) {
+		d->bq_head = d->bq_tail = i;
+	} else {
+		ft[d->bq_tail].ft_next = i;
+		d->bq_tail = i;
+	}
+	d->bq_len += ft[i].ft_frags;
+	d->bq_pkts++;
+	return first;
+}
+
+/*
+ * Return the queue for destination key in the table, or NULL if there
+ * is none and create is 0. The table cannot fill up as it is larger
+ * than the number of packets in a batch.
+ */
+static __inline struct nm_vale_q *
+nm_vale_dstq(struct nm_vale_q *tab, uint16_t key, int create)
+{
+	u_int h = ((uint32_t)key * 2654435761U) >> (32 - NM_VALE_DSTQ_SHIFT);
+
+	for (;;) {
+		struct nm_vale_q *d = tab + h;
+
+		if (d->bq_key == key)
+			return d;
+		if (d->bq_key == NM_VALE_NOKEY) {
+			if (!create)
+				return NULL;
+			d->bq_key = key;
+			return d;
+		}
+		h = (h + 1) & (NM_VALE_DSTQ - 1);
+	}
+}
+
+/*
+ * Give the buffer of the tx slot ts, recorded in ft by the preflush,
+ * to the rx slot rs, and the buffer of rs to ts.
+ * The indices come from userspace, so the swap is only done if both
+ * are valid (buffers 0 and 1 are reserved), if the tx slot still holds
+ * the buffer that was looked up, and if the packet fits the rx buffer;
+ * otherwise we return 0 and the caller falls back to the copy, which
+ * does its own checks.
+ */
+static __inline int
+nm_vale_swap_buf(struct netmap_adapter *na, struct nm_bdg_fwd *ft,
+		struct netmap_slot *ts, struct netmap_slot *rs)
+{
+	uint32_t tidx = ft->ft_buf_idx, ridx = rs->buf_idx;
+
+	if (unlikely(tidx < 2 || tidx >= na->na_lut.objtotal ||
+			ridx < 2 || ridx >= na->na_lut.objtotal ||
+			ft->ft_len > NETMAP_BUF_SIZE(na) ||
+			NM_ACCESS_ONCE(ts->buf_idx) != tidx))
+		return 0;
+	rs->buf_idx = tidx;
+	ts->buf_idx = ridx;
+	ts->flags |= NS_BUF_CHANGED;
+	return 1;
+}
+
+/* max number of multicast groups with a private queue in a batch */
+#define NM_BDG_MCAST_BATCH	4
+/* set in mcg[] for the groups flooded in this batch */
+#define NM_BDG_MCAST_FLOOD	0x8000
+
 /*
  *
- * This flush routine supports only unicast and broadcast but a large
- * number of ports, and lets us replace the learn and dispatch functions.
+ * This flush routine supports unicast, broadcast and multicast to the
+ * groups learned by the lookup function, with a large number of ports,
+ * and lets us replace the learn and dispatch functions.
  */
 int
 nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
@@ -875,113 +2105,202 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 	struct nm_vale_q *dst_ents, *brddst;
 	uint16_t num_dsts = 0, *dsts;
 	struct nm_bridge *b = na->na_bdg;
-	u_int i, me = na->bdg_port;
+	struct nm_hash_table *ht = b->ht;
+	struct nm_bdg_lookup *lkp = b->bdg_lookup;
+	struct netmap_kring *src_kring = na->up.tx_rings[ring_nr];
+	struct netmap_ring *src_ring = src_kring->ring;
+	/* we own the source kring, so its counters need no lock */
+	struct nm_bdg_stats *st = &src_kring->nkr_bdg_stats;
+	/* load the port arrays once, they may be replaced under us */
+	struct netmap_vp_adapter **ports = b->bdg_ports;
+	uint32_t *port_index = b->bdg_port_index;
+	u_int max_ports = b->bdg_max_ports;
+	/* queues for the multicast groups found in this batch */
+	struct nm_vale_q mcq[NM_BDG_MCAST_BATCH];
+	uint16_t mcg[NM_BDG_MCAST_BATCH];
+	u_int num_mcg = 0, k;
+	uint32_t now = time_second;
+	u_int i, me = na->bdg_port, num_flood = 0;
 
 	/*
-	 * The work area (pointed by ft) is followed by an array of
-	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * The work area (pointed by ft) is followed by a table of
+	 * NM_VALE_DSTQ queues, dst_ents, hashed by port:ring, plus
+	 * one for the broadcast traffic.
+	 * Then we have an array of the table entries in use.
 	 */
 	dst_ents = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
+	dsts = (uint16_t *)(dst_ents + NM_VALE_DSTQ + 1);
 
 	/* first pass: find a destination for each packet in the batch */
 	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
-		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
-		uint16_t dst_port, d_i;
-		struct nm_vale_q *d;
-		struct nm_bdg_fwd *start_ft = NULL;
-
 		ND("slot %d frags %d", i, ft[i].ft_frags);
 
+		ft[i].ft_dst_ring = ring_nr; /* default, same ring as origin */
+		ft[i].ft_dst_port = 0;
 		if (na->up.virt_hdr_len < ft[i].ft_len) {
 			ft[i].ft_offset = na->up.virt_hdr_len;
-			start_ft = &ft[i];
 		} else if (na->up.virt_hdr_len == ft[i].ft_len && ft[i].ft_flags & NS_MOREFRAG) {
 			ft[i].ft_offset = ft[i].ft_len;
-			start_ft = &ft[i+1];
 		} else {
 			/* Drop the packet if the virtio-net header is not into the first
 			 * fragment nor at the very beginning of the second.
 			 */
+			ft[i].ft_dst_port = NM_BDG_NOPORT;
 			continue;
 		}
-		dst_port = b->bdg_ops.lookup(start_ft, &dst_ring, na, b->private_data);
+		if (lkp->lookup_batch == NULL) {
+			uint32_t dst_port = lkp->lookup(nm_bdg_ft_start(ft + i),
+				&ft[i].ft_dst_ring, na, lkp->private_data);
+			ft[i].ft_dst_port = dst_port < NM_BDG_NOPORT ?
+				dst_port : NM_BDG_NOPORT;
+		}
+	}
+	if (lkp->lookup_batch != NULL)
+		lkp->lookup_batch(ft, n, na, lkp->private_data);
+
+	/* queue each packet to its destination */
+	brddst = dst_ents + NM_VALE_DSTQ;
+	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
+		uint8_t dst_ring = ft[i].ft_dst_ring;
+		uint16_t dst_port = ft[i].ft_dst_port;
+		struct nm_vale_q *d;
+
 		if (netmap_verbose > 255)
 			RD(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port >= NM_BDG_NOPORT)
-			continue; /* this packet is identified to be dropped */
-		else if (dst_port == NM_BDG_BROADCAST)
-			dst_ring = 0; /* broadcasts always go to ring 0 */
-		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
+		if (unlikely(dst_port > NM_BDG_NOPORT)) {
+			/* multicast group, flooded if we are out of queues
+			 * or if no port receives it */
+			u_int g = dst_port - NM_BDG_MCAST(0);
+
+			for (k = 0; k < num_mcg &&
+			    (mcg[k] & ~NM_BDG_MCAST_FLOOD) != g; k++)
+				;
+			if (k == NM_BDG_MCAST_BATCH) {
+				nm_vale_q_append(brddst, ft, i);
+				continue;
+			}
+			if (k == num_mcg) {
+				mcg[num_mcg++] = g;
+				if (!nm_vale_mcast_listened(ht, g, now))
+					mcg[k] |= NM_BDG_MCAST_FLOOD;
+				mcq[k].bq_head = mcq[k].bq_tail = NM_FT_NULL;
+				mcq[k].bq_len = 0;
+				mcq[k].bq_pkts = 0;
+			}
+			if (mcg[k] & NM_BDG_MCAST_FLOOD)
+				nm_vale_q_append(brddst, ft, i);
+			else
+				nm_vale_q_append(mcq + k, ft, i);
+			continue;
+		} else if (dst_port == NM_BDG_NOPORT) {
+			/* this packet is identified to be dropped */
+			st->drop_lookup++;
+			continue;
+		} else if (dst_port == NM_BDG_BROADCAST) {
+			nm_vale_q_append(brddst, ft, i);
+			continue;
+		} else if (unlikely(dst_port == me ||
+		    dst_port >= max_ports || !ports[dst_port])) {
+			st->drop_lookup++;
 			continue;
-
-		/* get a position in the scratch pad */
-		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
-		d = dst_ents + d_i;
-
-		/* append the first fragment to the list */
-		if (d->bq_head == NM_FT_NULL) { /* new destination */
-			d->bq_head = d->bq_tail = i;
-			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
-				dsts[num_dsts++] = d_i;
-		} else {
-			ft[d->bq_tail].ft_next = i;
-			d->bq_tail = i;
 		}
-		d->bq_len += ft[i].ft_frags;
+
+		/* append the first fragment to the list, and remember
+		 * new unicast destinations to be scanned later */
+		d = nm_vale_dstq(dst_ents, dst_port * NM_BDG_MAXRINGS + dst_ring, 1);
+		if (nm_vale_q_append(d, ft, i))
+			dsts[num_dsts++] = d - dst_ents;
 	}
 
 	/*
-	 * Broadcast traffic goes to ring 0 on all destinations.
-	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
+	 * Broadcast and multicast traffic goes to ring 0 of the
+	 * destinations. The list of active ports is our flood list,
+	 * scanned after the unicast destinations; ring 0 of each port
+	 * is served there, together with its unicast queue.
 	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
-	if (brddst->bq_head != NM_FT_NULL) {
-		u_int j;
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
-			uint16_t d_i;
-			i = b->bdg_port_index[j];
-			if (unlikely(i == me))
-				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
-				dsts[num_dsts++] = d_i;
-		}
-	}
+	if (brddst->bq_head != NM_FT_NULL || num_mcg > 0)
+		num_flood = b->bdg_active_ports;
 
 	ND(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
 	/* second pass: scan destinations */
-	for (i = 0; i < num_dsts; i++) {
+	for (i = 0; i < num_dsts + num_flood; i++) {
 		struct netmap_vp_adapter *dst_na;
 		struct netmap_kring *kring;
 		struct netmap_ring *ring;
-		u_int dst_nr, lim, j, d_i, next, brd_next;
+		u_int dst_nr, lim, j, d_i, nq, h;
+		/* heads of the queues merged into this destination */
+		uint16_t q[2 + NM_BDG_MCAST_BATCH];
 		u_int needed, howmany;
 		int retry = netmap_txsync_retry;
 		struct nm_vale_q *d;
 		uint32_t my_start = 0, lease_idx = 0;
 		int nrings;
-		int virt_hdr_mismatch = 0;
-
-		d_i = dsts[i];
+		int virt_hdr_mismatch = 0, zcopy;
+		/* packets still to deliver, and delivered in this lease */
+		u_int pkts, sent = 0;
+		uint64_t bytes = 0;
+
+		if (i < num_dsts) {
+			d = dst_ents + dsts[i];
+			d_i = d->bq_key;
+			if (num_flood && (d_i & (NM_BDG_MAXRINGS - 1)) == 0)
+				continue; /* in the flood list */
+		} else {
+			d_i = port_index[i - num_dsts] * NM_BDG_MAXRINGS;
+			if (unlikely(d_i / NM_BDG_MAXRINGS == me))
+				continue;
+			d = nm_vale_dstq(dst_ents, d_i, 0);
+		}
 		ND("second pass %d port %d", i, d_i);
-		d = dst_ents + d_i;
+
+		/* Collect the unicast queue and, on ring 0, the broadcast
+		 * and multicast queues for this port, so that all of them
+		 * are copied under a single lease.
+		 * We need to reserve this many slots. If fewer are
+		 * available, some packets will be dropped.
+		 * Packets may have multiple fragments, so we may not use
+		 * there is a chance that we may not use all of the slots
+		 * we have claimed, so we will need to handle the leftover
+		 * ones when we regain the lock.
+		 */
+		nq = 0;
+		needed = 0;
+		pkts = 0;
+		if (d != NULL && d->bq_head != NM_FT_NULL) {
+			q[nq++] = d->bq_head;
+			needed += d->bq_len;
+			pkts += d->bq_pkts;
+		}
+		if ((d_i & (NM_BDG_MAXRINGS - 1)) == 0) {
+			if (brddst->bq_head != NM_FT_NULL) {
+				q[nq++] = brddst->bq_head;
+				needed += brddst->bq_len;
+				pkts += brddst->bq_pkts;
+			}
+			for (k = 0; k < num_mcg; k++) {
+				if (!(mcg[k] & NM_BDG_MCAST_FLOOD) &&
+				    nm_vale_mcast_to_port(ht, mcg[k],
+						d_i / NM_BDG_MAXRINGS, now)) {
+					q[nq++] = mcq[k].bq_head;
+					needed += mcq[k].bq_len;
+					pkts += mcq[k].bq_pkts;
+				}
+			}
+		}
+		if (unlikely(nq == 0))
+			continue;
+
 		// XXX fix the division
-		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
+		dst_na = ports[d_i/NM_BDG_MAXRINGS];
 		/* protect from the lookup function returning an inactive
 		 * destination port
 		 */
-		if (unlikely(dst_na == NULL))
-			goto cleanup;
+		if (unlikely(dst_na == NULL)) {
+			st->drop_down += pkts;
+			continue;
+		}
 		if (dst_na->up.na_flags & NAF_SW_ONLY)
-			goto cleanup;
+			continue;
 		/*
 		 * The interface may be in !netmap mode in two cases:
 		 * - when na is attached but not activated yet;
@@ -989,21 +2308,10 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		 */
 		if (unlikely(!nm_netmap_on(&dst_na->up))) {
 			ND("not in netmap mode!");
-			goto cleanup;
+			st->drop_down += pkts;
+			continue;
 		}
 
-		/* there is at least one either unicast or broadcast packet */
-		brd_next = brddst->bq_head;
-		next = d->bq_head;
-		/* we need to reserve this many slots. If fewer are
-		 * available, some packets will be dropped.
-		 * Packets may have multiple fragments, so we may not use
-		 * there is a chance that we may not use all of the slots
-		 * we have claimed, so we will need to handle the leftover
-		 * ones when we regain the lock.
-		 */
-		needed = d->bq_len + brddst->bq_len;
-
 		if (unlikely(dst_na->up.virt_hdr_len != na->up.virt_hdr_len)) {
 			if (netmap_verbose) {
 				RD(3, "virt_hdr_mismatch, src %d dst %d", na->up.virt_hdr_len,
@@ -1032,6 +2340,10 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			}
 		}
 
+		/* unicast packets may swap buffers instead of copying */
+		zcopy = na->zcopy && dst_na->zcopy && !virt_hdr_mismatch &&
+			na->up.nm_mem == dst_na->up.nm_mem;
+
 		ND(5, "pass 2 dst %d is %x %s",
 			i, d_i, is_vp ? "virtual" : "nic/host");
 		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
@@ -1041,8 +2353,10 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		kring = dst_na->up.rx_rings[dst_nr];
 		ring = kring->ring;
 		/* the destination ring may have not been opened for RX */
-		if (unlikely(ring == NULL || kring->nr_mode != NKR_NETMAP_ON))
-			goto cleanup;
+		if (unlikely(ring == NULL || kring->nr_mode != NKR_NETMAP_ON)) {
+			st->drop_down += pkts;
+			continue;
+		}
 		lim = kring->nkr_num_slots - 1;
 
 retry:
@@ -1062,11 +2376,14 @@ retry:
 		mtx_lock(&kring->q_lock);
 		if (kring->nkr_stopped) {
 			mtx_unlock(&kring->q_lock);
-			goto cleanup;
+			st->drop_down += pkts;
+			continue;
 		}
 		my_start = j = kring->nkr_hwlease;
 		howmany = nm_kr_space(kring, 1);
-		if (needed < howmany)
+		if (dst_na->fair)
+			howmany = nm_vale_fair(kring, na, howmany, needed);
+		else if (needed < howmany)
 			howmany = needed;
 		lease_idx = nm_kr_lease(kring, howmany, 1);
 		mtx_unlock(&kring->q_lock);
@@ -1081,34 +2398,59 @@ retry:
 			struct nm_bdg_fwd *ft_p, *ft_end;
 			u_int cnt;
 
-			/* find the queue from which we pick next packet.
-			 * NM_FT_NULL is always higher than valid indexes
-			 * so we never dereference it if the other list
-			 * has packets (and if both are empty we never
-			 * get here).
+			/* find the queue from which we pick next packet,
+			 * i.e. the one with the lowest index, to preserve
+			 * the order. NM_FT_NULL is always higher than valid
+			 * indexes, so if we pick it all the queues are empty.
 			 */
-			if (next < brd_next) {
-				ft_p = ft + next;
-				next = ft_p->ft_next;
-			} else { /* insert broadcast */
-				ft_p = ft + brd_next;
-				brd_next = ft_p->ft_next;
+			for (h = 0, k = 1; k < nq; k++) {
+				if (q[k] < q[h])
+					h = k;
 			}
+			if (q[h] == NM_FT_NULL)
+				break;
+			ft_p = ft + q[h];
 			cnt = ft_p->ft_frags; // cnt > 0
 			if (unlikely(cnt > howmany))
 			    break; /* no more space */
+			q[h] = ft_p->ft_next;
 			if (netmap_verbose && cnt > 1)
 				RD(5, "rx %d frags to %d", cnt, j);
 			ft_end = ft_p + cnt;
+			sent++;
+			if (ft_p->ft_dst_port >= NM_BDG_BROADCAST)
+				st->bcast++;
 			if (unlikely(virt_hdr_mismatch)) {
+				struct nm_bdg_fwd *f;
+
+				for (f = ft_p; f != ft_end; f++)
+					bytes += f->ft_len;
 				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
 			} else {
+				/* broadcast and multicast packets are also
+				 * sent to other ports, so they are copied */
+				int swap = zcopy &&
+					ft_p->ft_dst_port < NM_BDG_BROADCAST;
+
 				howmany -= cnt;
 				do {
 					char *dst, *src = ft_p->ft_buf;
 					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
 
 					slot = &ring->slot[j];
+					bytes += copy_len;
+					if (swap && !(ft_p->ft_flags & NS_INDIRECT) &&
+					    nm_vale_swap_buf(&na->up, ft_p,
+						    &src_ring->slot[ft_p->ft_slot],
+						    slot)) {
+						slot->len = ft_p->ft_len;
+						slot->flags = (cnt << 8) |
+						    NS_MOREFRAG | NS_BUF_CHANGED;
+						j = nm_next(j, lim);
+						needed--;
+						ft_p++;
+						continue;
+					}
 					dst = NMB(&dst_na->up, slot);
 
 					ND("send [%d] %d(%d) bytes at %s:%d",
@@ -1137,11 +2479,9 @@ retry:
 					needed--;
 					ft_p++;
 				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
+				/* clear flag on last entry */
+				slot->flags &= ~NS_MOREFRAG;
 			}
-			/* are we done ? */
-			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
-				break;
 		}
 		{
 		    /* current position */
@@ -1150,6 +2490,11 @@ retry:
 		    int still_locked = 1;
 
 		    mtx_lock(&kring->q_lock);
+		    kring->nkr_bdg_stats.pkts += sent;
+		    kring->nkr_bdg_stats.bytes += bytes;
+		    pkts -= sent;
+		    sent = 0;
+		    bytes = 0;
 		    if (unlikely(howmany > 0)) {
 			/* not used all bufs. If i am the last one
 			 * i can recover the slots, otherwise must
@@ -1199,6 +2544,7 @@ retry:
 					/* XXX this is going to call nm_notify again.
 					 * Only useful for bwrap in virtual machines
 					 */
+					st->retries++;
 					goto retry;
 				}
 			}
@@ -1206,12 +2552,21 @@ retry:
 		    if (still_locked)
 			mtx_unlock(&kring->q_lock);
 		}
-cleanup:
-		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
+		/* whatever is left did not fit in the destination ring */
+		st->drop_nospace += pkts;
+	}
+	/* release the queues used in this batch */
+	for (i = 0; i < num_dsts; i++) {
+		struct nm_vale_q *d = dst_ents + dsts[i];
+
+		d->bq_head = d->bq_tail = NM_FT_NULL;
+		d->bq_key = NM_VALE_NOKEY;
 		d->bq_len = 0;
+		d->bq_pkts = 0;
 	}
 	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
 	brddst->bq_len = 0;
+	brddst->bq_pkts = 0;
 	return 0;
 }
 
@@ -1329,7 +2684,7 @@ netmap_vale_vp_create(struct nmreq_header *hdr, struct ifnet *ifp,
 		netmap_mem_private_new(
 			na->num_tx_rings, na->num_tx_desc,
 			na->num_rx_rings, na->num_rx_desc,
-			req->nr_extra_bufs, npipes, &error);
+			req->nr_extra_bufs, npipes, -1, &error);
 	if (na->nm_mem == NULL)
 		goto err;
 	na->nm_bdg_attach = netmap_vale_vp_bdg_attach;
@@ -301,6 +301,13 @@ struct netmap_ring {
 
 	struct timeval	ts;		/* (k) time of last *sync() */
 
+	/*
+	 * Offset from this structure of an array of num_slots uint64_t,
+	 * holding the receive time in nanoseconds of the packet in each
+	 * slot, 0 if the ring has no timestamps (see NR_RX_TSTAMP).
+	 */
+	const int64_t	tstamp_ofs;
+
 	/* opaque room for a mutex or similar object */
 #if !defined(_WIN32) || defined(__CYGWIN__)
 	uint8_t	__attribute__((__aligned__(NM_CACHE_ALIGN))) sem[128];
@@ -374,7 +381,19 @@ struct netmap_if {
 	const uint32_t	ni_rx_rings;	/* number of HW rx rings */
 
 	uint32_t	ni_bufs_head;	/* head index for extra bufs */
-	uint32_t	ni_spare1[5];
+	/*
+	 * Current size of the memory region. It is larger than the size
+	 * returned by the registration if the buffer pool has grown since
+	 * (see the dev.netmap.buf_grow_max sysctl); the new buffers can
+	 * only be used after mapping the region again.
+	 */
+	const uint32_t	ni_memsize;
+	/*
+	 * Offset from this structure of the buffer queue (see struct
+	 * netmap_bufq), 0 if the port was not registered with NR_BUFQ.
+	 */
+	const int64_t	ni_bufq_ofs;
+	uint32_t	ni_spare1[2];
 	/*
 	 * The following array contains the offset of each netmap ring
 	 * from this structure, in the following order:
@@ -387,6 +406,38 @@ struct netmap_if {
 	const ssize_t	ring_ofs[0];
 };
 
+/*
+ * Buffer queue, a pair of queues of buffer indices through which the
+ * application and the kernel exchange free buffers in batches, without
+ * touching the buffers themselves. It is set up on NETMAP_REQ_REGISTER
+ * with NR_BUFQ, and found through nifp->ni_bufq_ofs.
+ *
+ * The alloc queue holds the free buffers granted to the application:
+ * the buffers from nbq_alloc_head to nbq_alloc_tail (excluded) can be
+ * taken, advancing nbq_alloc_head. The free queue takes the buffers the
+ * application gives back: it writes them from nbq_free_head on, and
+ * then advances nbq_free_head. Each queue has nbq_num_slots entries, one
+ * of which is always empty.
+ *
+ * On NETMAP_REQ_BUFQ_SYNC the kernel returns the buffers in the free
+ * queue to the pool, and tops up the alloc queue to nbq_want buffers.
+ * The buffers in the queues and those taken from the alloc queue are
+ * owned by the file descriptor like the extra buffers: the kernel
+ * reclaims the former when the descriptor is closed, and the latter
+ * when the memory allocator falls out of use.
+ */
+struct netmap_bufq {
+	const uint32_t	nbq_num_slots;	/* entries of each queue */
+	uint32_t	nbq_want;	/* (u) buffers to keep in alloc queue */
+	uint32_t	nbq_alloc_head;	/* (u) next buffer to take */
+	const uint32_t	nbq_alloc_tail;	/* (k) first slot not granted */
+	uint32_t	nbq_free_head;	/* (u) next slot to fill */
+	const uint32_t	nbq_free_tail;	/* (k) first slot not reclaimed */
+	uint32_t	nbq_spare[2];
+	/* the alloc queue, then the free queue */
+	uint32_t	nbq_idx[0];
+};
+
 /* Legacy interface to interact with a netmap control device.
  * Included for backward compatibility. The user should not include this
  * file directly. */
@@ -536,6 +587,29 @@ enum {
 	NETMAP_REQ_SYNC_KLOOP_STOP,
 	/* Enable CSB mode on a registered netmap control device. */
 	NETMAP_REQ_CSB_ENABLE,
+	/* Get the configuration and statistics of the forwarding
+	 * table of a VALE switch. */
+	NETMAP_REQ_VALE_FDB_GET,
+	/* Reconfigure or flush the forwarding table of a VALE switch. */
+	NETMAP_REQ_VALE_FDB_SET,
+	/* Get the configuration of a VALE port. */
+	NETMAP_REQ_VALE_PORT_GET,
+	/* Change the configuration of a VALE port. */
+	NETMAP_REQ_VALE_PORT_SET,
+	/* Get the forwarding counters of a VALE port. */
+	NETMAP_REQ_VALE_STATS_GET,
+	/* Get the classifier rules of a VALE switch. */
+	NETMAP_REQ_VALE_RULES_GET,
+	/* Replace the classifier rules of a VALE switch. */
+	NETMAP_REQ_VALE_RULES_SET,
+	/* Change the configuration of a memory allocator. */
+	NETMAP_REQ_POOLS_CONFIG_SET,
+	/* Get the usage counters of a memory allocator. */
+	NETMAP_REQ_POOLS_STATS_GET,
+	/* Exchange buffers through the buffer queue of the bound port. */
+	NETMAP_REQ_BUFQ_SYNC,
+	/* Sync a list of rings, possibly bound to other file descriptors. */
+	NETMAP_REQ_SYNC_BATCH,
 };
 
 enum {
@@ -579,7 +653,8 @@ struct nmreq_register {
 #define NR_ZCOPY_MON	0x400
 /* request exclusive access to the selected rings */
 #define NR_EXCLUSIVE	0x800
-/* 0x1000 unused */
+/* set up the buffer queue (see struct netmap_bufq) */
+#define NR_BUFQ		0x1000
 #define NR_RX_RINGS_ONLY	0x2000
 #define NR_TX_RINGS_ONLY	0x4000
 /* Applications set this flag if they are able to deal with virtio-net headers,
@@ -592,6 +667,11 @@ struct nmreq_register {
  * NETMAP_DO_RX_POLL. */
 #define NR_DO_RX_POLL		0x10000
 #define NR_NO_TX_POLL		0x20000
+/* Store the receive time of each packet in the rx rings, see the
+ * tstamp_ofs field of struct netmap_ring. The time is taken by the NIC
+ * when the driver supports it, otherwise it is the (wall clock) time of
+ * the rxsync that made the packet visible. */
+#define NR_RX_TSTAMP		0x40000
 };
 
 /* Valid values for nmreq_register.nr_mode (see above). */
@@ -700,14 +780,25 @@ struct nmreq_vale_newif {
 /*
  * nr_reqtype: NETMAP_REQ_VALE_POLLING_ENABLE or NETMAP_REQ_VALE_POLLING_DISABLE
  * Enable or disable polling kthreads on a VALE port.
+ * With NETMAP_POLLING_ADAPTIVE the kthreads back off when they find
+ * no work (pausing, then yielding, then sleeping with the interrupts
+ * of the port enabled) and resume busy polling on the next interrupt.
+ * The thresholds are in the dev.netmap.polling_* sysctls.
+ * With NETMAP_POLLING_MODE_SHARED the rx and tx rings of the port are
+ * served, together with those of the other ports in the same mode, by
+ * a single pool of nr_num_polling_cpus kthreads bound to consecutive
+ * cores starting at nr_first_cpu_id. The first port sets the geometry
+ * of the pool, later ports must request the same one.
  */
 struct nmreq_vale_polling {
 	uint32_t	nr_mode;
 #define NETMAP_POLLING_MODE_SINGLE_CPU 1
 #define NETMAP_POLLING_MODE_MULTI_CPU 2
+#define NETMAP_POLLING_MODE_SHARED 3
 	uint32_t	nr_first_cpu_id;
 	uint32_t	nr_num_polling_cpus;
-	uint32_t	pad1;
+	uint32_t	nr_flags;
+#define NETMAP_POLLING_ADAPTIVE	0x1
 };
 
 /*
@@ -720,7 +811,10 @@ struct nmreq_vale_polling {
 struct nmreq_pools_info {
 	uint64_t	nr_memsize;
 	uint16_t	nr_mem_id; /* in/out argument */
-	uint16_t	pad1[3];
+	uint8_t		nr_hugepage_shift; /* out, see nmreq_pools_config */
+	uint8_t		pad1;
+	int16_t		nr_numa_node; /* out, node of the pools, -1 if unknown */
+	uint8_t		pad2[2];
 	uint64_t	nr_if_pool_offset;
 	uint32_t	nr_if_pool_objtotal;
 	uint32_t	nr_if_pool_objsize;
@@ -732,6 +826,119 @@ struct nmreq_pools_info {
 	uint32_t	nr_buf_pool_objsize;
 };
 
+/*
+ * nr_reqtype: NETMAP_REQ_POOLS_CONFIG_SET
+ * Configure the memory allocator nr_mem_id (1 if zero), which must not
+ * be in use. The new configuration is applied when the allocator is
+ * next used.
+ * nr_hugepage_shift selects the page size backing the buffer and ring
+ * pools: 0 for normal pages, NETMAP_HUGEPAGE_2M or NETMAP_HUGEPAGE_1G
+ * for clusters made of a single hugepage, which are mapped with large
+ * pages where supported. Ring objects are enlarged to a power of two
+ * to divide the hugepage size. Pools smaller than a hugepage, and
+ * buffer pools whose object size does not divide the hugepage size,
+ * keep using normal pages. The default for the allocators that were
+ * never configured is the dev.netmap.hugepage_shift sysctl.
+ * If NETMAP_POOLS_CONFIG_NUMA is set in nr_flags, nr_numa_node selects
+ * the NUMA node the pools are allocated on; -1 (the default) places them
+ * on the node of the first device that uses the allocator.
+ */
+struct nmreq_pools_config {
+	uint16_t	nr_mem_id;
+	uint8_t		nr_hugepage_shift;
+#define NETMAP_HUGEPAGE_2M	21
+#define NETMAP_HUGEPAGE_1G	30
+	uint8_t		nr_flags;
+#define NETMAP_POOLS_CONFIG_NUMA	0x1
+	int16_t		nr_numa_node;
+	uint8_t		pad1[2];
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_POOLS_STATS_GET
+ * Get the usage counters of the memory allocator used by the port named
+ * by hdr.nr_name, or of the allocator nr_mem_id (1 if zero) if the name
+ * is empty. The port is not registered, and the allocator is left as it
+ * is: the pools of an allocator that is not in use are empty.
+ * For each pool, nr_hiwat is the largest number of objects that
+ * were in use at the same time and nr_failures counts the allocations
+ * that could not be satisfied.
+ * nr_extra_bufs is the number of buffers handed out as extra buffers
+ * (see nmreq_register) or through buffer queues, and nr_leaked the number of buffers that were
+ * still in use when the allocator fell out of use, and that were
+ * reclaimed (e.g. buffers lost by processes that crashed).
+ * If a port is named, nr_port_ring_bufs and nr_port_extra_bufs count
+ * the buffers held by its rings and by the extra buffer lists of the
+ * file descriptors bound to it.
+ * The counters are reset when the allocator is reconfigured.
+ */
+struct nmreq_pool_stats {
+	uint32_t	nr_objtotal;
+	uint32_t	nr_objfree;
+	uint32_t	nr_hiwat;
+	uint32_t	pad1;
+	uint64_t	nr_failures;
+};
+
+struct nmreq_pools_stats {
+	uint16_t	nr_mem_id;	/* in/out argument */
+	uint16_t	pad1;
+	uint32_t	nr_users;	/* bindings using the allocator */
+	struct nmreq_pool_stats nr_if_pool;
+	struct nmreq_pool_stats nr_ring_pool;
+	struct nmreq_pool_stats nr_buf_pool;
+	uint64_t	nr_extra_bufs;
+	uint64_t	nr_leaked;
+	uint32_t	nr_port_ring_bufs;
+	uint32_t	nr_port_extra_bufs;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_BUFQ_SYNC
+ * Synchronize the buffer queue of the port bound to the file
+ * descriptor (see struct netmap_bufq). No request body.
+ * Fails with EINVAL if the port was registered without NR_BUFQ, and
+ * with ENOMEM if the alloc queue could not be topped up (the free queue
+ * is processed nevertheless).
+ */
+
+/*
+ * nr_reqtype: NETMAP_REQ_SYNC_BATCH
+ * Sync in a single system call the nr_count rings listed in the
+ * nr_entries array (at most NR_SYNC_BATCH_MAX), e.g. one ring on each
+ * of the ports of a forwarder. For each entry, nr_fd is a netmap file
+ * descriptor of the calling process on which a port is registered (-1
+ * for the one the request is issued on), nr_ring is the index of one of
+ * the rings bound to it, counted as in NETMAP_TXRING() and
+ * NETMAP_RXRING(), and nr_dir tells which one of the two.
+ * Each ring is synced as NIOCTXSYNC or NIOCRXSYNC would do, and its
+ * head and tail are returned in nr_head and nr_tail. The outcome of
+ * each entry is returned in nr_error (EBADF for an nr_fd that is not a
+ * netmap file descriptor, ENXIO if no port is registered on it, EINVAL
+ * for a ring that is not bound to it), and nr_synced counts the entries
+ * with no error. The request itself only fails if the array cannot be
+ * accessed or is too large.
+ * No hdr.nr_name is needed.
+ */
+struct nmreq_sync_entry {
+	int32_t		nr_fd;
+	uint16_t	nr_ring;
+	uint16_t	nr_dir;
+#define NR_SYNC_TX	0
+#define NR_SYNC_RX	1
+	uint32_t	nr_head;	/* out */
+	uint32_t	nr_tail;	/* out */
+	int32_t		nr_error;	/* out */
+	uint32_t	pad1;
+};
+
+struct nmreq_sync_batch {
+	uint64_t	nr_entries;	/* (struct nmreq_sync_entry *) */
+	uint32_t	nr_count;
+#define NR_SYNC_BATCH_MAX	1024
+	uint32_t	nr_synced;	/* out */
+};
+
 /*
  * nr_reqtype: NETMAP_REQ_SYNC_KLOOP_START
  * Start an in-kernel loop that syncs the rings periodically or on
@@ -748,6 +955,165 @@ struct nmreq_sync_kloop_start {
 	uint32_t	pad1;
 };
 
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_FDB_GET or NETMAP_REQ_VALE_FDB_SET
+ * Get or set the parameters of the forwarding table of the VALE
+ * switch named by hdr.nr_name (e.g. "vale0").
+ * The table has nr_buckets buckets (a power of 2) of nr_ways entries
+ * each. Entries not refreshed for nr_ageing seconds are ignored and
+ * reused (0 means no ageing). On SET, a zero nr_buckets or
+ * nr_ageing leaves the corresponding parameter unchanged, and
+ * nr_flags may ask to flush the table, clear the counters or
+ * disable ageing. Multicast groups are learned by snooping IGMP and
+ * MLD reports, and flushed together with the table.
+ * Changing nr_buckets empties the table. nr_entries, nr_groups and
+ * the counters are only filled on GET.
+ */
+struct nmreq_vale_fdb {
+	uint32_t	nr_buckets;
+	uint32_t	nr_ways;
+	uint32_t	nr_ageing;
+	uint32_t	nr_flags;
+#define NR_VALE_FDB_FLUSH		0x1
+#define NR_VALE_FDB_CLEAR_STATS		0x2
+#define NR_VALE_FDB_NO_AGEING		0x4
+	uint32_t	nr_entries;	/* active entries */
+	uint32_t	nr_groups;	/* multicast groups with members */
+	uint64_t	nr_hits;	/* unicast lookups that found the dst */
+	uint64_t	nr_misses;	/* unicast lookups that flooded */
+	uint64_t	nr_learned;	/* new addresses */
+	uint64_t	nr_evictions;	/* live entries replaced */
+	uint64_t	nr_expired;	/* entries removed by ageing */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_PORT_GET or NETMAP_REQ_VALE_PORT_SET
+ * Get or set the configuration of the VALE port named by hdr.nr_name
+ * (e.g. "vale0:v1"). With NR_VALE_PORT_RXHASH the switch spreads the
+ * unicast traffic sent to the port over its rx rings, using a hash of
+ * the addresses and ports of each flow that is the same for both
+ * directions. Otherwise, packets go to the rx ring with the same
+ * index as the tx ring they come from. Broadcast and multicast
+ * traffic always goes to ring 0.
+ * With NR_VALE_PORT_ZCOPY, unicast packets between two ports that
+ * both have the flag and use the same memory allocator (nr_mem_id)
+ * are not copied: the switch swaps the buffers of the tx and rx
+ * slots, and sets NS_BUF_CHANGED in both. The sender must then
+ * reload buf_idx before reusing a tx slot. Only virtual ports
+ * support NR_VALE_PORT_ZCOPY.
+ * With NR_VALE_PORT_FAIR, the space in the rx rings of the port is
+ * shared among the ports that send to it with deficit round robin, in
+ * proportion to their nr_weight (1 to 256, 1 by default), so that a
+ * heavy sender cannot starve the others. On SET, a nr_weight of 0
+ * leaves the weight unchanged.
+ * nr_rx_rings is only filled on GET.
+ */
+struct nmreq_vale_port {
+	uint32_t	nr_flags;
+#define NR_VALE_PORT_RXHASH		0x1
+#define NR_VALE_PORT_ZCOPY		0x2
+#define NR_VALE_PORT_FAIR		0x4
+	uint32_t	nr_rx_rings;
+	uint32_t	nr_weight;
+	uint32_t	pad1;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_STATS_GET
+ * Get the forwarding counters of tx and rx ring nr_ring_id of the VALE
+ * port named by hdr.nr_name. The counters are cumulative since the
+ * port was last put in netmap mode, and stay at zero while it is not.
+ * The tx counters describe what the switch did with the packets sent
+ * on the ring: nr_tx_pkts/nr_tx_bytes were seen, the drops are broken
+ * down by reason, nr_retries counts the times a destination ring lease
+ * had to be retried after a wraparound, and nr_bcast counts the copies
+ * of broadcast and multicast packets. The rx counters count what was
+ * delivered to the ring. nr_tx_rings and nr_rx_rings are always
+ * filled, so that a first call with nr_ring_id 0 tells how many
+ * rings there are.
+ */
+struct nmreq_vale_stats {
+	uint32_t	nr_ring_id;		/* in */
+	uint32_t	nr_tx_rings;		/* out */
+	uint32_t	nr_rx_rings;		/* out */
+	uint32_t	pad1;
+	uint64_t	nr_tx_pkts;
+	uint64_t	nr_tx_bytes;
+	uint64_t	nr_drop_lookup;		/* no destination */
+	uint64_t	nr_drop_down;		/* destination not active */
+	uint64_t	nr_drop_nospace;	/* destination ring full */
+	uint64_t	nr_retries;
+	uint64_t	nr_bcast;
+	uint64_t	nr_rx_pkts;
+	uint64_t	nr_rx_bytes;
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_RULES_GET or NETMAP_REQ_VALE_RULES_SET
+ * Get or replace the match/action rules of the VALE switch named by
+ * hdr.nr_name. nr_rules points to an array of nr_count rules. SET
+ * replaces the whole table atomically, and an empty table (nr_count 0)
+ * removes the classifier. GET copies up to nr_count rules, with their
+ * hit counters, and returns the number of rules in the table in
+ * nr_count. nr_max is the size limit of the table, always filled.
+ *
+ * Each packet is matched against the rules in order, before the
+ * forwarding table lookup, and the first rule that matches decides:
+ *   NR_VALE_ACT_LEARN	go on with the forwarding table lookup,
+ *			as if no rule had matched;
+ *   NR_VALE_ACT_FWD	send to port nr_out_port (as listed by
+ *			NETMAP_REQ_VALE_LIST) and ring nr_out_ring, or
+ *			to the usual ring if that is NR_VALE_RING_ANY;
+ *   NR_VALE_ACT_DROP	drop the packet;
+ *   NR_VALE_ACT_BCAST	send to all the other ports.
+ * A rule matches when all the fields selected by nr_fields match.
+ * The ethertype is the one after an optional 802.1Q tag. The IP fields
+ * only match IPv4 packets, and are in host byte order, as are the L4
+ * ports, which only match unfragmented TCP, UDP and SCTP packets.
+ * The source addresses are still learned for every packet.
+ * The rules are not used if a kernel module has replaced the lookup
+ * function of the switch with netmap_bdg_regops().
+ */
+struct nmreq_vale_rule {
+	uint16_t	nr_fields;
+#define NR_VALE_MATCH_IN_PORT		0x001
+#define NR_VALE_MATCH_SRC_MAC		0x002
+#define NR_VALE_MATCH_DST_MAC		0x004
+#define NR_VALE_MATCH_ETHERTYPE		0x008
+#define NR_VALE_MATCH_PROTO		0x010
+#define NR_VALE_MATCH_SRC_IP		0x020
+#define NR_VALE_MATCH_DST_IP		0x040
+#define NR_VALE_MATCH_SRC_PORT		0x080
+#define NR_VALE_MATCH_DST_PORT		0x100
+	uint16_t	nr_in_port;
+	uint16_t	nr_ethertype;
+	uint8_t		nr_proto;
+	uint8_t		nr_action;
+#define NR_VALE_ACT_LEARN		0
+#define NR_VALE_ACT_FWD			1
+#define NR_VALE_ACT_DROP		2
+#define NR_VALE_ACT_BCAST		3
+	uint8_t		nr_src_mac[6];
+	uint8_t		nr_dst_mac[6];
+	uint32_t	nr_src_ip;
+	uint32_t	nr_dst_ip;
+	uint8_t		nr_src_plen;	/* prefix length of nr_src_ip */
+	uint8_t		nr_dst_plen;	/* prefix length of nr_dst_ip */
+	uint16_t	nr_src_port;
+	uint16_t	nr_dst_port;
+	uint16_t	nr_out_port;
+	uint8_t		nr_out_ring;
+#define NR_VALE_RING_ANY		0xff
+	uint8_t		pad1[11];
+	uint64_t	nr_hits;	/* out, packets that matched */
+};
+
+struct nmreq_vale_rules {
+	uint64_t	nr_rules;	/* (struct nmreq_vale_rule *) */
+	uint32_t	nr_count;
+	uint32_t	nr_max;		/* out */
+};
+
 /* A CSB entry for the application --> kernel direction. */
 struct nm_csb_atok {
 	uint32_t head;		  /* AW+ KR+ the head of the appl netmap_ring */
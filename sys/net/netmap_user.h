@@ -113,6 +113,12 @@
 #define NETMAP_RXRING(nifp, index) _NETMAP_OFFSET(struct netmap_ring *,	\
 	nifp, (nifp)->ring_ofs[index + (nifp)->ni_tx_rings + 1] )
 
+#define NETMAP_BUFQ(nifp)	((nifp)->ni_bufq_ofs == 0 ? NULL : \
+	_NETMAP_OFFSET(struct netmap_bufq *, nifp, (nifp)->ni_bufq_ofs))
+
+#define NETMAP_RING_TSTAMPS(ring)	((ring)->tstamp_ofs == 0 ? NULL : \
+	_NETMAP_OFFSET(uint64_t *, ring, (ring)->tstamp_ofs))
+
 #define NETMAP_BUF(ring, index)				\
 	((char *)(ring) + (ring)->buf_ofs + ((index)*(ring)->nr_buf_size))
 
@@ -149,6 +155,47 @@ nm_ring_space(struct netmap_ring *ring)
         return ret;
 }
 
+/*
+ * Helpers for the buffer queue (see struct netmap_bufq). The kernel
+ * only updates the queues on NETMAP_REQ_BUFQ_SYNC.
+ */
+
+/* number of buffers that can be taken from the alloc queue */
+static inline uint32_t
+nm_bufq_avail(struct netmap_bufq *q)
+{
+	int ret = q->nbq_alloc_tail - q->nbq_alloc_head;
+	if (ret < 0)
+		ret += q->nbq_num_slots;
+	return ret;
+}
+
+/* take a buffer from the alloc queue, return 0 if it is empty */
+static inline uint32_t
+nm_bufq_get(struct netmap_bufq *q)
+{
+	uint32_t i = q->nbq_alloc_head;
+
+	if (i == q->nbq_alloc_tail)
+		return 0;
+	q->nbq_alloc_head = unlikely(i + 1 == q->nbq_num_slots) ? 0 : i + 1;
+	return q->nbq_idx[i];
+}
+
+/* give a buffer back through the free queue, return -1 if it is full */
+static inline int
+nm_bufq_put(struct netmap_bufq *q, uint32_t idx)
+{
+	uint32_t i = q->nbq_free_head;
+	uint32_t next = unlikely(i + 1 == q->nbq_num_slots) ? 0 : i + 1;
+
+	if (next == q->nbq_free_tail)
+		return -1;
+	q->nbq_idx[q->nbq_num_slots + i] = idx;
+	q->nbq_free_head = next;
+	return 0;
+}
+
 
 #ifdef NETMAP_WITH_LIBS
 /*
@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <net/if.h>
 #include <net/netmap.h>
+#include <net/netmap_user.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +45,7 @@ struct TestContext {
 
 	uint32_t nr_first_cpu_id;     /* vale polling */
 	uint32_t nr_num_polling_cpus; /* vale polling */
+	uint32_t nr_polling_flags;    /* vale polling */
 	void *csb;                    /* CSB entries (atok and ktoa) */
 	struct nmreq_option *nr_opt;  /* list of options */
 
@@ -573,6 +575,200 @@ vale_persistent_port(struct TestContext *ctx)
 	return result;
 }
 
+/* NETMAP_REQ_VALE_FDB_SET followed by NETMAP_REQ_VALE_FDB_GET, to check
+ * that the forwarding table of the switch has been reconfigured. */
+static int
+vale_fdb_set_and_get(struct TestContext *ctx)
+{
+	struct nmreq_vale_fdb req;
+	struct nmreq_header hdr;
+	int ret;
+
+	ctx->ifname  = "vale:fdb0";
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if ((ret = port_register(ctx))) {
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_FDB_SET on 'vale'\n");
+	nmreq_hdr_init(&hdr, "vale");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_FDB_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_buckets = 3000; /* rounded up to 4096 */
+	req.nr_ageing  = 60;
+	req.nr_flags   = NR_VALE_FDB_FLUSH | NR_VALE_FDB_CLEAR_STATS;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_FDB_SET)");
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_FDB_GET on 'vale'\n");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_FDB_GET;
+	memset(&req, 0, sizeof(req));
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_FDB_GET)");
+		return ret;
+	}
+	printf("nr_buckets %u nr_ways %u nr_ageing %u nr_entries %u\n",
+	       req.nr_buckets, req.nr_ways, req.nr_ageing, req.nr_entries);
+
+	return (req.nr_buckets == 4096 && req.nr_ageing == 60 &&
+	        req.nr_entries == 0) ? 0 : -1;
+}
+
+static int
+vale_port_config(struct TestContext *ctx)
+{
+	struct nmreq_vale_port req;
+	struct nmreq_header hdr;
+	int ret;
+
+	ctx->ifname  = "vale:rxh0";
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if ((ret = port_register(ctx))) {
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_PORT_SET on '%s'\n", ctx->ifname);
+	nmreq_hdr_init(&hdr, ctx->ifname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_PORT_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_flags   = NR_VALE_PORT_RXHASH | NR_VALE_PORT_ZCOPY |
+	               NR_VALE_PORT_FAIR;
+	req.nr_weight  = 4;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_PORT_SET)");
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_PORT_GET on '%s'\n", ctx->ifname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_PORT_GET;
+	memset(&req, 0, sizeof(req));
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_PORT_GET)");
+		return ret;
+	}
+	printf("nr_flags 0x%x nr_rx_rings %u nr_weight %u\n", req.nr_flags,
+	       req.nr_rx_rings, req.nr_weight);
+
+	return (req.nr_flags == (NR_VALE_PORT_RXHASH | NR_VALE_PORT_ZCOPY |
+	                         NR_VALE_PORT_FAIR) &&
+	        req.nr_rx_rings >= 1 && req.nr_weight == 4) ? 0 : -1;
+}
+
+static int
+vale_stats_get(struct TestContext *ctx)
+{
+	struct nmreq_vale_stats req;
+	struct nmreq_header hdr;
+	int ret;
+
+	ctx->ifname  = "vale:st0";
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if ((ret = port_register(ctx))) {
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_STATS_GET on '%s'\n", ctx->ifname);
+	nmreq_hdr_init(&hdr, ctx->ifname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_STATS_GET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_ring_id = 0;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_STATS_GET)");
+		return ret;
+	}
+	printf("nr_tx_rings %u nr_rx_rings %u nr_tx_pkts %llu\n",
+	       req.nr_tx_rings, req.nr_rx_rings,
+	       (unsigned long long)req.nr_tx_pkts);
+
+	return (req.nr_tx_rings >= 1 && req.nr_rx_rings >= 1 &&
+	        req.nr_tx_pkts == 0) ? 0 : -1;
+}
+
+static int
+vale_rules_set_and_get(struct TestContext *ctx)
+{
+	struct nmreq_vale_rule rules[3];
+	struct nmreq_vale_rules req;
+	struct nmreq_header hdr;
+	int ret;
+
+	ctx->ifname  = "vale:cls0";
+	ctx->nr_mode = NR_REG_ALL_NIC;
+	if ((ret = port_register(ctx))) {
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_RULES_SET on 'vale'\n");
+	memset(rules, 0, sizeof(rules));
+	/* drop telnet */
+	rules[0].nr_fields   = NR_VALE_MATCH_PROTO | NR_VALE_MATCH_DST_PORT;
+	rules[0].nr_proto    = 6;
+	rules[0].nr_dst_port = 23;
+	rules[0].nr_action   = NR_VALE_ACT_DROP;
+	/* 10.0.0.0/8 to port 0 */
+	rules[1].nr_fields   = NR_VALE_MATCH_DST_IP;
+	rules[1].nr_dst_ip   = 0x0a000000;
+	rules[1].nr_dst_plen = 8;
+	rules[1].nr_action   = NR_VALE_ACT_FWD;
+	rules[1].nr_out_port = 0;
+	rules[1].nr_out_ring = NR_VALE_RING_ANY;
+	nmreq_hdr_init(&hdr, "vale");
+	hdr.nr_reqtype = NETMAP_REQ_VALE_RULES_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_rules = (uintptr_t)rules;
+	req.nr_count = 2;
+	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_RULES_SET)");
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_VALE_RULES_GET on 'vale'\n");
+	memset(rules, 0, sizeof(rules));
+	hdr.nr_reqtype = NETMAP_REQ_VALE_RULES_GET;
+	req.nr_count   = 3;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_RULES_GET)");
+		return ret;
+	}
+	printf("nr_count %u nr_max %u\n", req.nr_count, req.nr_max);
+	if (req.nr_count != 2 || req.nr_max == 0 ||
+	    rules[0].nr_action != NR_VALE_ACT_DROP ||
+	    rules[1].nr_dst_ip != 0x0a000000) {
+		return -1;
+	}
+
+	/* an invalid prefix must be refused */
+	hdr.nr_reqtype       = NETMAP_REQ_VALE_RULES_SET;
+	rules[1].nr_dst_plen = 33;
+	req.nr_count         = 2;
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr) == 0) {
+		printf("VALE_RULES_SET accepted an invalid rule\n");
+		return -1;
+	}
+
+	/* remove the classifier */
+	req.nr_count = 0;
+	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_RULES_SET)");
+		return ret;
+	}
+	return 0;
+}
+
 /* Single NETMAP_REQ_POOLS_INFO_GET. */
 static int
 pools_info_get(struct TestContext *ctx)
@@ -604,6 +800,8 @@ pools_info_get(struct TestContext *ctx)
 	printf("nr_buf_pool_offset 0x%lx\n", req.nr_buf_pool_offset);
 	printf("nr_buf_pool_objtotal %u\n", req.nr_buf_pool_objtotal);
 	printf("nr_buf_pool_objsize %u\n", req.nr_buf_pool_objsize);
+	printf("nr_hugepage_shift %u\n", req.nr_hugepage_shift);
+	printf("nr_numa_node %d\n", req.nr_numa_node);
 
 	return req.nr_memsize && req.nr_if_pool_objtotal &&
 	                       req.nr_if_pool_objsize &&
@@ -638,6 +836,270 @@ pools_info_get_and_register(struct TestContext *ctx)
 	return pools_info_get(ctx);
 }
 
+/* NETMAP_REQ_POOLS_CONFIG_SET */
+static int
+pools_config_invalid(struct TestContext *ctx)
+{
+	struct nmreq_pools_config req;
+	struct nmreq_header hdr;
+	int ret;
+
+	printf("Testing NETMAP_REQ_POOLS_CONFIG_SET with invalid hugepages\n");
+
+	nmreq_hdr_init(&hdr, "");
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_CONFIG_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_hugepage_shift = 13; /* not a hugepage size */
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0) {
+		printf("NETMAP_REQ_POOLS_CONFIG_SET unexpectedly succeeded\n");
+		return -1;
+	}
+
+	return errno == EINVAL ? 0 : -1;
+}
+
+static int
+pools_config_invalid_numa(struct TestContext *ctx)
+{
+	struct nmreq_pools_config req;
+	struct nmreq_header hdr;
+	int ret;
+
+	printf("Testing NETMAP_REQ_POOLS_CONFIG_SET with invalid NUMA node\n");
+
+	nmreq_hdr_init(&hdr, "");
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_CONFIG_SET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_flags     = NETMAP_POOLS_CONFIG_NUMA;
+	req.nr_numa_node = 32767; /* no such node */
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret == 0) {
+		printf("NETMAP_REQ_POOLS_CONFIG_SET unexpectedly succeeded\n");
+		return -1;
+	}
+
+	return errno == EINVAL ? 0 : -1;
+}
+
+/* NETMAP_REQ_POOLS_STATS_GET on a registered port */
+static int
+pools_stats_get(struct TestContext *ctx)
+{
+	struct nmreq_pools_stats req;
+	struct nmreq_header hdr;
+	int ret;
+
+	if (port_register_hwall(ctx) != 0)
+		return -1;
+
+	printf("Testing NETMAP_REQ_POOLS_STATS_GET on '%s'\n", ctx->ifname);
+
+	nmreq_hdr_init(&hdr, ctx->ifname);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_STATS_GET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_STATS_GET)");
+		return ret;
+	}
+	printf("nr_mem_id %u\n", req.nr_mem_id);
+	printf("nr_users %u\n", req.nr_users);
+	printf("nr_buf_pool.nr_objtotal %u\n", req.nr_buf_pool.nr_objtotal);
+	printf("nr_buf_pool.nr_objfree %u\n", req.nr_buf_pool.nr_objfree);
+	printf("nr_buf_pool.nr_hiwat %u\n", req.nr_buf_pool.nr_hiwat);
+	printf("nr_port_ring_bufs %u\n", req.nr_port_ring_bufs);
+
+	if (req.nr_users == 0 || req.nr_port_ring_bufs == 0 ||
+			req.nr_buf_pool.nr_objfree > req.nr_buf_pool.nr_objtotal ||
+			req.nr_buf_pool.nr_hiwat < req.nr_port_ring_bufs) {
+		printf("Inconsistent pool counters\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* NR_BUFQ and NETMAP_REQ_BUFQ_SYNC */
+static int
+bufq_sync(struct TestContext *ctx)
+{
+	struct nmreq_register req;
+	struct nmreq_header hdr;
+	struct netmap_bufq *q;
+	uint32_t idx[4];
+	void *mem;
+	int i, ret = -1;
+
+	printf("Testing NETMAP_REQ_BUFQ_SYNC on '%s'\n", ctx->ifname);
+
+	nmreq_hdr_init(&hdr, ctx->ifname);
+	hdr.nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_mode  = NR_REG_ALL_NIC;
+	req.nr_flags = NR_BUFQ;
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr)) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, REGISTER)");
+		return -1;
+	}
+	mem = mmap(NULL, req.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	           ctx->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	q = NETMAP_BUFQ(NETMAP_IF(mem, req.nr_offset));
+	if (q == NULL) {
+		printf("No buffer queue\n");
+		goto out;
+	}
+	printf("nbq_num_slots %u\n", q->nbq_num_slots);
+
+	/* get 8 buffers, give 4 back and get them replaced */
+	hdr.nr_reqtype = NETMAP_REQ_BUFQ_SYNC;
+	hdr.nr_body    = (uintptr_t)NULL;
+	q->nbq_want    = 8;
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr)) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, BUFQ_SYNC)");
+		goto out;
+	}
+	if (nm_bufq_avail(q) != 8) {
+		printf("%u buffers in the queue, expected 8\n",
+		       nm_bufq_avail(q));
+		goto out;
+	}
+	for (i = 0; i < 4; i++) {
+		idx[i] = nm_bufq_get(q);
+		if (idx[i] < 2) {
+			printf("Invalid buffer %u\n", idx[i]);
+			goto out;
+		}
+	}
+	for (i = 0; i < 4; i++) {
+		if (nm_bufq_put(q, idx[i])) {
+			printf("Free queue full\n");
+			goto out;
+		}
+	}
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr)) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, BUFQ_SYNC)");
+		goto out;
+	}
+	if (nm_bufq_avail(q) != 8 || q->nbq_free_tail != q->nbq_free_head) {
+		printf("Buffer queue not synchronized\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	munmap(mem, req.nr_memsize);
+	return ret;
+}
+
+/* NR_RX_TSTAMP: only the rx rings get a timestamp array */
+static int
+rx_tstamp(struct TestContext *ctx)
+{
+	struct nmreq_register req;
+	struct nmreq_header hdr;
+	struct netmap_if *nifp;
+	void *mem;
+	int i, ret = -1;
+
+	printf("Testing NR_RX_TSTAMP on '%s'\n", ctx->ifname);
+
+	nmreq_hdr_init(&hdr, ctx->ifname);
+	hdr.nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_mode  = NR_REG_ALL_NIC;
+	req.nr_flags = NR_RX_TSTAMP;
+	if (ioctl(ctx->fd, NIOCCTRL, &hdr)) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, REGISTER)");
+		return -1;
+	}
+	mem = mmap(NULL, req.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	           ctx->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	nifp = NETMAP_IF(mem, req.nr_offset);
+	for (i = 0; i < (int)req.nr_rx_rings; i++) {
+		if (NETMAP_RING_TSTAMPS(NETMAP_RXRING(nifp, i)) == NULL) {
+			printf("No timestamps for rx ring %d\n", i);
+			goto out;
+		}
+	}
+	for (i = 0; i < (int)req.nr_tx_rings; i++) {
+		if (NETMAP_RING_TSTAMPS(NETMAP_TXRING(nifp, i)) != NULL) {
+			printf("Unexpected timestamps for tx ring %d\n", i);
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	munmap(mem, req.nr_memsize);
+	return ret;
+}
+
+/* NETMAP_REQ_SYNC_BATCH, with valid and invalid entries */
+static int
+sync_batch(struct TestContext *ctx)
+{
+	struct nmreq_sync_entry e[4];
+	struct nmreq_sync_batch req;
+	struct nmreq_header hdr;
+	int ret;
+
+	ret = port_register_hwall(ctx);
+	if (ret != 0) {
+		return ret;
+	}
+
+	printf("Testing NETMAP_REQ_SYNC_BATCH on '%s'\n", ctx->ifname);
+
+	memset(e, 0, sizeof(e));
+	e[0].nr_fd   = -1;
+	e[0].nr_dir  = NR_SYNC_TX;
+	e[1].nr_fd   = ctx->fd;
+	e[1].nr_dir  = NR_SYNC_RX;
+	e[2].nr_fd   = 0; /* not a netmap file descriptor */
+	e[2].nr_dir  = NR_SYNC_TX;
+	e[3].nr_fd   = ctx->fd;
+	e[3].nr_ring = ctx->nr_rx_rings + 1; /* not bound */
+	e[3].nr_dir  = NR_SYNC_RX;
+
+	nmreq_hdr_init(&hdr, "");
+	hdr.nr_reqtype = NETMAP_REQ_SYNC_BATCH;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_entries = (uintptr_t)e;
+	req.nr_count   = 4;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, SYNC_BATCH)");
+		return ret;
+	}
+	printf("nr_synced %u\n", req.nr_synced);
+	printf("nr_error %d %d %d %d\n", e[0].nr_error, e[1].nr_error,
+	       e[2].nr_error, e[3].nr_error);
+	if (req.nr_synced != 2 || e[0].nr_error || e[1].nr_error ||
+	    e[2].nr_error != EBADF || e[3].nr_error != EINVAL) {
+		return -1;
+	}
+	if (e[0].nr_tail >= ctx->nr_tx_slots ||
+	    e[1].nr_tail >= ctx->nr_rx_slots) {
+		printf("Invalid tail %u %u\n", e[0].nr_tail, e[1].nr_tail);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 pools_info_get_empty_ifname(struct TestContext *ctx)
 {
@@ -718,6 +1180,7 @@ vale_polling_enable(struct TestContext *ctx)
 	req.nr_mode             = ctx->nr_mode;
 	req.nr_first_cpu_id     = ctx->nr_first_cpu_id;
 	req.nr_num_polling_cpus = ctx->nr_num_polling_cpus;
+	req.nr_flags            = ctx->nr_polling_flags;
 	ret                     = ioctl(ctx->fd, NIOCCTRL, &hdr);
 	if (ret) {
 		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_POLLING_ENABLE)");
@@ -757,7 +1220,7 @@ vale_polling_disable(struct TestContext *ctx)
 }
 
 static int
-vale_polling_enable_disable(struct TestContext *ctx)
+vale_polling_mode_enable_disable(struct TestContext *ctx, uint32_t mode)
 {
 	int ret = 0;
 
@@ -765,7 +1228,7 @@ vale_polling_enable_disable(struct TestContext *ctx)
 		return ret;
 	}
 
-	ctx->nr_mode             = NETMAP_POLLING_MODE_SINGLE_CPU;
+	ctx->nr_mode             = mode;
 	ctx->nr_num_polling_cpus = 1;
 	ctx->nr_first_cpu_id     = 0;
 	if ((ret = vale_polling_enable(ctx))) {
@@ -787,6 +1250,27 @@ vale_polling_enable_disable(struct TestContext *ctx)
 	return vale_detach(ctx);
 }
 
+static int
+vale_polling_enable_disable(struct TestContext *ctx)
+{
+	return vale_polling_mode_enable_disable(ctx,
+	                                        NETMAP_POLLING_MODE_SINGLE_CPU);
+}
+
+static int
+vale_polling_adaptive(struct TestContext *ctx)
+{
+	ctx->nr_polling_flags = NETMAP_POLLING_ADAPTIVE;
+	return vale_polling_enable_disable(ctx);
+}
+
+static int
+vale_polling_shared(struct TestContext *ctx)
+{
+	return vale_polling_mode_enable_disable(ctx,
+	                                        NETMAP_POLLING_MODE_SHARED);
+}
+
 static void
 push_option(struct nmreq_option *opt, struct TestContext *ctx)
 {
@@ -1505,13 +1989,25 @@ static struct mytest tests[] = {
 	decltest(vale_attach_detach_host_rings),
 	decltest(vale_ephemeral_port_hdr_manipulation),
 	decltest(vale_persistent_port),
+	decltest(vale_fdb_set_and_get),
+	decltest(vale_port_config),
+	decltest(vale_stats_get),
+	decltest(vale_rules_set_and_get),
 	decltest(pools_info_get_and_register),
 	decltest(pools_info_get_empty_ifname),
+	decltest(pools_config_invalid),
+	decltest(pools_config_invalid_numa),
+	decltest(pools_stats_get),
+	decltest(bufq_sync),
+	decltest(rx_tstamp),
+	decltest(sync_batch),
 	decltest(pipe_master),
 	decltest(pipe_slave),
 	decltest(pipe_port_info_get),
 	decltest(pipe_pools_info_get),
 	decltest(vale_polling_enable_disable),
+	decltest(vale_polling_adaptive),
+	decltest(vale_polling_shared),
 	decltest(unsupported_option),
 	decltest(infinite_options),
 #ifdef CONFIG_NETMAP_EXTMEM